@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include "Tracing.h"
+
+constexpr int BEAM_SIZE = 8; // Pixels per side of the screen blocks whose primary rays share a start distance
+constexpr int BEAM_MAX_STEPS = 48; // A beam keeps the distance it reached after this many steps
+constexpr int32_t BEAM_MAX_CHUNKS = 27; // A step that would have to look at more chunks than this counts as blocked
+
+// True if no brick in the box holds anything. Chunks that are not loaded count as empty and get requested, the same as for a ray.
+static bool beam_box_empty(const World& world, const float lo[3], const float hi[3]) {
+	int32_t v0[3], v1[3], c0[3], c1[3];
+	for (int i = 0; i < 3; i++) {
+		v0[i] = fastfloor(lo[i]);
+		v1[i] = fastfloor(hi[i]);
+		c0[i] = v0[i] >> CHUNK_SHIFT;
+		c1[i] = v1[i] >> CHUNK_SHIFT;
+	}
+	if ((c1[0] - c0[0] + 1) * (c1[1] - c0[1] + 1) * (c1[2] - c0[2] + 1) > BEAM_MAX_CHUNKS) { return false; }
+
+	for (int32_t cz = c0[2]; cz <= c1[2]; cz++) {
+		for (int32_t cy = c0[1]; cy <= c1[1]; cy++) {
+			for (int32_t cx = c0[0]; cx <= c1[0]; cx++) {
+				const Chunk* chunk = world.find_chunk(cx, cy, cz);
+				if (chunk == nullptr) {
+					world.request_chunk(cx, cy, cz);
+					continue;
+				}
+				if (chunk->is_empty()) { continue; }
+				// Part of the box inside this chunk, in local voxels
+				const int32_t base[3]{ cx << CHUNK_SHIFT, cy << CHUNK_SHIFT, cz << CHUNK_SHIFT };
+				int32_t l0[3], l1[3];
+				for (int i = 0; i < 3; i++) {
+					l0[i] = std::max(v0[i] - base[i], 0) & ~(BRICK_WIDTH - 1);
+					l1[i] = std::min(v1[i] - base[i], CHUNK_WIDTH - 1);
+				}
+				for (int32_t z = l0[2]; z <= l1[2]; z += BRICK_WIDTH) {
+					for (int32_t y = l0[1]; y <= l1[1]; y += BRICK_WIDTH) {
+						for (int32_t x = l0[0]; x <= l1[0]; x += BRICK_WIDTH) {
+							if (!chunk->is_brick_empty(x, y, z)) { return false; }
+						}
+					}
+				}
+			}
+		}
+	}
+	return true;
+}
+
+// Distance along every camera ray through the screen rectangle [s0, s1] x [t0, t1] before which nothing can be hit, so the rays can start
+// there instead of stepping through the same air as their neighbours. Marches a cone around those rays through the chunk and brick
+// occupancy with steps that grow while they stay empty. Every box it checks is padded by the widest cell a ray may use at that distance
+// with the footprint, so all cells a ray would have visited before the start are known to be empty.
+static float beam_start(const World& world, const Camera& cam, float s0, float t0, float s1, float t1, float footprint) {
+	const vec3 axis = unit_vector(cam.get_ray((s0 + s1) * 0.5f, (t0 + t1) * 0.5f).direction);
+	float cosAngle = 1.0f;
+	const float corners[4][2]{ { s0, t0 }, { s1, t0 }, { s0, t1 }, { s1, t1 } };
+	for (const float* corner : corners) { cosAngle = std::min(cosAngle, dot(axis, unit_vector(cam.get_ray(corner[0], corner[1]).direction))); }
+	const float spread = std::sqrt(std::max(2.0f - 2.0f * cosAngle, 0.0f)) * 1.001f; // A ray is at most u * spread from the axis at distance u
+
+	const vec3& origin = cam.position;
+	float u = 0.0f, h = static_cast<float>(BRICK_WIDTH);
+	for (int n = 0; n < BEAM_MAX_STEPS && u < MAX_CHUNK_DISTANCE; n++) {
+		const float next = std::min(u + h, static_cast<float>(MAX_CHUNK_DISTANCE));
+		const float reach = next * spread + static_cast<float>(1 << lod_level(next, footprint));
+		float lo[3], hi[3];
+		for (int i = 0; i < 3; i++) {
+			const float a = origin[i] + axis[i] * u, b = origin[i] + axis[i] * next;
+			lo[i] = std::min(a, b) - reach;
+			hi[i] = std::max(a, b) + reach;
+		}
+		if (beam_box_empty(world, lo, hi)) {
+			u = next;
+			h = std::min(h * 2.0f, static_cast<float>(CHUNK_WIDTH));
+		} else if (h > BRICK_WIDTH) {
+			h = std::max(h * 0.5f, static_cast<float>(BRICK_WIDTH));
+		} else {
+			break;
+		}
+	}
+	return u;
+}
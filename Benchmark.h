@@ -0,0 +1,532 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+#include "Renderer.h"
+#include "RegionFile.h"
+#include "Resolve.h"
+#include "TerrainGenerator.h"
+
+constexpr int BENCHMARK_CHUNKS_XZ = 8; // Scenes are 8x4x8 chunks, 128x64x128 voxels
+constexpr int BENCHMARK_CHUNKS_Y = 4;
+constexpr int BENCHMARK_SIZE_XZ = BENCHMARK_CHUNKS_XZ * CHUNK_WIDTH;
+constexpr int BENCHMARK_SIZE_Y = BENCHMARK_CHUNKS_Y * CHUNK_WIDTH;
+
+// Settings for the benchmark run, everything that shapes the workload is part of the JSON so runs can be told apart
+struct BenchmarkSettings {
+	int width = 320, height = 240;
+	int frames = 30; // Length of every camera path
+	int rays = 100000; // Rays per scene for the trace() and shadow() stages
+	int lookups = 4000000; // World::get_voxel calls per scene
+	int threads = 0; // Used for the frame stage, 0 uses every hardware thread
+	uint64_t seed = 1;
+	const char* scene = nullptr; // Only run the scene with this name
+	const char* output = "benchmark.json";
+	const char* baseline = nullptr; // Compare against this earlier output
+	float tolerance = 5.0f; // Percent a metric may get worse before it counts as a regression
+};
+
+// A fixed scene and the camera path that flies through it
+struct BenchmarkScene {
+	const char* name;
+	void (*build)(World& world, uint64_t seed);
+	void (*path)(int frame, int frames, vec3& position, vec3& direction);
+};
+
+// Metrics in the order they were measured, named <scene>.<stage>.<unit>
+struct BenchmarkResults {
+	std::vector<std::pair<std::string, double>> metrics;
+
+	void add(const std::string& name, double value) { metrics.push_back({ name, value }); }
+
+	const double* find(const std::string& name) const {
+		for (const auto& m : metrics) { if (m.first == name) { return &m.second; } }
+		return nullptr;
+	}
+};
+
+static volatile float benchmarkSink = 0.0f; // Keeps the traced colors from being optimised away
+
+static inline uint64_t benchmarkHash(uint64_t seed, uint64_t a, uint64_t b = 0, uint64_t c = 0) { return hash64(seed ^ hash64(a ^ hash64(b ^ hash64(c)))); }
+
+// Smooth value noise on a grid with the given cell size
+static float benchmarkNoise(uint64_t seed, int x, int z, int cell) {
+	const int gx = x / cell, gz = z / cell;
+	float fx = static_cast<float>(x % cell) / cell, fz = static_cast<float>(z % cell) / cell;
+	fx = fx * fx * (3.0f - 2.0f * fx);
+	fz = fz * fz * (3.0f - 2.0f * fz);
+	auto corner = [seed, cell](int cx, int cz) { return hashToFloat(benchmarkHash(seed, static_cast<uint64_t>(cx), static_cast<uint64_t>(cz), static_cast<uint64_t>(cell))); };
+	const float a = corner(gx, gz) + (corner(gx + 1, gz) - corner(gx, gz)) * fx;
+	const float b = corner(gx, gz + 1) + (corner(gx + 1, gz + 1) - corner(gx, gz + 1)) * fx;
+	return a + (b - a) * fz;
+}
+
+static int benchmarkHeight(uint64_t seed, int x, int z) { return 6 + static_cast<int>(30.0f * benchmarkNoise(seed, x, z, 32) + 10.0f * benchmarkNoise(seed, x, z, 8)); }
+
+// Fills every chunk of the scene volume from a voxel function and publishes it
+template <typename F>
+static void buildBenchmarkScene(World& world, F voxel) {
+	std::vector<uint32_t> values(CHUNK_SIZE);
+	for (int cz = 0; cz < BENCHMARK_CHUNKS_XZ; cz++) {
+		for (int cy = 0; cy < BENCHMARK_CHUNKS_Y; cy++) {
+			for (int cx = 0; cx < BENCHMARK_CHUNKS_XZ; cx++) {
+				for (int z = 0; z < CHUNK_WIDTH; z++) {
+					for (int y = 0; y < CHUNK_WIDTH; y++) {
+						for (int x = 0; x < CHUNK_WIDTH; x++) { values[voxel_index(x, y, z)] = voxel(cx * CHUNK_WIDTH + x, cy * CHUNK_WIDTH + y, cz * CHUNK_WIDTH + z); }
+					}
+				}
+				Chunk chunk;
+				chunk.allocate({ cx, cy, cz });
+				chunk.load(values.data());
+				world.publish_chunk(chunk);
+			}
+		}
+	}
+}
+
+// Rolling hills, grass on top of dirt on top of stone
+static void buildDenseScene(World& world, uint64_t seed) {
+	buildBenchmarkScene(world, [seed](int x, int y, int z) -> uint32_t {
+		const int h = benchmarkHeight(seed, x, z);
+		if (y > h) { return 0; }
+		return y == h ? 3 : (y > h - 4 ? 2 : 1);
+	});
+}
+
+// A floor and a few floating voxels, mostly empty space
+static void buildSparseScene(World& world, uint64_t seed) {
+	buildBenchmarkScene(world, [seed](int x, int y, int z) -> uint32_t {
+		if (y == 0) { return 1; }
+		return hashToFloat(benchmarkHash(seed, x, y, z)) < 0.002f ? 2 : 0;
+	});
+}
+
+// The dense hills with a mirror like surface, so most primary hits bounce
+static void buildReflectiveScene(World& world, uint64_t seed) {
+	world.materials[3] = Material(REFLECTIVE, { 0.8f, 0.8f, 0.9f }, 0.0f, 0.8f);
+	buildDenseScene(world, seed);
+}
+
+// One voxel in the corner of every brick, no brick can be skipped so diagonal rays step through every voxel
+static void buildDiagonalScene(World& world, uint64_t /*seed*/) {
+	buildBenchmarkScene(world, [](int x, int y, int z) -> uint32_t { return (x & (BRICK_WIDTH - 1)) == 0 && (y & (BRICK_WIDTH - 1)) == 0 && (z & (BRICK_WIDTH - 1)) == 0 ? 1 : 0; });
+}
+
+// Circles the scene looking at its centre from above
+static void orbitPath(int frame, int frames, vec3& position, vec3& direction) {
+	const float angle = 6.2831853f * frame / frames;
+	const vec3 center(BENCHMARK_SIZE_XZ * 0.5f, 20.0f, BENCHMARK_SIZE_XZ * 0.5f);
+	position = center + vec3(std::cos(angle) * 70.0f, 30.0f, std::sin(angle) * 70.0f);
+	direction = center - position;
+}
+
+// Flies along the space diagonal from the scene's corner
+static void diagonalPath(int frame, int frames, vec3& position, vec3& direction) {
+	position = vec3(1.5f, 1.25f, 2.75f) + vec3(1.0f, 0.5f, 1.0f) * (20.0f * frame / frames);
+	direction = vec3(1.0f, 0.9f, 1.0f);
+}
+
+static const BenchmarkScene benchmarkScenes[] = {
+	{ "dense", buildDenseScene, orbitPath },
+	{ "sparse", buildSparseScene, orbitPath },
+	{ "reflective", buildReflectiveScene, orbitPath },
+	{ "diagonal", buildDiagonalScene, diagonalPath }
+};
+
+static uint64_t peakMemoryBytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) { return counters.PeakWorkingSetSize; }
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) { return 0; }
+#ifdef __APPLE__
+	return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+	return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+static inline double benchmarkSeconds(std::chrono::steady_clock::time_point start) { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); }
+
+static double percentile(std::vector<double> values, double p) {
+	if (values.empty()) { return 0.0; }
+	std::sort(values.begin(), values.end());
+	return values[static_cast<size_t>(std::ceil(p * (values.size() - 1)))];
+}
+
+static void setBenchmarkCamera(const BenchmarkScene& scene, int frame, int frames, Camera& cam) {
+	vec3 direction;
+	scene.path(frame, frames, cam.position, direction);
+	cam.prepare(direction);
+}
+
+static void runBenchmarkScene(const BenchmarkScene& scene, const BenchmarkSettings& settings, BenchmarkResults& results) {
+	const std::string prefix = std::string(scene.name) + ".";
+	std::unique_ptr<World> world(new World());
+	init_default_materials(*world);
+	world->set_memory_budget(~static_cast<size_t>(0));
+	scene.build(*world, settings.seed);
+	Camera cam({ 0, 1, 0 }, 50.0f, static_cast<float>(settings.width) / static_cast<float>(settings.height), 0.1f, 10.0f);
+
+	{// World::get_voxel at random positions inside the scene
+		uint64_t solid = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < settings.lookups; i++) {
+			const uint64_t h = benchmarkHash(settings.seed, 1, i);
+			solid += world->get_voxel(static_cast<long>(h % BENCHMARK_SIZE_XZ), static_cast<long>((h >> 16) % BENCHMARK_SIZE_Y), static_cast<long>((h >> 32) % BENCHMARK_SIZE_XZ)) != 0;
+		}
+		const double seconds = benchmarkSeconds(start);
+		results.add(prefix + "get_voxel.lookups_per_sec", settings.lookups / seconds);
+		results.add(prefix + "get_voxel.solid_count", static_cast<double>(solid));
+	}
+
+	{// trace() with one bounce, rays spread over the camera path
+		const int perFrame = std::max(1, settings.rays / settings.frames);
+		uint64_t steps = threadCounters.steps, rays = 0;
+		float sink = 0.0f;
+		auto start = std::chrono::steady_clock::now();
+		for (int f = 0; f < settings.frames; f++) {
+			setBenchmarkCamera(scene, f, settings.frames, cam);
+			for (int i = 0; i < perFrame; i++) {
+				const uint64_t h = benchmarkHash(settings.seed, 2, f, i);
+				float depth = 0;
+				vec3 color = trace(cam.position, cam.get_ray(hashToFloat(h), hashToFloat(hash64(h))), *world, 2, 2, depth);
+				sink += color[0];
+				rays++;
+			}
+		}
+		const double seconds = benchmarkSeconds(start);
+		results.add(prefix + "trace.rays_per_sec", rays / seconds);
+		results.add(prefix + "trace.steps_per_sec", (threadCounters.steps - steps) / seconds);
+		benchmarkSink = sink;
+	}
+
+	{// shadow() from random empty voxels towards the sun
+		uint64_t steps = threadCounters.steps, occluded = 0;
+		std::vector<vec3> origins;
+		origins.reserve(settings.rays);
+		for (uint64_t i = 0; origins.size() < static_cast<size_t>(settings.rays) && i < static_cast<uint64_t>(settings.rays) * 16; i++) {
+			const uint64_t h = benchmarkHash(settings.seed, 3, i);
+			vec3 p(hashToFloat(h) * BENCHMARK_SIZE_XZ, hashToFloat(hash64(h)) * BENCHMARK_SIZE_Y, hashToFloat(hash64(h + 1)) * BENCHMARK_SIZE_XZ);
+			if (world->get_voxel(fastfloor(p[0]), fastfloor(p[1]), fastfloor(p[2])) == 0) { origins.push_back(p); }
+		}
+		auto start = std::chrono::steady_clock::now();
+		for (const vec3& p : origins) { occluded += shadow(p, *world); }
+		const double seconds = benchmarkSeconds(start);
+		results.add(prefix + "shadow.rays_per_sec", origins.size() / seconds);
+		results.add(prefix + "shadow.steps_per_sec", (threadCounters.steps - steps) / seconds);
+		results.add(prefix + "shadow.occluded_count", static_cast<double>(occluded));
+	}
+
+	// Full frames along the camera path, every frame moves so nothing accumulates
+	auto frames = [&](const char* stage, bool wavefront, bool temporal, float lodBias, bool beam) {
+		Renderer renderer;
+		renderer.scheduler.setThreads(settings.threads);
+		renderer.wavefront = wavefront;
+		renderer.temporalReuse = temporal;
+		renderer.lodBias = lodBias;
+		renderer.beamPrepass = beam;
+		Framebuffer frame(settings.width, settings.height);
+		std::vector<double> times;
+		uint64_t samples = 0, reused = 0;
+		double total = 0.0;
+		for (int f = 0; f < settings.frames; f++) {
+			setBenchmarkCamera(scene, f, settings.frames, cam);
+			auto start = std::chrono::steady_clock::now();
+			renderer.render(*world, cam, frame, 1);
+			const double seconds = benchmarkSeconds(start);
+			times.push_back(seconds * 1000.0);
+			total += seconds;
+			samples += renderer.lastSampleCount;
+			reused += renderer.lastReusedCount;
+		}
+		results.add(prefix + stage + ".rays_per_sec", samples / total);
+		results.add(prefix + stage + ".p50_ms", percentile(times, 0.5));
+		results.add(prefix + stage + ".p99_ms", percentile(times, 0.99));
+		if (temporal) { results.add(prefix + stage + ".reused_fraction", static_cast<double>(reused) / (static_cast<double>(settings.width) * settings.height * settings.frames)); }
+	};
+	frames("frame", false, false, 0.0f, true);
+	frames("wavefront", true, false, 0.0f, true);
+	frames("temporal", false, true, 0.0f, true);
+	frames("lod", false, false, 4.0f, true); // Coarse cells up to 4 pixels wide, so the benchmark resolution reaches them within the render distance
+	frames("no_beam", false, false, 0.0f, false); // The frame stage with every primary ray starting at the camera
+
+	{// Saves the whole scene as region files in the temp directory, then loads every chunk back from them
+		std::error_code error;
+		const std::filesystem::path directory = std::filesystem::temp_directory_path(error) / (std::string("voxeltracer_benchmark_") + scene.name);
+		std::filesystem::remove_all(directory, error);
+		RegionStore store(directory.string());
+		if (store.open()) {
+			auto start = std::chrono::steady_clock::now();
+			store.save(*world, true);
+			const double saveSeconds = benchmarkSeconds(start);
+
+			uint64_t loaded = 0, solid = 0;
+			start = std::chrono::steady_clock::now();
+			for (int cz = 0; cz < BENCHMARK_CHUNKS_XZ; cz++) {
+				for (int cy = 0; cy < BENCHMARK_CHUNKS_Y; cy++) {
+					for (int cx = 0; cx < BENCHMARK_CHUNKS_XZ; cx++) {
+						Chunk chunk;
+						if (!store.load({ cx, cy, cz }, chunk)) { continue; }
+						loaded++;
+						solid += chunk[voxel_index(7, 7, 7)] != 0; // Touches the voxels, so the time includes faulting them in
+					}
+				}
+			}
+			const double loadSeconds = benchmarkSeconds(start);
+			uint64_t fileBytes = 0;
+			for (const auto& file : std::filesystem::directory_iterator(directory, error)) { fileBytes += file.file_size(error); }
+			results.add(prefix + "region.save_chunks_per_sec", store.chunksSaved / saveSeconds);
+			results.add(prefix + "region.load_chunks_per_sec", loaded / loadSeconds);
+			results.add(prefix + "region.file_bytes", static_cast<double>(fileBytes));
+			results.add(prefix + "region.loaded_count", static_cast<double>(loaded));
+			benchmarkSink = static_cast<float>(solid);
+		}
+		std::filesystem::remove_all(directory, error);
+	}
+
+	{// Small craters and single voxels queued like a simulation would, applied at the frame boundary a batch at a time
+		constexpr int rounds = 16, editsPerRound = 1000;
+		uint64_t voxels = 0, chunks = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < rounds; r++) {
+			for (int i = 0; i < editsPerRound; i++) {
+				const uint64_t h = benchmarkHash(settings.seed, 2, r, i);
+				const long x = static_cast<long>(h % BENCHMARK_SIZE_XZ), y = static_cast<long>((h >> 16) % BENCHMARK_SIZE_Y), z = static_cast<long>((h >> 32) % BENCHMARK_SIZE_XZ);
+				if (i % 16 == 0) { world->queue_sphere(vec3(static_cast<float>(x), static_cast<float>(y), static_cast<float>(z)), 2.0f + ((h >> 48) & 3), 0); }
+				else { world->queue_voxel(x, y, z, static_cast<uint32_t>((h >> 48) & 3)); }
+			}
+			world->apply_edits();
+			const EditStats stats = world->get_edit_stats();
+			voxels += stats.voxels;
+			chunks += stats.chunks;
+		}
+		const double seconds = benchmarkSeconds(start);
+		results.add(prefix + "edit.edits_per_sec", static_cast<double>(rounds) * editsPerRound / seconds);
+		results.add(prefix + "edit.voxels_per_sec", voxels / seconds);
+		results.add(prefix + "edit.chunks_per_round", static_cast<double>(chunks) / rounds);
+	}
+
+	results.add(prefix + "world.resident_bytes", static_cast<double>(world->get_residency_stats().residentBytes));
+}
+
+static bool writeBenchmarkJson(const BenchmarkSettings& settings, const BenchmarkResults& results) {
+	FILE* file = fopen(settings.output, "w");
+	if (file == nullptr) {
+		printf_s("Could not open %s for writing\n", settings.output);
+		return false;
+	}
+	fprintf(file, "{\n  \"seed\": %llu,\n  \"width\": %d,\n  \"height\": %d,\n  \"frames\": %d,\n  \"rays\": %d,\n  \"lookups\": %d,\n  \"metrics\": {\n",
+		static_cast<unsigned long long>(settings.seed), settings.width, settings.height, settings.frames, settings.rays, settings.lookups);
+	for (size_t i = 0; i < results.metrics.size(); i++) {
+		fprintf(file, "    \"%s\": %.9g%s\n", results.metrics[i].first.c_str(), results.metrics[i].second, i + 1 < results.metrics.size() ? "," : "");
+	}
+	fprintf(file, "  }\n}\n");
+	fclose(file);
+	return true;
+}
+
+// Reads the metrics object of a file written by writeBenchmarkJson
+static bool readBenchmarkJson(const char* filename, BenchmarkResults& results) {
+	FILE* file = fopen(filename, "rb");
+	if (file == nullptr) { return false; }
+	std::string text;
+	char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) { text.append(buffer, n); }
+	fclose(file);
+
+	size_t pos = text.find("\"metrics\"");
+	if (pos == std::string::npos || (pos = text.find('{', pos)) == std::string::npos) { return false; }
+	while (true) {
+		const size_t keyStart = text.find_first_of("\"}", pos + 1);
+		if (keyStart == std::string::npos || text[keyStart] == '}') { break; }
+		const size_t keyEnd = text.find('"', keyStart + 1);
+		const size_t colon = keyEnd == std::string::npos ? std::string::npos : text.find(':', keyEnd);
+		if (colon == std::string::npos) { return false; }
+		char* end = nullptr;
+		const double value = strtod(text.c_str() + colon + 1, &end);
+		results.add(text.substr(keyStart + 1, keyEnd - keyStart - 1), value);
+		pos = static_cast<size_t>(end - text.c_str());
+	}
+	return true;
+}
+
+// Rates end in _per_sec and should go up, times and sizes should go down, counts describe the workload and should not change at all.
+// Returns the number of regressions.
+static int compareBenchmarks(const BenchmarkResults& baseline, const BenchmarkResults& current, float tolerance) {
+	auto endsWith = [](const std::string& s, const char* suffix) { const size_t n = strlen(suffix); return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0; };
+	int regressions = 0;
+	printf_s("%-40s %16s %16s %9s\n", "metric", "baseline", "current", "change");
+	for (const auto& m : current.metrics) {
+		const double* old = baseline.find(m.first);
+		if (old == nullptr) {
+			printf_s("%-40s %16s %16.4g %9s\n", m.first.c_str(), "-", m.second, "new");
+			continue;
+		}
+		const double change = *old != 0.0 ? (m.second - *old) / *old * 100.0 : 0.0;
+		const char* verdict = "";
+		if (endsWith(m.first, "_count")) {
+			if (m.second != *old) { verdict = "CHANGED (workload differs)"; }
+		} else {
+			const bool higherIsBetter = endsWith(m.first, "_per_sec");
+			const double worse = higherIsBetter ? -change : change;
+			if (worse > tolerance) {
+				verdict = "REGRESSION";
+				regressions++;
+			} else if (-worse > tolerance) {
+				verdict = "improved";
+			}
+		}
+		printf_s("%-40s %16.4g %16.4g %+8.1f%% %s\n", m.first.c_str(), *old, m.second, change, verdict);
+	}
+	printf_s("%d regression%s beyond %.1f%%\n", regressions, regressions == 1 ? "" : "s", tolerance);
+	return regressions;
+}
+
+static void printBenchmarkUsage() {
+	printf_s("Usage: VoxelTracer --benchmark [--width W] [--height H] [--frames N] [--rays N] [--lookups N] [--threads T] [--seed S] [--scene NAME] [--out FILE] [--compare BASELINE] [--tolerance PERCENT]\n");
+}
+
+// Returns false if the arguments could not be parsed
+static bool parseBenchmarkArguments(int argc, char* argv[], BenchmarkSettings& settings) {
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+		if (strcmp(arg, "--benchmark") == 0) { continue; }
+		else if (strcmp(arg, "--width") == 0 && hasValue) { settings.width = atoi(argv[++i]); }
+		else if (strcmp(arg, "--height") == 0 && hasValue) { settings.height = atoi(argv[++i]); }
+		else if (strcmp(arg, "--frames") == 0 && hasValue) { settings.frames = atoi(argv[++i]); }
+		else if (strcmp(arg, "--rays") == 0 && hasValue) { settings.rays = atoi(argv[++i]); }
+		else if (strcmp(arg, "--lookups") == 0 && hasValue) { settings.lookups = atoi(argv[++i]); }
+		else if (strcmp(arg, "--threads") == 0 && hasValue) { settings.threads = atoi(argv[++i]); }
+		else if (strcmp(arg, "--seed") == 0 && hasValue) { settings.seed = strtoull(argv[++i], nullptr, 10); }
+		else if (strcmp(arg, "--scene") == 0 && hasValue) { settings.scene = argv[++i]; }
+		else if (strcmp(arg, "--out") == 0 && hasValue) { settings.output = argv[++i]; }
+		else if (strcmp(arg, "--compare") == 0 && hasValue) { settings.baseline = argv[++i]; }
+		else if (strcmp(arg, "--tolerance") == 0 && hasValue) { settings.tolerance = static_cast<float>(atof(argv[++i])); }
+		else {
+			printf_s("Unknown or incomplete argument: %s\n", arg);
+			return false;
+		}
+	}
+	return settings.width > 0 && settings.height > 0 && settings.frames > 0 && settings.rays > 0 && settings.lookups > 0 && settings.threads >= 0 && settings.tolerance >= 0.0f;
+}
+
+static bool isBenchmark(int argc, char* argv[]) {
+	for (int i = 1; i < argc; i++) { if (strcmp(argv[i], "--benchmark") == 0) { return true; } }
+	return false;
+}
+
+// Resolves a fixed 1080p image of colours between 0 and 2, once like the window does by default and once tone mapped into sRGB
+static void runResolveBenchmark(const BenchmarkSettings& settings, BenchmarkResults& results) {
+	constexpr int width = 1920, height = 1080, rounds = 20;
+	std::vector<vec3> image(static_cast<size_t>(width) * height);
+	for (size_t i = 0; i < image.size(); i++) {
+		const uint64_t h = benchmarkHash(settings.seed, i);
+		image[i] = vec3((h & 0xFFFF) / 32768.0f, ((h >> 16) & 0xFFFF) / 32768.0f, ((h >> 32) & 0xFFFF) / 32768.0f);
+	}
+	std::vector<uint32_t> pixels(image.size());
+	TileScheduler scheduler(settings.threads);
+	auto measure = [&](const char* name, const ResolveSettings& resolveSettings) {
+		const PixelLayout layout;
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < rounds; r++) { resolve(image.data(), width, height, pixels.data(), width * 4, layout, resolveSettings, scheduler); }
+		results.add(std::string("resolve.") + name + "_pixels_per_sec", static_cast<double>(image.size()) * rounds / benchmarkSeconds(start));
+		benchmarkSink = static_cast<float>(pixels[pixels.size() / 2] & 0xFF);
+	};
+	measure("linear", ResolveSettings());
+	ResolveSettings tonemapped;
+	tonemapped.toneMap = TONEMAP_ACES;
+	tonemapped.srgb = true;
+	measure("aces_srgb", tonemapped);
+}
+
+// Generates a block of chunks around the surface with caves below it, once on a single thread and once on all of them.
+// The single thread rate is what one streaming thread keeps up with, the other one how much the cores scale.
+static void runTerrainBenchmark(const BenchmarkSettings& settings, BenchmarkResults& results) {
+	TerrainSettings terrainSettings;
+	terrainSettings.seed = settings.seed;
+	const TerrainGenerator generator(terrainSettings);
+	std::vector<ChunkLocation> locs;
+	for (int cz = -12; cz < 12; cz++) {
+		for (int cy = -2; cy < 4; cy++) {
+			for (int cx = -12; cx < 12; cx++) { locs.push_back({ cx, cy, cz }); }
+		}
+	}
+	std::vector<Chunk> chunks;
+	TileScheduler single(1), scheduler(settings.threads);
+	auto start = std::chrono::steady_clock::now();
+	generator.generate_chunks(locs, chunks, single);
+	results.add("terrain.chunks_per_core_per_sec", locs.size() / benchmarkSeconds(start));
+	start = std::chrono::steady_clock::now();
+	generator.generate_chunks(locs, chunks, scheduler);
+	results.add("terrain.chunks_per_sec", locs.size() / benchmarkSeconds(start));
+
+	uint64_t solid = 0, uniform = 0;
+	for (const Chunk& c : chunks) {
+		for (uint32_t i = 0; i < CHUNK_SIZE; i++) { solid += c[i] != 0; }
+		uniform += c.get_storage() == CHUNK_UNIFORM;
+	}
+	results.add("terrain.solid_count", static_cast<double>(solid)); // Changes only if the generated terrain does
+	results.add("terrain.uniform_chunk_count", static_cast<double>(uniform));
+}
+
+// Runs every stage on every scene and writes the metrics as JSON, with --compare the exit code is the number of regressions
+static int runBenchmark(int argc, char* argv[]) {
+	BenchmarkSettings settings;
+	if (!parseBenchmarkArguments(argc, argv, settings)) {
+		printBenchmarkUsage();
+		return -1;
+	}
+
+	BenchmarkResults results;
+	bool ran = false;
+	for (const BenchmarkScene& scene : benchmarkScenes) {
+		if (settings.scene != nullptr && strcmp(settings.scene, scene.name) != 0) { continue; }
+		printf_s("Running scene %s\n", scene.name);
+		runBenchmarkScene(scene, settings, results);
+		ran = true;
+	}
+	if (!ran) {
+		printf_s("Unknown scene: %s\n", settings.scene);
+		return -1;
+	}
+	runResolveBenchmark(settings, results);
+	runTerrainBenchmark(settings, results);
+	results.add("process.peak_memory_bytes", static_cast<double>(peakMemoryBytes()));
+	const AllocatorStats allocator = chunk_allocator().get_stats();
+	results.add("process.chunk_high_water_bytes", static_cast<double>(allocator.highWaterBytes));
+	results.add("process.chunk_touched_bytes", static_cast<double>(allocator.carvedBytes));
+
+	if (!writeBenchmarkJson(settings, results)) { return -2; }
+	printf_s("Wrote %zu metrics to %s\n", results.metrics.size(), settings.output);
+
+	if (settings.baseline == nullptr) { return 0; }
+	BenchmarkResults baseline;
+	if (!readBenchmarkJson(settings.baseline, baseline)) {
+		printf_s("Could not read baseline %s\n", settings.baseline);
+		return -3;
+	}
+	return compareBenchmarks(baseline, results, settings.tolerance);
+}
@@ -25,6 +25,7 @@ private:
 	vec3 horizontal;
 	vec3 vertical;
 	vec3 u, v, w; // ???
+	float viewAngle = 0; // Half angle of the cone around the view frustum
 
 public:
 	Camera() {}
@@ -38,10 +39,35 @@ public:
 		w = unit_vector(-dir);
 		u = unit_vector(cross(up, w));
 		v = cross(w, u);
+		viewAngle = atan(sqrt(halfWidth * halfWidth + halfHeight * halfHeight));
 		lowerLeftCorner = position - halfWidth * focusDistance * u - halfHeight * focusDistance * v - focusDistance * w;
 		horizontal = 2 * halfWidth * focusDistance * u;
 		vertical = 2 * halfHeight * focusDistance * v;
 	}
 
+	// Width of one pixel at distance 1 from the camera for an image of the given height
+	float pixel_footprint(int height) const { return 2.0f * static_cast<float>(tan(fov * M_PI / 360)) / static_cast<float>(height); }
+
 	Ray get_ray(float s, float t) const { return Ray(position, lowerLeftCorner + s * horizontal + t * vertical - position); }
+
+	// Inverse of get_ray: the s and t whose ray goes through the point, false if the point is behind the camera
+	bool project(const vec3& point, float& s, float& t) const {
+		vec3 d = point - position;
+		float z = -dot(d, w);
+		if (z <= 0.0f) { return false; }
+		vec3 onPlane = d * (focusDistance / z) - (lowerLeftCorner - position);
+		s = dot(onPlane, horizontal) / dot(horizontal, horizontal);
+		t = dot(onPlane, vertical) / dot(vertical, vertical);
+		return true;
+	}
+
+	// Conservative visibility test for a sphere, uses the cone around the frustum so nothing on screen is ever rejected
+	bool sees(const vec3& center, float radius) const {
+		vec3 d = center - position;
+		float distance = d.length();
+		if (distance <= radius) { return true; }
+		float c = dot(d, -w) / distance;
+		float angle = acos(c < -1.0f ? -1.0f : (c > 1.0f ? 1.0f : c));
+		return angle <= viewAngle + asin(radius / distance);
+	}
 };
\ No newline at end of file
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <string.h>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Block sizes, four per doubling so a block wastes at most a fifth of itself. Blocks are cache line aligned, the ones that are a
+// multiple of the page size, like a chunk's full voxel array, are page aligned as well.
+constexpr uint32_t ALLOCATOR_CLASSES = 21;
+constexpr uint32_t ALLOCATOR_BLOCK_SIZES[ALLOCATOR_CLASSES] = { 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192, 10240, 12288, 14336, 16384 };
+#if UINTPTR_MAX > 0xFFFFFFFFu
+constexpr size_t ALLOCATOR_CLASS_RESERVE = 4ull << 30; // Address space per block size, only pages that were handed out use memory
+#else
+constexpr size_t ALLOCATOR_CLASS_RESERVE = 16u << 20; // 32 bit builds cannot spare more than a few hundred MiB of address space
+#endif
+constexpr size_t ALLOCATOR_COMMIT_STEP = 2ull << 20; // Windows commits the reserved pages in steps this large, Linux needs no commit
+
+// Counters over every block size
+struct AllocatorStats {
+	uint64_t usedBytes = 0; // Blocks handed out and not released
+	uint64_t requestedBytes = 0; // What was asked for in those blocks, the rest is lost to rounding up to a block size
+	uint64_t carvedBytes = 0; // Blocks that were ever handed out, their pages stay in use once touched
+	uint64_t highWaterBytes = 0; // Most usedBytes ever were at once, summed over the block sizes
+	uint64_t fallbacks = 0; // Allocations that went to malloc because they were too big or the reservation ran out
+	double fragmentation() const { return carvedBytes > 0 ? 1.0 - static_cast<double>(requestedBytes) / carvedBytes : 0.0; } // Fraction of touched memory not holding data
+};
+
+// Hands out chunk storage from one big reservation of address space split per block size. Blocks that were never used come straight from
+// pages the OS has not touched yet, so they are zero without a memset. Released blocks go onto a lock free list per size for the next
+// allocation of that size, so streaming threads never wait on each other. Anything that does not fit falls back to malloc.
+struct ChunkAllocator {
+private:
+	struct alignas(64) SizeClass { // A cache line each, threads allocating different sizes do not share one
+		std::atomic<uint64_t> head{ 0 }; // Free list: tag in the high half against ABA, block index + 1 in the low half, 0 if empty
+		std::atomic<uint32_t> carved{ 0 }; // Blocks taken from the reservation so far
+		std::atomic<uint64_t> used{ 0 }, requested{ 0 }, highWater{ 0 }; // Bytes
+		std::atomic<size_t> committed{ 0 }; // Windows only
+	};
+
+	uint8_t* base = nullptr; // ALLOCATOR_CLASSES reservations of ALLOCATOR_CLASS_RESERVE bytes, nullptr if reserving failed
+	SizeClass classes[ALLOCATOR_CLASSES];
+	std::atomic<uint64_t> fallbacks{ 0 };
+	std::mutex commitLock;
+
+	static inline int classOf(size_t bytes) {
+		for (uint32_t i = 0; i < ALLOCATOR_CLASSES; i++) { if (bytes <= ALLOCATOR_BLOCK_SIZES[i]) { return static_cast<int>(i); } }
+		return -1;
+	}
+
+	inline uint8_t* block(uint32_t c, uint32_t index) const { return base + c * ALLOCATOR_CLASS_RESERVE + static_cast<size_t>(index) * ALLOCATOR_BLOCK_SIZES[c]; }
+
+	// Makes sure the first bytes of a class's reservation can be written
+	bool commit(uint32_t c, size_t bytes) {
+#ifdef _WIN32
+		SizeClass& sc = classes[c];
+		if (sc.committed.load(std::memory_order_acquire) >= bytes) { return true; }
+		std::lock_guard<std::mutex> guard(commitLock);
+		const size_t have = sc.committed.load(std::memory_order_relaxed);
+		if (have >= bytes) { return true; }
+		const size_t want = (bytes + ALLOCATOR_COMMIT_STEP - 1) / ALLOCATOR_COMMIT_STEP * ALLOCATOR_COMMIT_STEP;
+		if (VirtualAlloc(base + c * ALLOCATOR_CLASS_RESERVE + have, want - have, MEM_COMMIT, PAGE_READWRITE) == nullptr) { return false; }
+		sc.committed.store(want, std::memory_order_release);
+#else
+		(void)c;
+		(void)bytes;
+#endif
+		return true;
+	}
+
+	void* fallback(size_t bytes, bool zeroed) {
+		fallbacks.fetch_add(1, std::memory_order_relaxed);
+		return zeroed ? calloc(1, bytes) : malloc(bytes);
+	}
+
+public:
+	ChunkAllocator() {
+		const size_t size = ALLOCATOR_CLASSES * ALLOCATOR_CLASS_RESERVE;
+#ifdef _WIN32
+		base = static_cast<uint8_t*>(VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS));
+#else
+		void* reserved = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		base = reserved != MAP_FAILED ? static_cast<uint8_t*>(reserved) : nullptr;
+#endif
+	}
+
+	~ChunkAllocator() {
+		if (base == nullptr) { return; }
+#ifdef _WIN32
+		VirtualFree(base, 0, MEM_RELEASE);
+#else
+		munmap(base, ALLOCATOR_CLASSES * ALLOCATOR_CLASS_RESERVE);
+#endif
+	}
+
+	ChunkAllocator(const ChunkAllocator&) = delete;
+	ChunkAllocator& operator=(const ChunkAllocator&) = delete;
+
+	// Backs the reservation with transparent huge pages where the OS has them, returns false if it does not.
+	// Needs no special rights, but a huge page is only handed out once 2 MiB of a block size were touched.
+	bool set_huge_pages(bool enable) {
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+		return base != nullptr && madvise(base, ALLOCATOR_CLASSES * ALLOCATOR_CLASS_RESERVE, enable ? MADV_HUGEPAGE : MADV_NOHUGEPAGE) == 0;
+#else
+		return !enable;
+#endif
+	}
+
+	// Safe to call from any thread. Zeroed blocks cost nothing extra unless a released block is reused.
+	void* allocate(size_t bytes, bool zeroed = false) {
+		const int c = classOf(bytes);
+		if (base == nullptr || c < 0) { return fallback(bytes, zeroed); }
+		SizeClass& sc = classes[c];
+		uint8_t* p = nullptr;
+
+		uint64_t head = sc.head.load(std::memory_order_acquire);
+		while (static_cast<uint32_t>(head) != 0) {
+			uint8_t* top = block(c, static_cast<uint32_t>(head) - 1);
+			// Another thread may pop and reuse this block meanwhile, then the tag changed and the exchange fails
+			const uint32_t next = reinterpret_cast<std::atomic<uint32_t>*>(top)->load(std::memory_order_relaxed);
+			const uint64_t replacement = ((head >> 32) + 1) << 32 | next;
+			if (sc.head.compare_exchange_weak(head, replacement, std::memory_order_acquire, std::memory_order_acquire)) {
+				p = top;
+				if (zeroed) { memset(p, 0, bytes); }
+				break;
+			}
+		}
+		if (p == nullptr) { // Nothing to reuse, carve a new block from untouched pages
+			const uint32_t capacity = static_cast<uint32_t>(ALLOCATOR_CLASS_RESERVE / ALLOCATOR_BLOCK_SIZES[c]);
+			uint32_t index = sc.carved.load(std::memory_order_relaxed);
+			do {
+				if (index >= capacity) { return fallback(bytes, zeroed); }
+			} while (!sc.carved.compare_exchange_weak(index, index + 1, std::memory_order_relaxed));
+			if (!commit(c, (static_cast<size_t>(index) + 1) * ALLOCATOR_BLOCK_SIZES[c])) { return fallback(bytes, zeroed); } // The block stays unused
+			p = block(c, index);
+		}
+
+		const uint64_t used = sc.used.fetch_add(ALLOCATOR_BLOCK_SIZES[c], std::memory_order_relaxed) + ALLOCATOR_BLOCK_SIZES[c];
+		sc.requested.fetch_add(bytes, std::memory_order_relaxed);
+		uint64_t high = sc.highWater.load(std::memory_order_relaxed);
+		while (used > high && !sc.highWater.compare_exchange_weak(high, used, std::memory_order_relaxed)) {}
+		return p;
+	}
+
+	// Takes back a block from allocate, bytes has to be the size it was allocated with. Safe to call from any thread.
+	void release(void* p, size_t bytes) {
+		if (p == nullptr) { return; }
+		uint8_t* q = static_cast<uint8_t*>(p);
+		if (base == nullptr || q < base || q >= base + ALLOCATOR_CLASSES * ALLOCATOR_CLASS_RESERVE) {
+			free(p);
+			return;
+		}
+		const uint32_t c = static_cast<uint32_t>((q - base) / ALLOCATOR_CLASS_RESERVE);
+		SizeClass& sc = classes[c];
+		const uint32_t index = static_cast<uint32_t>((q - block(c, 0)) / ALLOCATOR_BLOCK_SIZES[c]);
+		sc.used.fetch_sub(ALLOCATOR_BLOCK_SIZES[c], std::memory_order_relaxed);
+		sc.requested.fetch_sub(bytes, std::memory_order_relaxed);
+
+		std::atomic<uint32_t>* link = new (q) std::atomic<uint32_t>(0);
+		uint64_t head = sc.head.load(std::memory_order_relaxed);
+		do {
+			link->store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+		} while (!sc.head.compare_exchange_weak(head, ((head >> 32) + 1) << 32 | (index + 1), std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	AllocatorStats get_stats() const {
+		AllocatorStats s;
+		for (uint32_t c = 0; c < ALLOCATOR_CLASSES; c++) {
+			const SizeClass& sc = classes[c];
+			s.usedBytes += sc.used.load(std::memory_order_relaxed);
+			s.requestedBytes += sc.requested.load(std::memory_order_relaxed);
+			s.carvedBytes += static_cast<uint64_t>(sc.carved.load(std::memory_order_relaxed)) * ALLOCATOR_BLOCK_SIZES[c];
+			s.highWaterBytes += sc.highWater.load(std::memory_order_relaxed);
+		}
+		s.fallbacks = fallbacks.load(std::memory_order_relaxed);
+		return s;
+	}
+};
+
+// The one allocator all chunks share, inline so every translation unit gets the same one. Never destroyed, static worlds release their
+// chunks during exit and may do so after the statics that were created later are gone.
+inline ChunkAllocator& chunk_allocator() {
+	static ChunkAllocator* allocator = new ChunkAllocator();
+	return *allocator;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "Camera.h"
+#include "RegionFile.h"
+#include "TerrainGenerator.h"
+
+constexpr uint32_t STREAM_MAX_PENDING = 2048; // Farther requests are dropped beyond this, the render threads ask for them again if they are still needed
+constexpr uint32_t STREAM_MAX_PUBLISH = 256; // Finished chunks made visible per frame
+constexpr float STREAM_OFFSCREEN_PENALTY = 4.0f; // Chunks outside the view count as this much farther away
+
+// Builds requested chunks on a pool of worker threads so the render loop never waits for them.
+// The world only ever sees finished chunks, they get published all at once between frames in update().
+struct ChunkStreamer {
+private:
+	struct Request {
+		float priority; // Lower is more important
+		ChunkLocation loc;
+	};
+
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable wake, idle;
+	std::vector<Request> pending; // Heap with the most important request on top
+	std::vector<Chunk> ready;
+	int building = 0;
+	bool stopping = false;
+
+	// Only touched by the thread calling update()
+	std::unordered_set<uint64_t> known; // Pending, being built or ready, so a chunk is never queued twice
+	std::vector<ChunkLocation> incoming;
+	std::vector<Chunk> finished;
+
+	static inline bool later(const Request& a, const Request& b) { return a.priority > b.priority; }
+
+	static float priority(const ChunkLocation& loc, const Camera& cam) {
+		const float half = CHUNK_WIDTH * 0.5f;
+		const vec3 center(loc.x * CHUNK_WIDTH + half, loc.y * CHUNK_WIDTH + half, loc.z * CHUNK_WIDTH + half);
+		const float distance = (center - cam.position).length();
+		return cam.sees(center, half * 1.7320508f) ? distance : distance * STREAM_OFFSCREEN_PENALTY;
+	}
+
+	void workerLoop() {
+		while (true) {
+			Request request;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [this] { return stopping || !pending.empty(); });
+				if (stopping) { return; }
+				std::pop_heap(pending.begin(), pending.end(), later);
+				request = pending.back();
+				pending.pop_back();
+				building++;
+			}
+
+			// A failed allocation is still handed back so update() can forget the request
+			Chunk chunk;
+			if (store == nullptr || !store->load(request.loc, chunk)) {
+				if (generator == nullptr || !generator->generate(request.loc, chunk)) { chunk.allocate(request.loc); }
+			}
+
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				ready.push_back(std::move(chunk));
+				building--;
+			}
+			idle.notify_all();
+		}
+	}
+
+	// Hands finished chunks to the world, returns how many became visible
+	uint32_t publish(World& world, uint32_t limit) {
+		finished.clear();
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			const size_t n = std::min<size_t>(limit, ready.size());
+			for (size_t i = ready.size() - n; i < ready.size(); i++) { finished.push_back(std::move(ready[i])); }
+			ready.resize(ready.size() - n);
+		}
+		uint32_t published = 0;
+		for (Chunk& chunk : finished) {
+			known.erase(chunk.loc.key());
+			if (world.publish_chunk(chunk)) { published++; } // Anything not published is freed with the chunk
+		}
+		finished.clear();
+		return published;
+	}
+
+public:
+	uint32_t lastPublished = 0; // Chunks made visible by the last update
+	uint32_t lastDropped = 0; // Requests thrown away by the last update because the queue was full
+	RegionStore* store = nullptr; // Chunks saved here are loaded from it instead of being generated, set before the first update
+	const TerrainGenerator* generator = nullptr; // Builds the chunks that are not in the store, without one they start out as air
+
+	// A thread count of 0 picks a small pool that leaves most cores to the renderer
+	ChunkStreamer(int threads = 0) {
+		if (threads <= 0) { threads = std::max(1u, std::min(4u, std::thread::hardware_concurrency() / 4)); }
+		for (int i = 0; i < threads; i++) { workers.emplace_back(&ChunkStreamer::workerLoop, this); }
+	}
+
+	~ChunkStreamer() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread& t : workers) { t.join(); }
+	}
+
+	ChunkStreamer(const ChunkStreamer&) = delete;
+	ChunkStreamer& operator=(const ChunkStreamer&) = delete;
+
+	// Call once per frame while nothing is rendering: starts the world's next frame, publishes finished chunks, queues the new misses
+	// and re-sorts everything still waiting for the current camera, which has to be prepared already.
+	void update(World& world, const Camera& cam) {
+		world.begin_frame(cam.position);
+		lastPublished = publish(world, STREAM_MAX_PUBLISH);
+
+		world.take_requests(incoming);
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			for (const ChunkLocation& loc : incoming) {
+				if (known.insert(loc.key()).second) { pending.push_back({ 0.0f, loc }); }
+			}
+			for (Request& r : pending) { r.priority = priority(r.loc, cam); }
+
+			lastDropped = 0;
+			if (pending.size() > STREAM_MAX_PENDING) {
+				std::nth_element(pending.begin(), pending.begin() + STREAM_MAX_PENDING, pending.end(), [](const Request& a, const Request& b) { return a.priority < b.priority; });
+				for (size_t i = STREAM_MAX_PENDING; i < pending.size(); i++) { known.erase(pending[i].loc.key()); }
+				lastDropped = static_cast<uint32_t>(pending.size() - STREAM_MAX_PENDING);
+				pending.resize(STREAM_MAX_PENDING);
+			}
+			std::make_heap(pending.begin(), pending.end(), later);
+		}
+		wake.notify_all();
+	}
+
+	// Waits until every queued chunk is built and publishes them, for runs that have to be reproducible
+	void flush(World& world, const Camera& cam) {
+		update(world, cam);
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			idle.wait(guard, [this] { return pending.empty() && building == 0; });
+		}
+		lastPublished += publish(world, ~0u);
+	}
+
+	size_t queued() {
+		std::lock_guard<std::mutex> guard(lock);
+		return pending.size() + building + ready.size();
+	}
+};
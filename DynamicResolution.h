@@ -0,0 +1,142 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include "Renderer.h"
+
+constexpr float RESOLUTION_STEP = 1.0f / 16.0f; // Scales are rounded to this so small changes in frame time do not resize every frame
+
+// Picks the render resolution for the next frame so frames stay within a time budget.
+// Frame time is modelled as a fixed part that does not depend on the render size, like the upscale and the copy to the window,
+// plus a cost per rendered pixel. Both are running averages over the frames that started the image over, frames that only
+// refine a still image get cheaper every frame and would otherwise grow the resolution until moving again is too slow.
+struct ResolutionController {
+	float budgetMs = 16.0f; // Time one frame may take
+	float headroom = 0.9f; // Fraction of the budget aimed for, so noise in the frame time does not push frames over
+	float minScale = 0.25f, maxScale = 1.0f; // Of the output size per axis
+	float smoothing = 0.25f; // Weight of the newest frame in the running averages
+	bool log = true; // Print every change of the scale with the numbers it was based on
+
+	float scale = 1.0f;
+	double fixedUs = -1.0, pixelUs = -1.0; // Negative until the first frame was measured
+
+	// Render size for an output of the given size at the current scale
+	void size(int outputWidth, int outputHeight, int& width, int& height) const {
+		width = std::max(1, static_cast<int>(std::lround(outputWidth * scale)));
+		height = std::max(1, static_cast<int>(std::lround(outputHeight * scale)));
+	}
+
+	// Feeds in how long the last frame took in total and how much of that was rendering width x height pixels.
+	// Only frames that started over are used, the others are ignored. Returns true if the scale changed.
+	bool update(uint64_t frameUs, uint64_t renderUs, int width, int height, int outputWidth, int outputHeight, bool restarted) {
+		if (!restarted || width <= 0 || height <= 0) { return false; }
+		const double fixed = static_cast<double>(frameUs > renderUs ? frameUs - renderUs : 0);
+		const double perPixel = static_cast<double>(renderUs) / (static_cast<double>(width) * height);
+		fixedUs = fixedUs < 0.0 ? fixed : fixedUs + smoothing * (fixed - fixedUs);
+		pixelUs = pixelUs < 0.0 ? perPixel : pixelUs + smoothing * (perPixel - pixelUs);
+
+		// Largest scale whose predicted frame time fits, rounded down to a step
+		const double outputPixels = static_cast<double>(outputWidth) * outputHeight;
+		const double available = std::max(0.0, budgetMs * 1000.0 * headroom - fixedUs);
+		float target = pixelUs > 0.0 ? static_cast<float>(std::sqrt(available / (pixelUs * outputPixels))) : maxScale;
+		target = std::floor(target / RESOLUTION_STEP) * RESOLUTION_STEP;
+		target = std::min(std::max(target, minScale), maxScale);
+
+		// Shrink as soon as the average is over the budget, grow only by more than a step so it does not flip between two sizes
+		const double predictedMs = (fixedUs + pixelUs * outputPixels * scale * scale) / 1000.0;
+		const bool shrink = target < scale && predictedMs > budgetMs;
+		const bool grow = target > scale + RESOLUTION_STEP * 1.5f;
+		if (!shrink && !grow) { return false; }
+		if (log) {
+			printf_s("Resolution scale %.3f -> %.3f (frame %.2f ms, render %.2f ms at %dx%d, average %.2f ms fixed + %.3f us per pixel, budget %.2f ms)\n",
+				scale, target, frameUs / 1000.0, renderUs / 1000.0, width, height, fixedUs / 1000.0, pixelUs, budgetMs);
+		}
+		scale = target;
+		return true;
+	}
+};
+
+// Source pixel and bilinear fraction for every output column or row
+static void upscaleTaps(int size, int lowSize, std::vector<int32_t>& index, std::vector<float>& fraction) {
+	index.resize(size);
+	fraction.resize(size);
+	const float scale = static_cast<float>(lowSize) / size;
+	for (int i = 0; i < size; i++) {
+		const float u = (static_cast<float>(i) + 0.5f) * scale - 0.5f;
+		index[i] = std::min(std::max(fastfloor(u), 0), lowSize - 1);
+		fraction[i] = index[i] + 1 < lowSize ? std::min(std::max(u - static_cast<float>(index[i]), 0.0f), 1.0f) : 0.0f;
+	}
+}
+
+// Filters one tile of the output, DEPTH leaves the depth test out of the inner loop when no hits were recorded
+template <bool DEPTH>
+static void upscaleTile(const Tile& tile, const vec3* pixels, const float* depth, int lowWidth, const int32_t* columns, const float* columnFractions,
+	const int32_t* rows, const float* rowFractions, vec3* out, int width) {
+	constexpr float colorScale = 1.0f / 0.1f, depthScale = 1.0f / 0.05f; // Differences at which a tap counts half
+	for (int y = tile.y0; y < tile.y1; y++) {
+		const float fy = rowFractions[y];
+		const size_t row0 = static_cast<size_t>(rows[y]) * lowWidth, row1 = fy > 0.0f ? row0 + lowWidth : row0;
+		vec3* line = out + static_cast<size_t>(y) * width;
+		for (int x = tile.x0; x < tile.x1; x++) {
+			const float fx = columnFractions[x];
+			const size_t x0 = static_cast<size_t>(columns[x]), x1 = fx > 0.0f ? x0 + 1 : x0;
+			const size_t tap[4]{ row0 + x0, row0 + x1, row1 + x0, row1 + x1 };
+			const float weight[4]{ (1.0f - fx) * (1.0f - fy), fx * (1.0f - fy), (1.0f - fx) * fy, fx * fy };
+			const size_t nearest = tap[(fx > 0.5f ? 1 : 0) | (fy > 0.5f ? 2 : 0)];
+
+			const vec3& reference = pixels[nearest];
+			const float referenceDepth = DEPTH ? depth[nearest] : 0.0f;
+			float r = 0.0f, g = 0.0f, b = 0.0f, total = 0.0f;
+			for (int k = 0; k < 4; k++) {
+				const vec3& c = pixels[tap[k]];
+				const float dc = (std::fabs(c[0] - reference[0]) + std::fabs(c[1] - reference[1]) + std::fabs(c[2] - reference[2])) * colorScale;
+				float range = 1.0f + dc * dc;
+				if (DEPTH) { // Zero is unknown, mirrors only go by color
+					const float d = depth[tap[k]];
+					const float dd = std::min(std::fabs(d - referenceDepth) / std::max(std::min(d, referenceDepth), 1e-6f) * depthScale, 1e6f);
+					range *= 1.0f + (referenceDepth > 0.0f && d > 0.0f ? dd * dd : 0.0f);
+				}
+				const float w = weight[k] / range;
+				r += c[0] * w;
+				g += c[1] * w;
+				b += c[2] * w;
+				total += w;
+			}
+			const float inv = 1.0f / total; // The nearest tap has at least a quarter of the weight and no difference, so this is never zero
+			line[x] = vec3(r * inv, g * inv, b * inv);
+		}
+	}
+}
+
+// Brings a low resolution render up to the output size. Bilinear, except that the taps are weighted down the more they differ from
+// the closest one in color and, where the hits are known, in relative depth, so edges stay sharp instead of bleeding into their background.
+static void upscale(const Framebuffer& low, std::vector<vec3>& out, int width, int height, TileScheduler& scheduler) {
+	static thread_local std::vector<int32_t> columns, rows;
+	static thread_local std::vector<float> columnFractions, rowFractions, depths;
+	out.resize(static_cast<size_t>(width) * height);
+	upscaleTaps(width, low.width, columns, columnFractions);
+	upscaleTaps(height, low.height, rows, rowFractions);
+
+	// Sky counts as far away, pixels without a usable hit as unknown
+	const PixelHits& hits = low.temporal.hits;
+	const bool haveDepth = low.temporal.valid && hits.depth.size() == low.pixels.size();
+	if (haveDepth) {
+		depths.resize(low.pixels.size());
+		for (size_t i = 0; i < depths.size(); i++) { depths[i] = hits.sky[i] ? TEMPORAL_SKY_DISTANCE : std::max(hits.depth[i], 0.0f); }
+	}
+
+	const vec3* pixels = low.pixels.data();
+	const float* depth = depths.data();
+	const int32_t* cols = columns.data();
+	const int32_t* rws = rows.data();
+	const float* fxs = columnFractions.data();
+	const float* fys = rowFractions.data();
+	vec3* target = out.data();
+	const int lowWidth = low.width;
+	scheduler.run(width, height, [=](const Tile& tile) {
+		if (haveDepth) { upscaleTile<true>(tile, pixels, depth, lowWidth, cols, fxs, rws, fys, target, width); }
+		else { upscaleTile<false>(tile, pixels, depth, lowWidth, cols, fxs, rws, fys, target, width); }
+	}, false);
+}
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include "Renderer.h"
+#include "DynamicResolution.h"
+#include "ImageOutput.h"
+#include "ChunkStreamer.h"
+
+// Settings for rendering frames straight to disk without opening a window
+struct HeadlessSettings {
+	int width = 400, height = 300;
+	int frames = 1;
+	int samples = 1;
+	int threads = 0; // 0 uses every hardware thread
+	int tileSize = DEFAULT_TILE_SIZE;
+	int budget = static_cast<int>(DEFAULT_MEMORY_BUDGET >> 20); // MiB of resident chunks
+	const char* output = "frame"; // Files are written as <output><frame number>.<format>
+	ImageFormat format = IMAGE_BMP;
+	bool packetTracing = true;
+	bool wavefront = false;
+	bool temporal = false; // Reuse the last frame's pixels that are still valid
+	float frameBudget = 0.0f; // Milliseconds per frame the render size is scaled to, 0 always renders at the output size
+	float lodBias = 1.0f; // See Renderer::lodBias
+	float coarseDistance = 0.0f; // See World::coarseDistance
+	const char* world = nullptr; // Directory of region files chunks are loaded from and edits are saved to
+	bool terrain = true; // Generate the chunks that are not in the world directory, without it they are air
+	uint64_t seed = 1; // See TerrainSettings::seed
+	bool hugePages = false; // Back chunk storage with transparent huge pages
+	const char* profile = nullptr; // Stage timings and ray counters are written to <profile>.json and <profile>.csv
+	bool write = true;
+	bool syncChunks = false; // Wait for requested chunks every frame so the output does not depend on timing
+};
+
+static void printHeadlessUsage() {
+	printf_s("Usage: VoxelTracer --headless [--width W] [--height H] [--frames N] [--samples S] [--threads T] [--tile SIZE] [--budget MIB] [--out PREFIX] [--format bmp|qoi|png|pfm] [--single-rays] [--wavefront] [--temporal] [--frame-budget MS] [--lod-bias PIXELS] [--coarse-distance VOXELS] [--world DIR] [--seed N] [--no-terrain] [--huge-pages] [--profile PREFIX] [--no-write] [--sync-chunks]\n");
+}
+
+// Returns false if the arguments could not be parsed
+static bool parseHeadlessArguments(int argc, char* argv[], HeadlessSettings& settings) {
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+		if (strcmp(arg, "--headless") == 0) { continue; }
+		else if (strcmp(arg, "--width") == 0 && hasValue) { settings.width = atoi(argv[++i]); }
+		else if (strcmp(arg, "--height") == 0 && hasValue) { settings.height = atoi(argv[++i]); }
+		else if (strcmp(arg, "--frames") == 0 && hasValue) { settings.frames = atoi(argv[++i]); }
+		else if (strcmp(arg, "--samples") == 0 && hasValue) { settings.samples = atoi(argv[++i]); }
+		else if (strcmp(arg, "--threads") == 0 && hasValue) { settings.threads = atoi(argv[++i]); }
+		else if (strcmp(arg, "--tile") == 0 && hasValue) { settings.tileSize = atoi(argv[++i]); }
+		else if (strcmp(arg, "--budget") == 0 && hasValue) { settings.budget = atoi(argv[++i]); }
+		else if (strcmp(arg, "--out") == 0 && hasValue) { settings.output = argv[++i]; }
+		else if (strcmp(arg, "--frame-budget") == 0 && hasValue) { settings.frameBudget = static_cast<float>(atof(argv[++i])); }
+		else if (strcmp(arg, "--lod-bias") == 0 && hasValue) { settings.lodBias = static_cast<float>(atof(argv[++i])); }
+		else if (strcmp(arg, "--coarse-distance") == 0 && hasValue) { settings.coarseDistance = static_cast<float>(atof(argv[++i])); }
+		else if (strcmp(arg, "--world") == 0 && hasValue) { settings.world = argv[++i]; }
+		else if (strcmp(arg, "--seed") == 0 && hasValue) { settings.seed = strtoull(argv[++i], nullptr, 10); }
+		else if (strcmp(arg, "--profile") == 0 && hasValue) { settings.profile = argv[++i]; }
+		else if (strcmp(arg, "--format") == 0 && hasValue) {
+			if (!image_format_from_name(argv[++i], settings.format)) {
+				printf_s("Unknown image format: %s\n", argv[i]);
+				return false;
+			}
+		}
+		else if (strcmp(arg, "--single-rays") == 0) { settings.packetTracing = false; }
+		else if (strcmp(arg, "--wavefront") == 0) { settings.wavefront = true; }
+		else if (strcmp(arg, "--temporal") == 0) { settings.temporal = true; }
+		else if (strcmp(arg, "--no-terrain") == 0) { settings.terrain = false; }
+		else if (strcmp(arg, "--huge-pages") == 0) { settings.hugePages = true; }
+		else if (strcmp(arg, "--no-write") == 0) { settings.write = false; }
+		else if (strcmp(arg, "--sync-chunks") == 0) { settings.syncChunks = true; }
+		else {
+			printf_s("Unknown or incomplete argument: %s\n", arg);
+			return false;
+		}
+	}
+	return settings.width > 0 && settings.height > 0 && settings.frames > 0 && settings.samples > 0 && settings.threads >= 0 && settings.tileSize >= 2 && settings.budget > 0 && settings.frameBudget >= 0.0f && settings.lodBias >= 0.0f && settings.coarseDistance >= 0.0f;
+}
+
+static bool isHeadless(int argc, char* argv[]) {
+	for (int i = 1; i < argc; i++) { if (strcmp(argv[i], "--headless") == 0) { return true; } }
+	return false;
+}
+
+// Renders the same scene as the window would, but into a framebuffer that gets written to disk, SDL is never initialised
+static int runHeadless(int argc, char* argv[]) {
+	HeadlessSettings settings;
+	if (!parseHeadlessArguments(argc, argv, settings)) {
+		printHeadlessUsage();
+		return -1;
+	}
+
+	if (settings.hugePages && !chunk_allocator().set_huge_pages(true)) { printf_s("Huge pages are not available, using normal pages\n"); }
+	static World world; // Too big for the stack
+	init_default_materials(world);
+	world.set_memory_budget(static_cast<size_t>(settings.budget) << 20);
+	world.coarseDistance = settings.coarseDistance;
+	Camera cam({ 0, 1, 0 }, 50.0f, static_cast<float>(settings.width) / static_cast<float>(settings.height), 0.1f, 10.0f);
+	Framebuffer frame(settings.width, settings.height);
+	Renderer renderer;
+	RegionStore store(settings.world != nullptr ? settings.world : ""); // Before the streamer, its threads load from it
+	if (settings.world != nullptr && !store.open()) {
+		printf_s("Could not use %s as the world directory\n", settings.world);
+		return -1;
+	}
+	TerrainSettings terrainSettings;
+	terrainSettings.seed = settings.seed;
+	const TerrainGenerator terrain(terrainSettings);
+	ChunkStreamer streamer;
+	if (settings.terrain) {
+		streamer.generator = &terrain;
+		cam.position = vec3(0.0f, static_cast<float>(terrain.surface_height(0, 0) + 2), 0.0f); // Stands on the ground instead of inside it
+	}
+	if (settings.world != nullptr) {
+		streamer.store = &store;
+		world.holdEdits = true;
+	}
+	ImageWriter imageWriter; // Writing frame n overlaps with rendering frame n + 1
+	ResolutionController resolution;
+	resolution.budgetMs = settings.frameBudget;
+	std::vector<vec3> upscaled;
+	renderer.packetTracing = settings.packetTracing;
+	renderer.wavefront = settings.wavefront;
+	renderer.temporalReuse = settings.temporal;
+	renderer.lodBias = settings.lodBias;
+	renderer.scheduler.setThreads(settings.threads);
+	renderer.scheduler.setTileSize(settings.tileSize);
+	Profiler profiler;
+	if (settings.profile != nullptr && !profiler.open(settings.profile)) {
+		printf_s("Could not write the profile %s\n", settings.profile);
+		return -1;
+	}
+
+	uint64_t total = 0;
+	char filename[512];
+	for (int i = 0; i < settings.frames; i++) {
+		// Same frame setup as Engine::onLoop
+		profiler.begin_frame();
+		cam.prepare({ 3,-2,8 });
+		{
+			ProfileScope scope(profiler, "loadChunks");
+			if (settings.syncChunks) { streamer.flush(world, cam); }
+			else { streamer.update(world, cam); }
+		}
+		{
+			ProfileScope scope(profiler, "autofocus");
+			float depth = 0;
+			trace(cam.position, cam.get_ray(0.5f, 0.5f), world, 1, 1, depth);
+			if (depth > 0.0f) { cam.focusDistance = depth; }
+		}
+		cam.prepare({ 3,-2,8 });
+
+		int width = settings.width, height = settings.height;
+		if (settings.frameBudget > 0.0f) { resolution.size(settings.width, settings.height, width, height); }
+		if (frame.width != width || frame.height != height) { frame.resize(width, height); }
+		const bool scaled = width != settings.width || height != settings.height;
+
+		auto start = std::chrono::high_resolution_clock::now();
+		{
+			ProfileScope scope(profiler, "render");
+			renderer.render(world, cam, frame, settings.samples);
+		}
+		const uint64_t renderUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		if (scaled) {
+			ProfileScope scope(profiler, "upscale");
+			upscale(frame, upscaled, settings.width, settings.height, renderer.scheduler);
+		}
+		uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+		total += us;
+		if (settings.frameBudget > 0.0f) { resolution.update(us, renderUs, width, height, settings.width, settings.height, renderer.lastRestarted); }
+		printf_s("Frame %d took %llu us (%dx%d, %llu samples, %llu reused, %.2f Msamples/s)\n", i, static_cast<unsigned long long>(us), width, height, static_cast<unsigned long long>(renderer.lastSampleCount), static_cast<unsigned long long>(renderer.lastReusedCount), us > 0 ? static_cast<double>(renderer.lastSampleCount) / us : 0.0);
+
+		if (settings.write) {
+			ProfileScope scope(profiler, "save");
+			snprintf(filename, sizeof(filename), "%s%04d.%s", settings.output, i, image_format_extension(settings.format));
+			if (scaled) { imageWriter.save(upscaled, settings.width, settings.height, filename, settings.format); }
+			else { imageWriter.save(frame, filename, settings.format); }
+		}
+		profiler.end_frame();
+	}
+	profiler.close();
+	if (!imageWriter.wait()) { return -2; }
+	if (settings.world != nullptr) {
+		if (!store.save(world)) { return -3; }
+		printf_s("World: %llu chunks loaded from region files, %llu saved\n", static_cast<unsigned long long>(store.chunksLoaded.load()), static_cast<unsigned long long>(store.chunksSaved));
+	}
+	ResidencyStats residency = world.get_residency_stats();
+	printf_s("Resident chunks: %llu (%llu uniform, %llu palette, %llu full, %llu coarse, %llu of %llu KiB, %llu KiB sun shadows), %llu loaded, %llu evicted, %llu rejected, %llu misses, %llu dropped requests\n",
+		static_cast<unsigned long long>(residency.residentChunks), static_cast<unsigned long long>(residency.uniformChunks), static_cast<unsigned long long>(residency.paletteChunks), static_cast<unsigned long long>(residency.fullChunks), static_cast<unsigned long long>(residency.coarseChunks),
+		static_cast<unsigned long long>(residency.residentBytes >> 10), static_cast<unsigned long long>(residency.budgetBytes >> 10), static_cast<unsigned long long>(residency.sunShadowBytes >> 10),
+		static_cast<unsigned long long>(residency.loaded), static_cast<unsigned long long>(residency.evicted), static_cast<unsigned long long>(residency.rejected),
+		static_cast<unsigned long long>(residency.misses), static_cast<unsigned long long>(residency.dropped));
+	const AllocatorStats allocator = chunk_allocator().get_stats();
+	printf_s("Chunk allocator: %llu KiB used, %llu KiB high water, %llu KiB touched, %.1f%% of touched memory unused, %llu malloc fallbacks\n",
+		static_cast<unsigned long long>(allocator.usedBytes >> 10), static_cast<unsigned long long>(allocator.highWaterBytes >> 10), static_cast<unsigned long long>(allocator.carvedBytes >> 10),
+		allocator.fragmentation() * 100.0, static_cast<unsigned long long>(allocator.fallbacks));
+	printf_s("Rendered %d frames on %d threads in %llu us, %llu us per frame\n", settings.frames, renderer.scheduler.threads(), static_cast<unsigned long long>(total), static_cast<unsigned long long>(total / settings.frames));
+	return 0;
+}
\ No newline at end of file
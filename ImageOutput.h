@@ -0,0 +1,551 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Renderer.h"
+
+enum ImageFormat {
+	IMAGE_BMP, // 24 bit, uncompressed
+	IMAGE_QOI, // Lossless and very fast to encode
+	IMAGE_PNG, // Lossless, deflate with fixed Huffman codes
+	IMAGE_PFM // 32 bit float per channel, keeps the HDR values of the accumulation buffer
+};
+
+constexpr int IMAGE_MIN_STRIPE_ROWS = 32; // Fewer rows per stripe are not worth a thread
+
+static const char* image_format_extension(ImageFormat format) {
+	switch (format) {
+	case IMAGE_QOI: return "qoi";
+	case IMAGE_PNG: return "png";
+	case IMAGE_PFM: return "pfm";
+	default: return "bmp";
+	}
+}
+
+// Returns false if the name is not a known format
+static bool image_format_from_name(const char* name, ImageFormat& format) {
+	const ImageFormat formats[]{ IMAGE_BMP, IMAGE_QOI, IMAGE_PNG, IMAGE_PFM };
+	for (ImageFormat f : formats) {
+		if (strcmp(name, image_format_extension(f)) == 0) {
+			format = f;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Picks the format from the file extension, bmp if the extension is not known
+static ImageFormat image_format_from_filename(const char* filename) {
+	const char* dot = strrchr(filename, '.');
+	ImageFormat format = IMAGE_BMP;
+	if (dot != nullptr) { image_format_from_name(dot + 1, format); }
+	return format;
+}
+
+static inline uint8_t to_byte(float v) { return static_cast<uint8_t>(clamp(0.0f, 1.0f, v) * 255.99f); }
+
+static inline void put_be32(uint8_t* p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+static inline void put_le32(uint8_t* p, uint32_t v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+
+static inline int stripe_count(int height, int threads) { return std::max(1, std::min(threads, height / IMAGE_MIN_STRIPE_ROWS)); }
+
+// Calls f(stripe, y0, y1) for horizontal stripes of the image, the first stripe runs on the calling thread
+template <typename F>
+static void for_each_stripe(int height, int threads, F f) {
+	const int stripes = stripe_count(height, threads);
+	std::vector<std::thread> workers;
+	for (int s = 1; s < stripes; s++) { workers.emplace_back([&f, s, stripes, height] { f(s, height * s / stripes, height * (s + 1) / stripes); }); }
+	f(0, 0, height / stripes);
+	for (std::thread& t : workers) { t.join(); }
+}
+
+// Sizes the buffer for a 24 bit bmp and writes its headers, returns where the pixel rows start
+static uint8_t* prepare_bmp(std::vector<uint8_t>& out, int width, int height, int& rowSize) {
+	rowSize = (width * 3 + 3) & ~3; // rows are padded to 4 bytes
+	const int headerSize = 14 + 40;
+	const uint32_t dataSize = static_cast<uint32_t>(rowSize) * height;
+	out.assign(headerSize + dataSize, 0);
+	uint8_t* header = out.data();
+	header[0] = 'B';
+	header[1] = 'M';
+	put_le32(header + 2, headerSize + dataSize);
+	put_le32(header + 10, headerSize); // pixel data offset
+	put_le32(header + 14, 40); // information header size
+	put_le32(header + 18, width);
+	put_le32(header + 22, height);
+	header[26] = 1; // planes
+	header[28] = 24; // bits per pixel
+	put_le32(header + 34, dataSize);
+	return out.data() + headerSize;
+}
+
+// Bottom up rows of BGR, packed straight from the float pixels into the file buffer
+static void encode_bmp(const vec3* pixels, int width, int height, int threads, std::vector<uint8_t>& out) {
+	int rowSize;
+	uint8_t* data = prepare_bmp(out, width, height, rowSize);
+	for_each_stripe(height, threads, [&](int, int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			uint8_t* row = data + static_cast<size_t>(height - 1 - y) * rowSize;
+			const vec3* p = pixels + static_cast<size_t>(y) * width;
+			for (int x = 0; x < width; x++) {
+				row[x * 3] = to_byte(p[x].b());
+				row[x * 3 + 1] = to_byte(p[x].g());
+				row[x * 3 + 2] = to_byte(p[x].r());
+			}
+		}
+	});
+}
+
+// Little endian float RGB, bottom up like bmp
+static void encode_pfm(const vec3* pixels, int width, int height, int threads, std::vector<uint8_t>& out) {
+	char header[64];
+	const int headerSize = snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", width, height);
+	const size_t rowSize = static_cast<size_t>(width) * 3 * sizeof(float);
+	out.resize(headerSize + rowSize * height);
+	memcpy(out.data(), header, headerSize);
+	for_each_stripe(height, threads, [&](int, int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			uint8_t* row = out.data() + headerSize + (height - 1 - y) * rowSize; // not float aligned after the text header
+			const vec3* p = pixels + static_cast<size_t>(y) * width;
+			for (int x = 0; x < width; x++) {
+				const float rgb[3]{ p[x].r(), p[x].g(), p[x].b() };
+				memcpy(row + x * sizeof(rgb), rgb, sizeof(rgb));
+			}
+		}
+	});
+}
+
+// Every stripe is encoded on its own and starts with a full color, so the decoder never needs state the stripe's encoder did not have.
+// Entries of the color index are only referenced after the same stripe wrote them, which the decoder did as well.
+static void encode_qoi(const vec3* pixels, int width, int height, int threads, std::vector<uint8_t>& out) {
+	const int stripes = stripe_count(height, threads);
+	std::vector<std::vector<uint8_t>> parts(stripes);
+	for_each_stripe(height, threads, [&](int s, int y0, int y1) {
+		std::vector<uint8_t>& part = parts[s];
+		part.resize(static_cast<size_t>(width) * (y1 - y0) * 4 + 4); // worst case is a full color op per pixel
+		uint8_t* o = part.data();
+		uint8_t index[64][3]{};
+		bool used[64]{};
+		uint8_t prev[3]{ 0, 0, 0 };
+		int run = 0;
+		bool first = true;
+		for (int y = y0; y < y1; y++) {
+			const vec3* p = pixels + static_cast<size_t>(y) * width;
+			for (int x = 0; x < width; x++) {
+				const uint8_t px[3]{ to_byte(p[x].r()), to_byte(p[x].g()), to_byte(p[x].b()) };
+				if (!first && px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2]) {
+					if (++run == 62) {
+						*o++ = 0xC0 | (run - 1);
+						run = 0;
+					}
+					continue;
+				}
+				if (run > 0) {
+					*o++ = 0xC0 | (run - 1);
+					run = 0;
+				}
+				const int h = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) & 63;
+				if (first) {
+					*o++ = 0xFE;
+					*o++ = px[0]; *o++ = px[1]; *o++ = px[2];
+					first = false;
+				} else if (used[h] && index[h][0] == px[0] && index[h][1] == px[1] && index[h][2] == px[2]) {
+					*o++ = static_cast<uint8_t>(h);
+				} else {
+					const int dr = static_cast<int8_t>(px[0] - prev[0]), dg = static_cast<int8_t>(px[1] - prev[1]), db = static_cast<int8_t>(px[2] - prev[2]);
+					const int drg = dr - dg, dbg = db - dg;
+					if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+						*o++ = 0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2);
+					} else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+						*o++ = 0x80 | (dg + 32);
+						*o++ = ((drg + 8) << 4) | (dbg + 8);
+					} else {
+						*o++ = 0xFE;
+						*o++ = px[0]; *o++ = px[1]; *o++ = px[2];
+					}
+				}
+				memcpy(index[h], px, 3);
+				used[h] = true;
+				memcpy(prev, px, 3);
+			}
+		}
+		if (run > 0) { *o++ = 0xC0 | (run - 1); }
+		part.resize(o - part.data());
+	});
+
+	size_t size = 14 + 8;
+	for (const auto& part : parts) { size += part.size(); }
+	out.resize(size);
+	uint8_t* o = out.data();
+	memcpy(o, "qoif", 4);
+	put_be32(o + 4, width);
+	put_be32(o + 8, height);
+	o[12] = 3; // channels
+	o[13] = 1; // all channels linear
+	o += 14;
+	for (const auto& part : parts) {
+		memcpy(o, part.data(), part.size());
+		o += part.size();
+	}
+	memset(o, 0, 7);
+	o[7] = 1;
+}
+
+static const uint32_t* crc_table() {
+	static uint32_t table[256];
+	static std::once_flag once;
+	std::call_once(once, [] {
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++) { c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1; }
+			table[n] = c;
+		}
+	});
+	return table;
+}
+
+static uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0) {
+	const uint32_t* table = crc_table();
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) { crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8); }
+	return ~crc;
+}
+
+static uint32_t adler32(const uint8_t* data, size_t size) {
+	uint32_t a = 1, b = 0;
+	while (size > 0) {
+		const size_t n = std::min<size_t>(size, 5552); // Largest block that can not overflow before the modulo
+		for (size_t i = 0; i < n; i++) {
+			a += data[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+		data += n;
+		size -= n;
+	}
+	return (b << 16) | a;
+}
+
+// Adler-32 of two buffers put together, from the checksums of both and the length of the second
+static uint32_t adler32_combine(uint32_t a1, uint32_t a2, size_t length2) {
+	const uint32_t base = 65521, rem = static_cast<uint32_t>(length2 % base);
+	uint32_t sum1 = a1 & 0xFFFF;
+	uint32_t sum2 = (rem * sum1) % base;
+	sum1 += (a2 & 0xFFFF) + base - 1;
+	sum2 += (a1 >> 16) + (a2 >> 16) + base - rem;
+	if (sum1 >= base) { sum1 -= base; }
+	if (sum1 >= base) { sum1 -= base; }
+	if (sum2 >= base * 2) { sum2 -= base * 2; }
+	if (sum2 >= base) { sum2 -= base; }
+	return sum1 | (sum2 << 16);
+}
+
+// LSB first bit stream as deflate wants it
+struct BitWriter {
+	std::vector<uint8_t>& out;
+	uint64_t bits = 0;
+	int count = 0;
+
+	BitWriter(std::vector<uint8_t>& o) : out(o) {}
+
+	inline void put(uint32_t value, int n) {
+		bits |= static_cast<uint64_t>(value) << count;
+		count += n;
+		while (count >= 8) {
+			out.push_back(static_cast<uint8_t>(bits));
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+
+	// Huffman codes are stored most significant bit first
+	inline void put_code(uint32_t code, int n) {
+		uint32_t reversed = 0;
+		for (int i = 0; i < n; i++) { reversed |= ((code >> i) & 1) << (n - 1 - i); }
+		put(reversed, n);
+	}
+
+	void align() {
+		if (count > 0) { out.push_back(static_cast<uint8_t>(bits)); }
+		bits = 0;
+		count = 0;
+	}
+};
+
+static inline void put_fixed_literal(BitWriter& bw, uint32_t symbol) {
+	if (symbol < 144) { bw.put_code(0x30 + symbol, 8); }
+	else if (symbol < 256) { bw.put_code(0x190 + symbol - 144, 9); }
+	else if (symbol < 280) { bw.put_code(symbol - 256, 7); }
+	else { bw.put_code(0xC0 + symbol - 280, 8); }
+}
+
+// Compresses one stripe as a single fixed Huffman block with greedy LZ77 matching.
+// A stripe that is not the last ends with an empty stored block so the next one starts on a byte boundary.
+static void deflate_stripe(const uint8_t* data, size_t size, bool last, std::vector<uint8_t>& out) {
+	static const uint16_t lengthBase[29]{ 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const uint8_t lengthExtra[29]{ 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	static const uint16_t distanceBase[30]{ 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	static const uint8_t distanceExtra[30]{ 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+	constexpr uint32_t hashBits = 15, window = 32768, maxChain = 16;
+
+	BitWriter bw(out);
+	bw.put(last ? 1 : 0, 1);
+	bw.put(1, 2); // fixed Huffman codes
+
+	std::vector<int32_t> head(1u << hashBits, -1), chain(size, -1);
+	auto hash = [data](size_t i) { return ((data[i] << 16 | data[i + 1] << 8 | data[i + 2]) * 2654435761u) >> (32 - hashBits); };
+	auto insert = [&](size_t i) {
+		const uint32_t h = hash(i);
+		chain[i] = head[h];
+		head[h] = static_cast<int32_t>(i);
+	};
+
+	size_t i = 0;
+	while (i < size) {
+		size_t bestLength = 0, bestDistance = 0;
+		if (i + 3 <= size) {
+			const size_t maxLength = std::min<size_t>(258, size - i);
+			int32_t candidate = head[hash(i)];
+			for (uint32_t depth = 0; candidate >= 0 && i - candidate <= window && depth < maxChain; depth++) {
+				if (data[candidate + bestLength] == data[i + bestLength]) {
+					size_t length = 0;
+					while (length < maxLength && data[candidate + length] == data[i + length]) { length++; }
+					if (length > bestLength) {
+						bestLength = length;
+						bestDistance = i - candidate;
+						if (length == maxLength) { break; }
+					}
+				}
+				candidate = chain[candidate];
+			}
+			insert(i);
+		}
+
+		if (bestLength < 3) {
+			put_fixed_literal(bw, data[i]);
+			i++;
+			continue;
+		}
+		const int l = static_cast<int>(std::upper_bound(lengthBase, lengthBase + 29, bestLength) - lengthBase) - 1;
+		put_fixed_literal(bw, 257 + l);
+		bw.put(static_cast<uint32_t>(bestLength - lengthBase[l]), lengthExtra[l]);
+		const int d = static_cast<int>(std::upper_bound(distanceBase, distanceBase + 30, bestDistance) - distanceBase) - 1;
+		bw.put_code(d, 5);
+		bw.put(static_cast<uint32_t>(bestDistance - distanceBase[d]), distanceExtra[d]);
+		for (size_t k = i + 1; k < i + bestLength && k + 3 <= size; k++) { insert(k); }
+		i += bestLength;
+	}
+	put_fixed_literal(bw, 256);
+
+	if (!last) {
+		bw.put(0, 3); // empty stored block
+		bw.align();
+		const uint8_t sync[4]{ 0x00, 0x00, 0xFF, 0xFF };
+		out.insert(out.end(), sync, sync + 4);
+	} else {
+		bw.align();
+	}
+}
+
+static void append_png_chunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size) {
+	uint8_t header[8];
+	put_be32(header, static_cast<uint32_t>(size));
+	memcpy(header + 4, type, 4);
+	out.insert(out.end(), header, header + 8);
+	out.insert(out.end(), data, data + size);
+	uint8_t crc[4];
+	put_be32(crc, crc32(data, size, crc32(header + 4, 4)));
+	out.insert(out.end(), crc, crc + 4);
+}
+
+// 8 bit RGB png, every stripe is filtered, compressed and checksummed on its own thread and becomes its own IDAT chunk
+static void encode_png(const vec3* pixels, int width, int height, int threads, std::vector<uint8_t>& out) {
+	const int stripes = stripe_count(height, threads);
+	const size_t rowSize = static_cast<size_t>(width) * 3;
+	std::vector<std::vector<uint8_t>> chunks(stripes);
+	std::vector<uint32_t> adlers(stripes);
+	std::vector<size_t> lengths(stripes);
+
+	for_each_stripe(height, threads, [&](int s, int y0, int y1) {
+		// Pack the stripe and the row above it, filters look one row up
+		const int first = std::max(0, y0 - 1);
+		std::vector<uint8_t> rgb(rowSize * (y1 - first));
+		for (int y = first; y < y1; y++) {
+			uint8_t* row = rgb.data() + (y - first) * rowSize;
+			const vec3* p = pixels + static_cast<size_t>(y) * width;
+			for (int x = 0; x < width; x++) {
+				row[x * 3] = to_byte(p[x].r());
+				row[x * 3 + 1] = to_byte(p[x].g());
+				row[x * 3 + 2] = to_byte(p[x].b());
+			}
+		}
+
+		// Per row the filter with the smallest sum of absolute differences
+		std::vector<uint8_t> filtered((rowSize + 1) * (y1 - y0));
+		std::vector<uint8_t> candidate(rowSize);
+		const std::vector<uint8_t> zeros(rowSize, 0);
+		for (int y = y0; y < y1; y++) {
+			const uint8_t* row = rgb.data() + (y - first) * rowSize;
+			const uint8_t* up = y > 0 ? row - rowSize : zeros.data();
+			uint8_t* dst = filtered.data() + (y - y0) * (rowSize + 1);
+			uint32_t bestSum = ~0u;
+			for (uint8_t filter = 0; filter < 5; filter++) {
+				if (filter == 3) { continue; } // average rarely wins
+				uint32_t sum = 0;
+				for (size_t x = 0; x < rowSize; x++) {
+					const int a = x >= 3 ? row[x - 3] : 0, b = up[x], c = x >= 3 ? up[x - 3] : 0;
+					int predicted = 0;
+					if (filter == 1) { predicted = a; }
+					else if (filter == 2) { predicted = b; }
+					else if (filter == 4) {
+						const int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+						predicted = pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+					}
+					candidate[x] = static_cast<uint8_t>(row[x] - predicted);
+					sum += abs(static_cast<int8_t>(candidate[x]));
+				}
+				if (sum < bestSum) {
+					bestSum = sum;
+					dst[0] = filter;
+					memcpy(dst + 1, candidate.data(), rowSize);
+				}
+			}
+		}
+
+		std::vector<uint8_t> compressed;
+		compressed.reserve(filtered.size() / 2);
+		if (s == 0) {
+			compressed.push_back(0x78); // zlib header, 32k window
+			compressed.push_back(0x01);
+		}
+		deflate_stripe(filtered.data(), filtered.size(), s == stripes - 1, compressed);
+		adlers[s] = adler32(filtered.data(), filtered.size());
+		lengths[s] = filtered.size();
+		append_png_chunk(chunks[s], "IDAT", compressed.data(), compressed.size());
+	});
+
+	uint32_t adler = adlers[0];
+	for (int s = 1; s < stripes; s++) { adler = adler32_combine(adler, adlers[s], lengths[s]); }
+
+	out.clear();
+	const uint8_t signature[8]{ 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	out.insert(out.end(), signature, signature + 8);
+	uint8_t ihdr[13]{};
+	put_be32(ihdr, width);
+	put_be32(ihdr + 4, height);
+	ihdr[8] = 8; // bit depth
+	ihdr[9] = 2; // RGB
+	append_png_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+	for (const auto& chunk : chunks) { out.insert(out.end(), chunk.begin(), chunk.end()); }
+	uint8_t checksum[4];
+	put_be32(checksum, adler);
+	append_png_chunk(out, "IDAT", checksum, 4);
+	append_png_chunk(out, "IEND", nullptr, 0);
+}
+
+static void encode_image(const vec3* pixels, int width, int height, ImageFormat format, int threads, std::vector<uint8_t>& out) {
+	switch (format) {
+	case IMAGE_QOI: encode_qoi(pixels, width, height, threads, out); break;
+	case IMAGE_PNG: encode_png(pixels, width, height, threads, out); break;
+	case IMAGE_PFM: encode_pfm(pixels, width, height, threads, out); break;
+	default: encode_bmp(pixels, width, height, threads, out); break;
+	}
+}
+
+// The whole file goes out in one write
+static bool write_file(const char* filename, const std::vector<uint8_t>& data) {
+	FILE* file = fopen(filename, "wb");
+	if (file == nullptr) {
+		printf_s("ERROR: could not open file %s\n", filename);
+		return false;
+	}
+	const bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+	return fclose(file) == 0 && ok;
+}
+
+// Encodes and writes images on a background thread so the render loop only pays for copying the pixels
+struct ImageWriter {
+private:
+	struct Job {
+		std::vector<vec3> pixels;
+		int width, height;
+		ImageFormat format;
+		std::string filename;
+	};
+
+	std::thread worker;
+	std::mutex lock;
+	std::condition_variable wake, idle;
+	std::deque<Job> jobs;
+	bool busy = false, stopping = false;
+	std::atomic<uint32_t> failures{ 0 };
+
+	void workerLoop() {
+		std::vector<uint8_t> data;
+		while (true) {
+			Job job;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [this] { return stopping || !jobs.empty(); });
+				if (jobs.empty()) { return; }
+				job = std::move(jobs.front());
+				jobs.pop_front();
+				busy = true;
+			}
+			encode_image(job.pixels.data(), job.width, job.height, job.format, encodeThreads, data);
+			if (!write_file(job.filename.c_str(), data)) { failures++; }
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				busy = false;
+			}
+			idle.notify_all();
+		}
+	}
+
+public:
+	int encodeThreads = std::max(1u, std::thread::hardware_concurrency() / 2); // Leaves half the cores to the renderer
+	size_t maxQueued = 4; // save() waits beyond this many images so a fast loop can not pile up copies
+
+	ImageWriter() { worker = std::thread(&ImageWriter::workerLoop, this); }
+
+	// Finishes every queued image first
+	~ImageWriter() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		worker.join();
+	}
+
+	ImageWriter(const ImageWriter&) = delete;
+	ImageWriter& operator=(const ImageWriter&) = delete;
+
+	void save(const std::vector<vec3>& pixels, int width, int height, const char* filename, ImageFormat format) {
+		Job job{ pixels, width, height, format, filename };
+		std::unique_lock<std::mutex> guard(lock);
+		idle.wait(guard, [this] { return jobs.size() < maxQueued; });
+		jobs.push_back(std::move(job));
+		wake.notify_one();
+	}
+
+	void save(const Framebuffer& fb, const char* filename, ImageFormat format) { save(fb.pixels, fb.width, fb.height, filename, format); }
+	void save(const Framebuffer& fb, const char* filename) { save(fb, filename, image_format_from_filename(filename)); }
+
+	// Blocks until every queued image is on disk, returns false if any of them failed since the last wait
+	bool wait() {
+		std::unique_lock<std::mutex> guard(lock);
+		idle.wait(guard, [this] { return jobs.empty() && !busy; });
+		return failures.exchange(0) == 0;
+	}
+};
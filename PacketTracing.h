@@ -0,0 +1,217 @@
+#pragma once
+
+#include <emmintrin.h>
+#include "Tracing.h"
+
+constexpr int PACKET_SIZE = 4; // One ray per SSE lane
+
+// Rays that get traversed together, stored as structure of arrays so every lane maps to one SSE slot
+struct RayPacket {
+    alignas(16) float origin[3][PACKET_SIZE]{};
+    alignas(16) float direction[3][PACKET_SIZE]{};
+    int activeMask = 0; // Bit per lane that carries a ray
+
+    void set(int lane, const vec3& o, const vec3& d) {
+        vec3 n = unit_vector(d);
+        for (int i = 0; i < 3; i++) {
+            origin[i][lane] = o[i];
+            direction[i][lane] = n[i];
+        }
+        activeMask |= 1 << lane;
+    }
+};
+
+// First solid voxel per lane, lanes without their bit in hitMask did not hit anything
+struct PacketHit {
+    int32_t voxel[3][PACKET_SIZE]{};
+    float t[PACKET_SIZE]{};
+    uint32_t material[PACKET_SIZE]{};
+    int axis[PACKET_SIZE]{};
+    int hitMask = 0;
+};
+
+// SSE2 has no integer min/max or blend, so these are built from compares
+static inline __m128i select_epi32(__m128i mask, __m128i a, __m128i b) { return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+static inline __m128i min_epi32(__m128i a, __m128i b) { return select_epi32(_mm_cmplt_epi32(a, b), a, b); }
+static inline __m128i max_epi32(__m128i a, __m128i b) { return select_epi32(_mm_cmpgt_epi32(a, b), a, b); }
+
+// Same as fastfloor() for four values at once
+static inline __m128i floor_epi32(__m128 v) {
+    __m128i i = _mm_cvttps_epi32(v);
+    return _mm_add_epi32(i, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(i), v)));
+}
+
+static inline int lane_count(int mask) { return (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1); }
+static inline __m128i lane_mask(int mask) { return _mm_set_epi32(mask & 8 ? -1 : 0, mask & 4 ? -1 : 0, mask & 2 ? -1 : 0, mask & 1 ? -1 : 0); }
+
+// Finds the first solid voxel for every active lane, skipping empty chunks and bricks per lane.
+// Lanes in the same chunk share one index lookup, once only a single lane is left it continues through traverse().
+// Every lane picks its own coarse level from its distance and the footprint, like traverse() does, and all of them begin at the start distance.
+static void traversePacket(const World& world, const RayPacket& packet, float maxDistance, PacketHit& hit, float footprint = 0.0f, float start = 0.0f) {
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), infinity = _mm_set1_ps(std::numeric_limits<float>::max()), maxT = _mm_set1_ps(maxDistance);
+    const __m128i oneI = _mm_set1_epi32(1);
+    __m128 o[3], d[3], inv[3], positive[3], parallel[3];
+    __m128i c[3];
+    const __m128 startT = _mm_set1_ps(start);
+    for (int i = 0; i < 3; i++) {
+        o[i] = _mm_load_ps(packet.origin[i]);
+        d[i] = _mm_load_ps(packet.direction[i]);
+        positive[i] = _mm_cmpgt_ps(d[i], zero);
+        parallel[i] = _mm_cmpeq_ps(d[i], zero);
+        inv[i] = _mm_div_ps(one, select_ps(parallel[i], one, d[i]));
+
+        // Start in the voxel the ray is in at the start distance when looking along its direction
+        const __m128 p = _mm_add_ps(o[i], _mm_mul_ps(d[i], startT));
+        __m128i f = floor_epi32(p);
+        __m128 onBoundary = _mm_and_ps(_mm_cmplt_ps(d[i], zero), _mm_cmpeq_ps(_mm_cvtepi32_ps(f), p));
+        c[i] = select_epi32(_mm_castps_si128(onBoundary), _mm_sub_epi32(f, oneI), f);
+    }
+    __m128 t = startT;
+    __m128i size = oneI, axis = _mm_setzero_si128();
+
+    alignas(16) int32_t cell[3][PACKET_SIZE];
+    alignas(16) int32_t sizes[PACKET_SIZE]{ 1, 1, 1, 1 };
+    alignas(16) int32_t axes[PACKET_SIZE];
+    alignas(16) float distances[PACKET_SIZE];
+
+    hit.hitMask = 0;
+    int active = packet.activeMask;
+    while (active) {
+        // Nothing left to share, finish the last ray on its own
+        if ((active & (active - 1)) == 0) {
+            int lane = 0;
+            while (!((active >> lane) & 1)) { lane++; }
+            _mm_store_ps(distances, t);
+            // Its current cell is known to be empty, so traverse() can pick the ray up where it is
+            const vec3 lo(packet.origin[0][lane], packet.origin[1][lane], packet.origin[2][lane]);
+            const vec3 ld(packet.direction[0][lane], packet.direction[1][lane], packet.direction[2][lane]);
+            VoxelHit single;
+            if (traverse(world, lo, ld, maxDistance, single, footprint, distances[lane])) {
+                for (int i = 0; i < 3; i++) { hit.voxel[i][lane] = single.voxel[i]; }
+                hit.t[lane] = single.t;
+                hit.axis[lane] = single.axis;
+                hit.material[lane] = single.material;
+                hit.hitMask |= 1 << lane;
+            }
+            break;
+        }
+        const __m128i activeLanes = lane_mask(active);
+        threadCounters.steps += lane_count(active);
+
+        // Leave the current cell, for cells of size 1 this is a regular DDA step
+        const __m128i sizeMinus1 = _mm_sub_epi32(size, oneI);
+        __m128i base[3];
+        __m128 tAxis[3];
+        for (int i = 0; i < 3; i++) {
+            base[i] = _mm_andnot_si128(sizeMinus1, c[i]);
+            __m128i boundary = select_epi32(_mm_castps_si128(positive[i]), _mm_add_epi32(base[i], size), base[i]);
+            tAxis[i] = select_ps(parallel[i], infinity, _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(boundary), o[i]), inv[i]));
+        }
+        const __m128 xExit = _mm_and_ps(_mm_cmple_ps(tAxis[0], tAxis[1]), _mm_cmple_ps(tAxis[0], tAxis[2]));
+        const __m128 yExit = _mm_andnot_ps(xExit, _mm_cmple_ps(tAxis[1], tAxis[2]));
+        const __m128 zExit = _mm_andnot_ps(_mm_or_ps(xExit, yExit), _mm_castsi128_ps(_mm_set1_epi32(-1)));
+        const __m128 exits[3]{ xExit, yExit, zExit };
+        const __m128 tExit = _mm_min_ps(tAxis[0], _mm_min_ps(tAxis[1], tAxis[2]));
+        t = select_ps(_mm_castsi128_ps(activeLanes), _mm_max_ps(t, tExit), t);
+
+        for (int i = 0; i < 3; i++) {
+            __m128i exitCell = select_epi32(_mm_castps_si128(positive[i]), _mm_add_epi32(base[i], size), _mm_sub_epi32(base[i], oneI));
+            __m128i inside = min_epi32(max_epi32(floor_epi32(_mm_add_ps(o[i], _mm_mul_ps(d[i], t))), base[i]), _mm_add_epi32(base[i], sizeMinus1));
+            c[i] = select_epi32(activeLanes, select_epi32(_mm_castps_si128(exits[i]), exitCell, inside), c[i]);
+        }
+        __m128i exitAxis = select_epi32(_mm_castps_si128(yExit), oneI, _mm_setzero_si128());
+        exitAxis = select_epi32(_mm_castps_si128(zExit), _mm_set1_epi32(2), exitAxis);
+        axis = select_epi32(activeLanes, exitAxis, axis);
+
+        // Lanes that went past the render distance missed
+        active &= ~_mm_movemask_ps(_mm_cmpge_ps(t, maxT));
+
+        // Look at the cells the lanes entered, neighbouring lanes usually share a chunk
+        for (int i = 0; i < 3; i++) { _mm_store_si128(reinterpret_cast<__m128i*>(cell[i]), c[i]); }
+        _mm_store_si128(reinterpret_cast<__m128i*>(axes), axis);
+        _mm_store_ps(distances, t);
+        const Chunk* chunk = nullptr;
+        int32_t chunkLoc[3]{ 0, 0, 0 };
+        bool haveChunk = false;
+        for (int lane = 0; lane < PACKET_SIZE; lane++) {
+            if (!((active >> lane) & 1)) { sizes[lane] = 1; continue; }
+            const int32_t cx = cell[0][lane] >> CHUNK_SHIFT, cy = cell[1][lane] >> CHUNK_SHIFT, cz = cell[2][lane] >> CHUNK_SHIFT;
+            if (!haveChunk || cx != chunkLoc[0] || cy != chunkLoc[1] || cz != chunkLoc[2]) {
+                chunk = world.find_chunk(cx, cy, cz);
+                if (chunk == nullptr) { world.request_chunk(cx, cy, cz); }
+                chunkLoc[0] = cx; chunkLoc[1] = cy; chunkLoc[2] = cz;
+                haveChunk = true;
+            }
+            uint32_t voxel;
+            sizes[lane] = World::probe_chunk(chunk, cell[0][lane], cell[1][lane], cell[2][lane], voxel, lod_level(distances[lane], footprint));
+            if (voxel != 0) {
+                for (int i = 0; i < 3; i++) { hit.voxel[i][lane] = cell[i][lane]; }
+                hit.t[lane] = distances[lane];
+                hit.axis[lane] = axes[lane];
+                hit.material[lane] = voxel;
+                hit.hitMask |= 1 << lane;
+                active &= ~(1 << lane);
+            }
+        }
+        size = _mm_load_si128(reinterpret_cast<const __m128i*>(sizes));
+    }
+}
+
+// Traces and shades a packet of rays. Hits whose sun shadow is not cached yet send their shadow rays out as a second packet, like cachedShadow() does for single rays.
+// Reflections and refractions continue as single rays through trace(). Depths, if given, gets the distance to every lane's hit, negative for a miss.
+// The footprint lets the packet use coarse levels, see lod_level(), shadows and reflections always see the voxels.
+// The start distance has to be empty for every lane, see beam_start().
+static void tracePacket(const vec3& source, const RayPacket& packet, World& world, int bounces, int maxBounces, vec3* colors, float* depths = nullptr, float footprint = 0.0f, float start = 0.0f) {
+    PacketHit hits;
+    if (bounces > 0) {
+        const int lanes = lane_count(packet.activeMask);
+        threadCounters.rays += lanes;
+        threadCounters.bounceDepths[std::min(maxBounces - bounces, PROFILE_BOUNCE_DEPTHS - 1)] += lanes;
+        traversePacket(world, packet, MAX_CHUNK_DISTANCE, hits, footprint, start);
+    }
+    if (depths != nullptr) {
+        for (int lane = 0; lane < PACKET_SIZE; lane++) { depths[lane] = (hits.hitMask >> lane) & 1 ? hits.t[lane] : -1.0f; }
+    }
+
+    RayPacket shadows;
+    int32_t cells[PACKET_SIZE][3];
+    uint32_t shadowedMask = 0;
+    for (int lane = 0; lane < PACKET_SIZE; lane++) {
+        if (!((hits.hitMask >> lane) & 1)) { continue; }
+        vec3 direction(packet.direction[0][lane], packet.direction[1][lane], packet.direction[2][lane]);
+        vec3 start = vec3(packet.origin[0][lane], packet.origin[1][lane], packet.origin[2][lane]) + direction * hits.t[lane] - direction * 0.0001f;
+        int32_t* cell = cells[lane];
+        cell[0] = fastfloor(start.x()); cell[1] = fastfloor(start.y()); cell[2] = fastfloor(start.z());
+        bool shadowed;
+        if (world.find_sun_shadow(cell[0], cell[1], cell[2], shadowed)) {
+            shadowedMask |= static_cast<uint32_t>(shadowed) << lane;
+            continue;
+        }
+        shadows.set(lane, vec3(cell[0] + 0.5f, cell[1] + 0.5f, cell[2] + 0.5f), world.sunDirection);
+    }
+    if (shadows.activeMask) {
+        PacketHit occluders;
+        threadCounters.shadowRays += lane_count(shadows.activeMask);
+        traversePacket(world, shadows, MAX_CHUNK_DISTANCE, occluders);
+        for (int lane = 0; lane < PACKET_SIZE; lane++) {
+            if (!((shadows.activeMask >> lane) & 1)) { continue; }
+            const bool shadowed = (occluders.hitMask >> lane) & 1;
+            world.store_sun_shadow(cells[lane][0], cells[lane][1], cells[lane][2], shadowed);
+            shadowedMask |= static_cast<uint32_t>(shadowed) << lane;
+        }
+    }
+
+    for (int lane = 0; lane < PACKET_SIZE; lane++) {
+        if (!((packet.activeMask >> lane) & 1)) { continue; }
+        vec3 direction(packet.direction[0][lane], packet.direction[1][lane], packet.direction[2][lane]);
+        if (!((hits.hitMask >> lane) & 1)) {
+            colors[lane] = skybox(direction);
+            continue;
+        }
+        vec3 location = vec3(packet.origin[0][lane], packet.origin[1][lane], packet.origin[2][lane]) + direction * hits.t[lane];
+        vec3 normal(0.0f, 0.0f, 0.0f);
+        normal[hits.axis[lane]] = direction[hits.axis[lane]] > 0.0f ? -1.0f : 1.0f;
+        colors[lane] = shade(source, location, direction, normal, hits.material[lane], (shadowedMask >> lane) & 1, world, bounces, maxBounces);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string.h>
+#include <vector>
+
+constexpr int PROFILE_BOUNCE_DEPTHS = 8; // Deeper bounces are counted with the last one
+
+// Work counted by the thread doing it. Plain counters, they are only summed up between frames while the render threads wait.
+struct ThreadCounters {
+	uint64_t rays; // Rays sent into the world for shading, one per bounce, packet lanes count one each
+	uint64_t steps; // Cells visited by the traversals, a skipped empty chunk or brick counts as one
+	uint64_t voxelLookups, voxelMisses; // World::get_voxel calls, and the ones whose chunk was not loaded
+	uint64_t shadowRays; // Traced sun shadows, cached ones are not counted
+	uint64_t bounceDepths[PROFILE_BOUNCE_DEPTHS]; // Rays by how many bounces deep they are, 0 for the ones from the camera
+
+	void add(const ThreadCounters& o, int64_t sign = 1) {
+		rays += o.rays * sign;
+		steps += o.steps * sign;
+		voxelLookups += o.voxelLookups * sign;
+		voxelMisses += o.voxelMisses * sign;
+		shadowRays += o.shadowRays * sign;
+		for (int i = 0; i < PROFILE_BOUNCE_DEPTHS; i++) { bounceDepths[i] += o.bounceDepths[i] * sign; }
+	}
+};
+
+static thread_local ThreadCounters threadCounters{}; // Zero initialised, so counting costs no more than any other thread local
+
+// Every thread that counts work registers once, so the counters can be summed over all of them
+struct CounterRegistry {
+	std::mutex lock;
+	std::vector<ThreadCounters*> threads;
+	ThreadCounters retired{}; // Counted by threads that exited since
+};
+
+inline CounterRegistry& counter_registry() {
+	static CounterRegistry registry;
+	return registry;
+}
+
+// Takes a thread's counters out of the registry when the thread exits, keeping what it counted
+struct CounterRegistration {
+	bool registered = false;
+
+	~CounterRegistration() {
+		if (!registered) { return; }
+		CounterRegistry& registry = counter_registry();
+		std::lock_guard<std::mutex> guard(registry.lock);
+		registry.retired.add(threadCounters);
+		registry.threads.erase(std::remove(registry.threads.begin(), registry.threads.end(), &threadCounters), registry.threads.end());
+	}
+};
+
+// Call on every thread that counts work before it starts, calling it again does nothing
+static void register_thread_counters() {
+	static thread_local CounterRegistration registration;
+	if (registration.registered) { return; }
+	CounterRegistry& registry = counter_registry();
+	std::lock_guard<std::mutex> guard(registry.lock);
+	registry.threads.push_back(&threadCounters);
+	registration.registered = true;
+}
+
+// Everything every registered thread counted so far, call while none of them is working
+static ThreadCounters sum_thread_counters() {
+	register_thread_counters();
+	CounterRegistry& registry = counter_registry();
+	std::lock_guard<std::mutex> guard(registry.lock);
+	ThreadCounters sum = registry.retired;
+	for (const ThreadCounters* c : registry.threads) { sum.add(*c); }
+	return sum;
+}
+
+// Small number per thread for the rows of the trace, in the order the threads first time a stage
+inline uint32_t profile_track() {
+	static std::atomic<uint32_t> next{ 0 };
+	static thread_local uint32_t track = next++;
+	return track;
+}
+
+// Times the stages of every frame and what the threads counted during it. Writes a Chrome trace (chrome://tracing or Perfetto) with one event
+// per stage and the counters per frame, and a CSV with the mean and maximum of every stage and counter over each window of frames.
+// Stages can be timed on any thread and get a row per thread in the trace, the counters are only read at the end of the frame.
+// Does nothing until it is opened.
+struct Profiler {
+private:
+	struct Event {
+		const char* name;
+		uint64_t start, duration; // Microseconds since open
+		uint32_t track; // See profile_track()
+	};
+
+	struct Stage {
+		const char* name;
+		uint64_t calls = 0;
+		double totalMs = 0.0, maxMs = 0.0;
+	};
+
+	FILE* trace = nullptr;
+	FILE* summary = nullptr;
+	std::mutex eventLock;
+	bool firstEvent = true;
+	std::chrono::steady_clock::time_point origin;
+	std::vector<Event> events; // Of the current frame
+	std::vector<Stage> stages; // Of the current window
+	ThreadCounters last{}, windowTotal{}, windowMax{};
+	uint64_t frame = 0, frameStart = 0;
+	uint32_t windowFrames = 0;
+
+	void separator() {
+		fputs(firstEvent ? "\n" : ",\n", trace);
+		firstEvent = false;
+	}
+
+	void writeCounter(uint64_t ts, const char* name, const char* keys[], const uint64_t values[], int count) {
+		separator();
+		fprintf(trace, "{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":%llu,\"args\":{", name, static_cast<unsigned long long>(ts));
+		for (int i = 0; i < count; i++) { fprintf(trace, "%s\"%s\":%llu", i > 0 ? "," : "", keys[i], static_cast<unsigned long long>(values[i])); }
+		fputs("}}", trace);
+	}
+
+	Stage& stage(const char* name) {
+		for (Stage& s : stages) { if (s.name == name || strcmp(s.name, name) == 0) { return s; } }
+		stages.push_back(Stage());
+		stages.back().name = name;
+		return stages.back();
+	}
+
+	// One row per stage and counter for the frames since the last window
+	void writeSummary() {
+		if (windowFrames == 0) { return; }
+		const double n = static_cast<double>(windowFrames);
+		for (const Stage& s : stages) {
+			fprintf(summary, "%llu,%s,ms,%llu,%.4f,%.4f\n", static_cast<unsigned long long>(frame), s.name, static_cast<unsigned long long>(s.calls), s.calls > 0 ? s.totalMs / s.calls : 0.0, s.maxMs);
+		}
+		auto counter = [this, n](const char* name, uint64_t total, uint64_t most) {
+			fprintf(summary, "%llu,%s,per frame,%llu,%.2f,%llu\n", static_cast<unsigned long long>(frame), name, static_cast<unsigned long long>(total), total / n, static_cast<unsigned long long>(most));
+		};
+		counter("rays", windowTotal.rays, windowMax.rays);
+		counter("steps", windowTotal.steps, windowMax.steps);
+		counter("voxel_lookups", windowTotal.voxelLookups, windowMax.voxelLookups);
+		counter("voxel_misses", windowTotal.voxelMisses, windowMax.voxelMisses);
+		counter("shadow_rays", windowTotal.shadowRays, windowMax.shadowRays);
+		char name[32];
+		for (int d = 0; d < PROFILE_BOUNCE_DEPTHS; d++) {
+			snprintf(name, sizeof(name), d + 1 < PROFILE_BOUNCE_DEPTHS ? "bounce_%d" : "bounce_%d_or_more", d);
+			counter(name, windowTotal.bounceDepths[d], windowMax.bounceDepths[d]);
+		}
+		fflush(summary);
+		stages.clear();
+		windowTotal = ThreadCounters{};
+		windowMax = ThreadCounters{};
+		windowFrames = 0;
+	}
+
+public:
+	uint32_t summaryFrames = 60; // Frames per window of the CSV summary
+
+	Profiler() {}
+	~Profiler() { close(); }
+
+	Profiler(const Profiler&) = delete;
+	Profiler& operator=(const Profiler&) = delete;
+
+	// Starts writing <prefix>.json and <prefix>.csv, returns false if either could not be created
+	bool open(const char* prefix) {
+		close();
+		const std::string base(prefix);
+		trace = fopen((base + ".json").c_str(), "w");
+		summary = fopen((base + ".csv").c_str(), "w");
+		if (trace == nullptr || summary == nullptr) {
+			close();
+			return false;
+		}
+		fputs("{\"traceEvents\":[", trace);
+		fputs("frame,name,unit,count,mean,max\n", summary);
+		firstEvent = true;
+		origin = std::chrono::steady_clock::now();
+		profile_track(); // The thread that opens the profiler gets the first row
+		last = sum_thread_counters();
+		frame = 0;
+		return true;
+	}
+
+	// Writes what is left of the last window and finishes both files
+	void close() {
+		if (summary != nullptr) {
+			writeSummary();
+			fclose(summary);
+			summary = nullptr;
+		}
+		if (trace != nullptr) {
+			fputs("\n]}\n", trace);
+			fclose(trace);
+			trace = nullptr;
+		}
+	}
+
+	inline bool enabled() const { return trace != nullptr; }
+
+	inline uint64_t now() const { return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count()); }
+
+	void begin_frame() {
+		if (!enabled()) { return; }
+		std::lock_guard<std::mutex> guard(eventLock);
+		events.clear();
+		frameStart = now();
+	}
+
+	inline void record(const char* name, uint64_t start, uint64_t end) {
+		if (!enabled()) { return; }
+		std::lock_guard<std::mutex> guard(eventLock);
+		events.push_back({ name, start, end - start, profile_track() });
+	}
+
+	// Takes the counters of all threads and writes the frame, call while no render thread is working
+	void end_frame() {
+		if (!enabled()) { return; }
+		const uint64_t end = now();
+		record("frame", frameStart, end);
+		std::lock_guard<std::mutex> guard(eventLock);
+
+		ThreadCounters counters = sum_thread_counters(), delta = counters;
+		delta.add(last, -1);
+		last = counters;
+
+		for (const Event& e : events) {
+			separator();
+			fprintf(trace, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"dur\":%llu,\"args\":{\"frame\":%llu}}",
+				e.name, e.track, static_cast<unsigned long long>(e.start), static_cast<unsigned long long>(e.duration), static_cast<unsigned long long>(frame));
+			Stage& s = stage(e.name);
+			const double ms = e.duration / 1000.0;
+			s.calls++;
+			s.totalMs += ms;
+			s.maxMs = std::max(s.maxMs, ms);
+		}
+		const char* rayKeys[] = { "rays", "shadow rays" };
+		const uint64_t rayValues[] = { delta.rays, delta.shadowRays };
+		writeCounter(frameStart, "rays", rayKeys, rayValues, 2);
+		const char* stepKeys[] = { "steps" };
+		writeCounter(frameStart, "steps", stepKeys, &delta.steps, 1);
+		const char* voxelKeys[] = { "lookups", "misses" };
+		const uint64_t voxelValues[] = { delta.voxelLookups, delta.voxelMisses };
+		writeCounter(frameStart, "voxels", voxelKeys, voxelValues, 2);
+		const char* depthKeys[PROFILE_BOUNCE_DEPTHS] = { "0", "1", "2", "3", "4", "5", "6", "7+" };
+		writeCounter(frameStart, "bounce depth", depthKeys, delta.bounceDepths, PROFILE_BOUNCE_DEPTHS);
+
+		windowTotal.add(delta);
+		windowMax.rays = std::max(windowMax.rays, delta.rays);
+		windowMax.steps = std::max(windowMax.steps, delta.steps);
+		windowMax.voxelLookups = std::max(windowMax.voxelLookups, delta.voxelLookups);
+		windowMax.voxelMisses = std::max(windowMax.voxelMisses, delta.voxelMisses);
+		windowMax.shadowRays = std::max(windowMax.shadowRays, delta.shadowRays);
+		for (int d = 0; d < PROFILE_BOUNCE_DEPTHS; d++) { windowMax.bounceDepths[d] = std::max(windowMax.bounceDepths[d], delta.bounceDepths[d]); }
+		frame++;
+		if (++windowFrames >= summaryFrames) { writeSummary(); }
+	}
+};
+
+// Times the enclosing block as a stage of the profiler's current frame, costs a branch when the profiler is not open
+struct ProfileScope {
+	Profiler& profiler;
+	const char* name; // Has to outlive the frame
+	uint64_t start;
+
+	ProfileScope(Profiler& p, const char* stageName) : profiler(p), name(stageName), start(p.enabled() ? p.now() : 0) {}
+	~ProfileScope() { if (profiler.enabled()) { profiler.record(name, start, profiler.now()); } }
+
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+};
@@ -21,6 +21,17 @@ public:
 	}
 };
 
-auto random = Random(0xA6E9377DAF75BDFEULL, 0x863F5CB508510D95ULL);
+auto globalRandom = Random(0xA6E9377DAF75BDFEULL, 0x863F5CB508510D95ULL);
 
-inline float randDouble() { return float(random.next() / 4294967295.0f); }
\ No newline at end of file
+inline float randDouble() { return float(globalRandom.next() / 4294967295.0f); }
+
+// Stateless splitmix64 hash, lets every pixel and sample derive its own random numbers without sharing a generator between threads
+static inline uint64_t hash64(uint64_t x) {
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+// Uses the top 24 bits so the result is always below 1
+static inline float hashToFloat(uint64_t h) { return static_cast<float>(h >> 40) * (1.0f / 16777216.0f); }
\ No newline at end of file
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "World.h"
+
+constexpr int32_t REGION_SHIFT = 3; // log2 of the region width in chunks, a region file holds 8x8x8 chunks
+constexpr int32_t REGION_WIDTH = 1 << REGION_SHIFT;
+constexpr int32_t REGION_MASK = REGION_WIDTH - 1;
+constexpr uint32_t REGION_CHUNKS = REGION_WIDTH * REGION_WIDTH * REGION_WIDTH;
+constexpr uint32_t REGION_MAGIC = 0x47525856; // "VXRG" in a little endian file
+constexpr uint32_t REGION_VERSION = 1;
+constexpr uint64_t REGION_ALIGN = 64; // Records start on a cache line
+
+// A region file is this header, the table with one entry per chunk and the chunk records. Records are only ever appended and the table
+// is rewritten after them, so chunks that still read from an older mapping of the file keep seeing their voxels and a write that did not
+// finish leaves the old table pointing at the old records. Files are in the byte order of the machine that wrote them.
+struct RegionHeader {
+	uint32_t magic, version;
+	uint64_t liveBytes; // Bytes of the records the table points to, the rest after the table is stale
+};
+
+struct RegionEntry {
+	uint64_t offset; // From the start of the file
+	uint32_t length; // 0 if the chunk was never saved
+	uint32_t reserved;
+};
+
+constexpr uint64_t REGION_DATA_START = (sizeof(RegionHeader) + REGION_CHUNKS * sizeof(RegionEntry) + REGION_ALIGN - 1) & ~(REGION_ALIGN - 1);
+
+static inline uint64_t region_align(uint64_t bytes) { return (bytes + REGION_ALIGN - 1) & ~(REGION_ALIGN - 1); }
+
+// Maps a whole file read only, the mapping lives until the last copy of the returned pointer is gone. Returns nullptr if the file does not exist or is empty.
+static std::shared_ptr<const uint8_t> map_file(const std::string& path, size_t& size) {
+	size = 0;
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) { return nullptr; }
+	LARGE_INTEGER length;
+	if (!GetFileSizeEx(file, &length) || length.QuadPart <= 0) {
+		CloseHandle(file);
+		return nullptr;
+	}
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr) { return nullptr; }
+	const void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping); // The view keeps the mapping open
+	if (view == nullptr) { return nullptr; }
+	size = static_cast<size_t>(length.QuadPart);
+	return std::shared_ptr<const uint8_t>(static_cast<const uint8_t*>(view), [](const uint8_t* p) { UnmapViewOfFile(p); });
+#else
+	const int file = open(path.c_str(), O_RDONLY);
+	if (file < 0) { return nullptr; }
+	struct stat info;
+	if (fstat(file, &info) != 0 || info.st_size <= 0) {
+		close(file);
+		return nullptr;
+	}
+	const size_t length = static_cast<size_t>(info.st_size);
+	void* view = mmap(nullptr, length, PROT_READ, MAP_SHARED, file, 0);
+	close(file); // The mapping keeps the file open
+	if (view == MAP_FAILED) { return nullptr; }
+	size = length;
+	return std::shared_ptr<const uint8_t>(static_cast<const uint8_t*>(view), [length](const uint8_t* p) { munmap(const_cast<uint8_t*>(p), length); });
+#endif
+}
+
+// Keeps a world on disk as region files in one directory. Loaded chunks read their voxels straight from the mapped files and only copy
+// them once they get edited, saving appends the edited chunks of every region in one sequential write.
+struct RegionStore {
+private:
+	struct Region {
+		std::shared_ptr<const uint8_t> mapping; // nullptr if the file does not exist or is damaged
+		size_t size = 0;
+	};
+
+	std::string directory;
+	std::mutex lock; // Loads come from the streaming threads
+	std::unordered_map<uint64_t, Region> regions; // Mapped on first use, by region location key
+
+	static inline ChunkLocation region_of(const ChunkLocation& loc) { return ChunkLocation(loc.x >> REGION_SHIFT, loc.y >> REGION_SHIFT, loc.z >> REGION_SHIFT); }
+	static inline uint32_t entry_of(const ChunkLocation& loc) { return static_cast<uint32_t>(((loc.z & REGION_MASK) << (REGION_SHIFT * 2)) | ((loc.y & REGION_MASK) << REGION_SHIFT) | (loc.x & REGION_MASK)); }
+
+	std::string path(const ChunkLocation& region) const {
+		char name[64];
+		snprintf(name, sizeof(name), "r.%d.%d.%d.vxr", region.x, region.y, region.z);
+		return (std::filesystem::path(directory) / name).string();
+	}
+
+	// The region's current mapping, opened on first use. Call with the lock held.
+	Region& mapped(const ChunkLocation& region) {
+		auto found = regions.find(region.key());
+		if (found != regions.end()) { return found->second; }
+		Region& r = regions[region.key()];
+		r.mapping = map_file(path(region), r.size);
+		RegionHeader header;
+		if (r.mapping == nullptr) { return r; }
+		memcpy(&header, r.mapping.get(), std::min(sizeof(header), r.size));
+		if (r.size < REGION_DATA_START || header.magic != REGION_MAGIC || header.version != REGION_VERSION) {
+			printf_s("WARNING: Region file %s is damaged or from another version, its chunks are generated again\n", path(region).c_str());
+			r.mapping = nullptr;
+			r.size = 0;
+		}
+		return r;
+	}
+
+	static bool readTable(FILE* file, RegionHeader& header, std::vector<RegionEntry>& table) {
+		table.resize(REGION_CHUNKS);
+		return fread(&header, sizeof(header), 1, file) == 1 && fread(table.data(), sizeof(RegionEntry), REGION_CHUNKS, file) == REGION_CHUNKS
+			&& header.magic == REGION_MAGIC && header.version == REGION_VERSION;
+	}
+
+	// Writes header, table and the padding up to the first record at the start of the file
+	static bool writeTable(FILE* file, RegionHeader& header, const std::vector<RegionEntry>& table) {
+		header.liveBytes = 0;
+		for (const RegionEntry& e : table) { header.liveBytes += region_align(e.length); }
+		static const uint8_t padding[REGION_ALIGN]{ 0 };
+		const size_t pad = static_cast<size_t>(REGION_DATA_START - sizeof(header) - table.size() * sizeof(RegionEntry));
+		return fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(table.data(), sizeof(RegionEntry), table.size(), file) == table.size()
+			&& fwrite(padding, 1, pad, file) == pad;
+	}
+
+	// Rewrites a region with only the records its table points to. The new file replaces the old one by name, so mappings of the old one stay valid.
+	// Fails harmlessly where the old file cannot be replaced while it is mapped, the region then just keeps growing until it can.
+	bool compact(const ChunkLocation& region) {
+		const std::string name = path(region), temporary = name + ".tmp";
+		size_t size;
+		std::shared_ptr<const uint8_t> old = map_file(name, size);
+		if (old == nullptr || size < REGION_DATA_START) { return false; }
+		RegionHeader header;
+		std::vector<RegionEntry> table(REGION_CHUNKS);
+		memcpy(&header, old.get(), sizeof(header));
+		memcpy(table.data(), old.get() + sizeof(header), REGION_CHUNKS * sizeof(RegionEntry));
+
+		std::vector<uint8_t> records;
+		records.reserve(static_cast<size_t>(header.liveBytes));
+		for (RegionEntry& e : table) {
+			if (e.length == 0) { continue; }
+			if (e.offset + e.length > size) { return false; }
+			const size_t at = records.size();
+			records.resize(at + static_cast<size_t>(region_align(e.length)), 0);
+			memcpy(records.data() + at, old.get() + e.offset, e.length);
+			e.offset = REGION_DATA_START + at;
+		}
+
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if (file == nullptr) { return false; }
+		bool ok = writeTable(file, header, table) && fwrite(records.data(), 1, records.size(), file) == records.size();
+		ok = fclose(file) == 0 && ok;
+		std::error_code error;
+		if (ok) { std::filesystem::rename(temporary, name, error); }
+		if (!ok || error) {
+			std::filesystem::remove(temporary, error);
+			return false;
+		}
+		return true;
+	}
+
+	// Appends the records of chunks that are all in one region, sorted by their place in it, then points the table at them
+	bool writeRegion(const ChunkLocation& region, const std::vector<const Chunk*>& batch) {
+		const std::string name = path(region);
+		RegionHeader header{ REGION_MAGIC, REGION_VERSION, 0 };
+		std::vector<RegionEntry> table;
+		FILE* file = fopen(name.c_str(), "r+b");
+		if (file != nullptr) {
+			if (!readTable(file, header, table)) {
+				printf_s("WARNING: Region file %s is damaged or from another version, not writing to it\n", name.c_str());
+				fclose(file);
+				return false;
+			}
+		} else {
+			file = fopen(name.c_str(), "w+b");
+			if (file == nullptr) { return false; }
+			table.assign(REGION_CHUNKS, RegionEntry{ 0, 0, 0 });
+			if (!writeTable(file, header, table)) {
+				fclose(file);
+				return false;
+			}
+		}
+
+		// Every file ends on a record boundary, so the batch goes right at the end
+		if (fseek(file, 0, SEEK_END) != 0) {
+			fclose(file);
+			return false;
+		}
+		const uint64_t end = static_cast<uint64_t>(ftell(file));
+		std::vector<uint8_t> records;
+		for (const Chunk* c : batch) {
+			const size_t length = c->record_size(), at = records.size();
+			records.resize(at + static_cast<size_t>(region_align(length)), 0);
+			c->write_record(records.data() + at);
+			table[entry_of(c->loc)] = RegionEntry{ end + at, static_cast<uint32_t>(length), 0 };
+		}
+		bool ok = fwrite(records.data(), 1, records.size(), file) == records.size() && fflush(file) == 0 && writeTable(file, header, table);
+		ok = fclose(file) == 0 && ok;
+		bytesWritten += records.size();
+
+		const uint64_t stale = end + records.size() - REGION_DATA_START - header.liveBytes;
+		if (ok && stale > header.liveBytes) { compact(region); }
+		return ok;
+	}
+
+public:
+	std::atomic<uint64_t> chunksLoaded{ 0 };
+	uint64_t chunksSaved = 0, bytesWritten = 0;
+
+	explicit RegionStore(const std::string& dir) : directory(dir) {}
+
+	RegionStore(const RegionStore&) = delete;
+	RegionStore& operator=(const RegionStore&) = delete;
+
+	// Creates the directory if needed, returns false if it cannot be used
+	bool open() {
+		std::error_code error;
+		std::filesystem::create_directories(directory, error);
+		return std::filesystem::is_directory(directory, error);
+	}
+
+	// Points the chunk at its record in the region file, safe to call from any thread.
+	// Returns false if the chunk was never saved, it has to be generated then.
+	bool load(const ChunkLocation& loc, Chunk& chunk) {
+		std::shared_ptr<const uint8_t> mapping;
+		RegionEntry entry;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			const Region& r = mapped(region_of(loc));
+			if (r.mapping == nullptr) { return false; }
+			memcpy(&entry, r.mapping.get() + sizeof(RegionHeader) + entry_of(loc) * sizeof(RegionEntry), sizeof(entry));
+			if (entry.length == 0) { return false; }
+			if (entry.offset < REGION_DATA_START || entry.offset + entry.length > r.size) {
+				printf_s("WARNING: Chunk %d %d %d points past the end of its region file\n", loc.x, loc.y, loc.z);
+				return false;
+			}
+			mapping = r.mapping;
+		}
+		const uint8_t* record = mapping.get() + entry.offset;
+		if (!chunk.map_record(record, entry.length, loc, std::move(mapping))) {
+			printf_s("WARNING: Chunk %d %d %d is damaged in its region file\n", loc.x, loc.y, loc.z);
+			return false;
+		}
+		chunksLoaded.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Writes the world's edited chunks, or every resident chunk with everything set, as one batch of appended records per region.
+	// Not safe to use while rendering. Returns false if a region could not be written, its chunks stay edited for the next save.
+	bool save(World& world, bool everything = false) {
+		std::vector<const Chunk*> chunks;
+		world.collect_chunks(chunks, everything);
+		auto order = [](const Chunk* c) { return std::make_pair(region_of(c->loc).key(), entry_of(c->loc)); };
+		std::sort(chunks.begin(), chunks.end(), [&order](const Chunk* a, const Chunk* b) { return order(a) < order(b); });
+
+		std::lock_guard<std::mutex> guard(lock); // Loads must not read a table while it is rewritten
+		bool ok = true;
+		std::vector<const Chunk*> batch;
+		for (size_t first = 0; first < chunks.size();) {
+			const ChunkLocation region = region_of(chunks[first]->loc);
+			size_t last = first;
+			while (last < chunks.size() && region_of(chunks[last]->loc).key() == region.key()) { last++; }
+			batch.assign(chunks.begin() + first, chunks.begin() + last);
+			regions.erase(region.key()); // Mapped again with the new records on the next load
+			if (writeRegion(region, batch)) {
+				for (const Chunk* c : batch) { world.mark_saved(c->loc); }
+				chunksSaved += batch.size();
+			} else {
+				printf_s("WARNING: Could not write region file %s\n", path(region).c_str());
+				ok = false;
+			}
+			first = last;
+		}
+		return ok;
+	}
+};
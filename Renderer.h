@@ -0,0 +1,445 @@
+#pragma once
+
+#include <atomic>
+#include <limits>
+#include <vector>
+#include "PacketTracing.h"
+#include "Beam.h"
+#include "Wavefront.h"
+#include "TileScheduler.h"
+
+// Running sums per pixel so an image keeps refining over several frames while nothing changes
+struct Accumulation {
+	std::vector<vec3> sum;
+	std::vector<float> luminanceSum, luminanceSquares; // Used for the variance estimate
+	std::vector<uint32_t> samples;
+
+	// What the samples were taken of, if any of this changes they have to be thrown away
+	vec3 cameraPosition, cornerLow, cornerHigh;
+	uint64_t worldVersion = 0;
+	bool valid = false;
+
+	void reset(size_t size) {
+		sum.assign(size, vec3(0.0f, 0.0f, 0.0f));
+		luminanceSum.assign(size, 0.0f);
+		luminanceSquares.assign(size, 0.0f);
+		samples.assign(size, 0);
+		valid = false;
+	}
+
+	inline void add(size_t i, const vec3& color) {
+		const float l = 0.2126f * color.r() + 0.7152f * color.g() + 0.0722f * color.b();
+		sum[i] += color;
+		luminanceSum[i] += l;
+		luminanceSquares[i] += l * l;
+		samples[i]++;
+	}
+
+	// True once the standard error of the pixel's mean luminance is below the threshold, relative to its brightness
+	inline bool converged(size_t i, uint32_t minSamples, float threshold) const {
+		const uint32_t n = samples[i];
+		if (n < minSamples || n < 2) { return false; }
+		const float mean = luminanceSum[i] / n;
+		const float variance = std::max(0.0f, (luminanceSquares[i] / n - mean * mean) * n / (n - 1));
+		const float tolerance = std::max(threshold * mean, 0.5f / 255.0f);
+		return variance / n <= tolerance * tolerance;
+	}
+
+	inline vec3 mean(size_t i) const { return samples[i] == 0 ? vec3(0.0f, 0.0f, 0.0f) : sum[i] / static_cast<float>(samples[i]); }
+};
+
+constexpr float TEMPORAL_SKY_DISTANCE = 1e30f; // Sky counts as this far away when reprojecting, anything solid landing on the same pixel wins
+
+// What the sample through the centre of every pixel hit
+struct PixelHits {
+	std::vector<float> depth; // Distance from the camera, negative if the pixel can not be reused
+	std::vector<uint8_t> sky; // The ray missed, position holds its direction then
+	std::vector<vec3> position;
+	std::vector<int32_t> voxel; // Three coords per pixel
+	std::vector<uint32_t> material;
+	std::vector<int8_t> face; // Axis of the face that was hit plus one, negative if its normal points down the axis
+
+	void reset(size_t size) {
+		depth.assign(size, -1.0f);
+		sky.assign(size, 0);
+		position.assign(size, vec3(0.0f, 0.0f, 0.0f));
+		voxel.assign(size * 3, 0);
+		material.assign(size, 0);
+		face.assign(size, 0);
+	}
+
+	// Depth is negative for a miss. Hits on mirrors are not kept, what they show depends on where they are seen from.
+	void record(const World& world, size_t i, const vec3& origin, const vec3& direction, float t) {
+		depth[i] = -1.0f;
+		sky[i] = t < 0.0f;
+		if (sky[i]) {
+			position[i] = direction;
+			return;
+		}
+		const vec3 p = origin + direction * t;
+		int32_t v[3];
+		int axis = 0;
+		float farthest = -1.0f;
+		for (int a = 0; a < 3; a++) {
+			v[a] = fastfloor(p[a] + direction[a] * 0.001f); // Just inside the voxel that was hit
+			const float offset = std::fabs(p[a] - (static_cast<float>(v[a]) + 0.5f));
+			if (offset > farthest) { farthest = offset; axis = a; } // The face the hit is on is the one farthest from the centre
+		}
+		const uint32_t m = world.get_voxel(v[0], v[1], v[2]);
+		if (m == 0 || m >= world.materials.size()) { return; }
+		const Material& mat = world.materials[m];
+		if (mat.type == REFLECTIVE && mat.effectValue > 0.0f) { return; }
+		depth[i] = t;
+		position[i] = p;
+		for (int a = 0; a < 3; a++) { voxel[i * 3 + a] = v[a]; }
+		material[i] = m;
+		face[i] = static_cast<int8_t>(p[axis] < static_cast<float>(v[axis]) + 0.5f ? -(axis + 1) : axis + 1);
+	}
+
+	inline void copy(size_t to, const PixelHits& from, size_t i, float d) {
+		depth[to] = d;
+		sky[to] = from.sky[i];
+		position[to] = from.position[i];
+		for (int a = 0; a < 3; a++) { voxel[to * 3 + a] = from.voxel[i * 3 + a]; }
+		material[to] = from.material[i];
+		face[to] = from.face[i];
+	}
+};
+
+// Lets a frame reuse the colors of the last one where their hits are still visible, so only what moved into view has to be traced
+struct TemporalCache {
+	PixelHits hits, previous;
+	std::vector<vec3> previousColors;
+	std::vector<uint8_t> reused; // Pixels that got their color from the last frame and are not traced in this one
+	bool anyReused = false; // Some pixels are still marked as reused
+	std::vector<int32_t> source; // Last frame's pixel that landed on each pixel
+	std::vector<float> nearest; // Distance of that pixel's hit
+	bool valid = false; // Hits were recorded for every pixel
+
+	void reset(size_t size) {
+		hits.reset(size);
+		reused.assign(size, 0);
+		anyReused = false;
+		valid = false;
+	}
+};
+
+// Linear float color per pixel, does not depend on SDL so it can be rendered into without a window
+struct Framebuffer {
+	int width = 0, height = 0;
+	std::vector<vec3> pixels;
+	Accumulation accumulation;
+	TemporalCache temporal;
+
+	Framebuffer() {}
+	Framebuffer(int w, int h) { resize(w, h); }
+
+	void resize(int w, int h) {
+		width = w;
+		height = h;
+		pixels.assign(static_cast<size_t>(w) * h, vec3(0.0f, 0.0f, 0.0f));
+		accumulation.reset(pixels.size());
+		temporal.reset(pixels.size());
+	}
+
+	inline vec3& at(int x, int y) { return pixels[y * width + x]; }
+	inline const vec3& at(int x, int y) const { return pixels[y * width + x]; }
+};
+
+struct Renderer {
+private:
+	static inline bool same(const vec3& a, const vec3& b) { return a[0] == b[0] && a[1] == b[1] && a[2] == b[2]; }
+
+	uint64_t frameCount = 0;
+
+	// Throws the accumulated samples away when the camera or the world changed since they were taken, returns true if it did
+	bool validate(World& world, const Camera& cam, Framebuffer& fb) {
+		Accumulation& acc = fb.accumulation;
+		const vec3 low = unit_vector(cam.get_ray(0.0f, 0.0f).direction), high = unit_vector(cam.get_ray(1.0f, 1.0f).direction); // Normalised so refocusing does not count as a change
+		if (acc.valid && acc.worldVersion == world.get_version() && same(acc.cameraPosition, cam.position) && same(acc.cornerLow, low) && same(acc.cornerHigh, high)) { return false; }
+		acc.reset(fb.pixels.size());
+		acc.cameraPosition = cam.position;
+		acc.cornerLow = low;
+		acc.cornerHigh = high;
+		acc.worldVersion = world.get_version();
+		acc.valid = true;
+		return true;
+	}
+
+	// Moves the last frame's pixels to where their hits are seen from the new camera and keeps their colors as the first sample.
+	// A pixel is reused if its voxel did not change, the face still looks at the camera, nothing closer landed on the same pixel and it is not
+	// much farther away than its neighbours, which means it would show through a gap of the surface in front. Pixels that only sky landed on get
+	// the sky for their own direction. Everything else is traced again, and so is a rolling fraction of the reused pixels so newly loaded
+	// geometry and small errors do not stay forever.
+	void reproject(World& world, const Camera& cam, Framebuffer& fb) {
+		TemporalCache& cache = fb.temporal;
+		const size_t size = fb.pixels.size();
+		const int width = fb.width, height = fb.height;
+		std::swap(cache.hits, cache.previous);
+		cache.hits.reset(size);
+		cache.previousColors = fb.pixels;
+		cache.source.assign(size, -1);
+		cache.nearest.assign(size, std::numeric_limits<float>::max());
+		std::vector<int32_t> target(size, -1);
+		std::vector<float> distance(size);
+
+		// Where every still valid hit lands, in parallel since the checks look up voxels
+		const PixelHits& old = cache.previous;
+		scheduler.run(width, height, [&world, &cam, &old, &target, &distance, width, height](const Tile& tile) {
+			for (int y = tile.y0; y < tile.y1; y++) {
+				for (int x = tile.x0; x < tile.x1; x++) {
+					const size_t j = static_cast<size_t>(y) * width + x;
+					float s, t;
+					if (old.sky[j]) {
+						if (!cam.project(cam.position + old.position[j], s, t)) { continue; }
+						const int px = fastfloor(s * width), py = fastfloor(t * height);
+						if (px < 0 || py < 0 || px >= width || py >= height) { continue; }
+						target[j] = py * width + px;
+						distance[j] = TEMPORAL_SKY_DISTANCE;
+						continue;
+					}
+					if (old.depth[j] < 0.0f) { continue; }
+					const int32_t* v = &old.voxel[j * 3];
+					const int axis = std::abs(old.face[j]) - 1;
+					const int32_t side = old.face[j] < 0 ? -1 : 1;
+					const vec3& p = old.position[j];
+					if ((cam.position[axis] - p[axis]) * side <= 0.0f) { continue; } // Seen from behind now
+					int32_t front[3]{ v[0], v[1], v[2] };
+					front[axis] += side;
+					if (world.get_voxel(v[0], v[1], v[2]) != old.material[j] || world.get_voxel(front[0], front[1], front[2]) != 0) { continue; }
+					if (!cam.project(p, s, t)) { continue; }
+					const int px = fastfloor(s * width), py = fastfloor(t * height);
+					if (px < 0 || py < 0 || px >= width || py >= height) { continue; }
+					target[j] = py * width + px;
+					distance[j] = (p - cam.position).length();
+				}
+			}
+		}, false);
+		for (size_t j = 0; j < size; j++) {
+			const int32_t k = target[j];
+			if (k >= 0 && distance[j] < cache.nearest[k]) {
+				cache.nearest[k] = distance[j];
+				cache.source[k] = static_cast<int32_t>(j);
+			}
+		}
+
+		Accumulation& acc = fb.accumulation;
+		const float tolerance = 1.0f + temporalDepthTolerance, refresh = temporalRefresh;
+		const uint64_t frame = frameCount;
+		std::atomic<uint64_t> reused{ 0 };
+		scheduler.run(width, height, [&cache, &cam, &fb, &acc, &reused, width, height, tolerance, refresh, frame](const Tile& tile) {
+			uint64_t count = 0;
+			for (int y = tile.y0; y < tile.y1; y++) {
+				for (int x = tile.x0; x < tile.x1; x++) {
+					const size_t k = static_cast<size_t>(y) * width + x;
+					cache.reused[k] = 0;
+					const int32_t j = cache.source[k];
+					if (j < 0) { continue; }
+					float closest = cache.nearest[k];
+					for (int ny = std::max(0, y - 1); ny <= std::min(height - 1, y + 1); ny++) {
+						for (int nx = std::max(0, x - 1); nx <= std::min(width - 1, x + 1); nx++) { closest = std::min(closest, cache.nearest[static_cast<size_t>(ny) * width + nx]); }
+					}
+					if (cache.nearest[k] > closest * tolerance) { continue; }
+					if (hashToFloat(hash64((frame << 32) ^ k)) < refresh) { continue; }
+					cache.hits.copy(k, cache.previous, j, cache.nearest[k]);
+					vec3 color = cache.previousColors[j];
+					if (cache.hits.sky[k]) {
+						vec3 direction = unit_vector(cam.get_ray((static_cast<float>(x) + 0.5f) / width, (static_cast<float>(y) + 0.5f) / height).direction);
+						cache.hits.position[k] = direction;
+						color = skybox(direction);
+					}
+					acc.add(k, color);
+					fb.pixels[k] = color;
+					cache.reused[k] = 1;
+					count++;
+				}
+			}
+			reused += count;
+		}, false);
+		lastReusedCount = reused;
+	}
+
+	// Sub pixel offset for the n-th sample of a pixel, the first one goes through the centre so single sample frames stay stable
+	static inline void jitter(size_t pixel, uint32_t n, float& jx, float& jy) {
+		if (n == 0) {
+			jx = 0.5f;
+			jy = 0.5f;
+			return;
+		}
+		const uint64_t h = hash64((static_cast<uint64_t>(pixel) << 32) ^ n);
+		jx = hashToFloat(h);
+		jy = hashToFloat(hash64(h));
+	}
+
+	// Start distance of the primary rays of every BEAM_SIZE block of the tile, row by row, all zero without the pre-pass.
+	// Returns the number of blocks per row.
+	static int beamStarts(const World& world, const Camera& cam, const Tile& tile, float wp, float hp, float footprint, bool beam, std::vector<float>& starts) {
+		const int blocksX = (tile.x1 - tile.x0 + BEAM_SIZE - 1) / BEAM_SIZE, blocksY = (tile.y1 - tile.y0 + BEAM_SIZE - 1) / BEAM_SIZE;
+		starts.assign(static_cast<size_t>(blocksX) * blocksY, 0.0f);
+		if (!beam) { return blocksX; }
+		for (int by = 0; by < blocksY; by++) {
+			for (int bx = 0; bx < blocksX; bx++) {
+				const int x0 = tile.x0 + bx * BEAM_SIZE, y0 = tile.y0 + by * BEAM_SIZE;
+				const int x1 = std::min(x0 + BEAM_SIZE, tile.x1), y1 = std::min(y0 + BEAM_SIZE, tile.y1);
+				starts[static_cast<size_t>(by) * blocksX + bx] = beam_start(world, cam, x0 * wp, y0 * hp, x1 * wp, y1 * hp, footprint);
+			}
+		}
+		return blocksX;
+	}
+
+public:
+	bool packetTracing = true; // Trace 2x2 pixel blocks as one SSE ray packet
+	bool wavefront = false; // Trace every tile as batches of rays that go through traversal, shadows and shading one stage at a time, overrides packetTracing
+	uint32_t minSamples = 4; // Samples a pixel needs before it can count as converged
+	uint32_t maxSamples = 1024; // Stop refining after this many samples even if the pixel is still noisy
+	float convergenceThreshold = 0.01f; // Relative standard error of a pixel's luminance at which it stops getting samples
+	uint64_t lastSampleCount = 0; // Samples traced by the last render call
+	bool temporalReuse = false; // After the camera or the world changed, reuse the last frame's pixels that are still visible instead of tracing them
+	float temporalRefresh = 0.05f; // Fraction of the reusable pixels that is traced anyway every frame
+	float temporalDepthTolerance = 0.1f; // How much farther than its closest neighbour a reused pixel may be, relative to that neighbour
+	uint64_t lastReusedCount = 0; // Pixels the last render call took from the frame before
+	float lodBias = 1.0f; // Primary rays switch to coarse voxel levels once a cell is at most this many pixels wide, 0 always traces the voxels
+	bool beamPrepass = true; // Primary rays of every BEAM_SIZE block start where a cone around the block first gets close to something solid
+	bool lastRestarted = false; // The last render call threw the accumulated samples away because the camera, the world or the size changed
+	TileScheduler scheduler;
+
+	// Adds up to the given number of jittered samples to every pixel that has not converged yet, and writes the mean into the framebuffer.
+	// The camera has to be prepared already.
+	void render(World& world, const Camera& cam, Framebuffer& fb, int samples) {
+		frameCount++;
+		TemporalCache& cache = fb.temporal;
+		lastReusedCount = 0;
+		lastRestarted = validate(world, cam, fb);
+		if (lastRestarted) {
+			if (temporalReuse && cache.valid) { reproject(world, cam, fb); }
+			else { cache.reset(fb.pixels.size()); }
+			cache.valid = temporalReuse; // Every pixel that was not reused records its hit below
+		} else if (cache.anyReused) {
+			cache.reused.assign(cache.reused.size(), 0); // Nothing changed, so they can be refined now
+		}
+		cache.anyReused = lastReusedCount > 0;
+
+		Accumulation& acc = fb.accumulation;
+		const float wp = 1.0f / static_cast<float>(fb.width), hp = 1.0f / static_cast<float>(fb.height);
+		const uint32_t minN = minSamples, maxN = maxSamples;
+		const float threshold = convergenceThreshold;
+		const bool record = temporalReuse;
+		const float footprint = lodBias * cam.pixel_footprint(fb.height);
+		const bool beam = beamPrepass;
+		PixelHits& hits = cache.hits;
+		auto needsSample = [&acc, &cache, minN, maxN, threshold](size_t i) { return !cache.reused[i] && acc.samples[i] < maxN && !acc.converged(i, minN, threshold); };
+		std::atomic<uint64_t> traced{ 0 };
+
+		if (wavefront) {
+			const uint32_t requested = static_cast<uint32_t>(std::max(samples, 0));
+			scheduler.run(fb.width, fb.height, [&world, &cam, &fb, &acc, &hits, &traced, &needsSample, wp, hp, requested, maxN, record, footprint, beam](const Tile& tile) {
+				static thread_local Wavefront wave;
+				static thread_local std::vector<size_t> pixels; // Pixel of every path in the wave
+				static thread_local std::vector<float> starts;
+				wave.clear();
+				pixels.clear();
+				const int blocksX = beamStarts(world, cam, tile, wp, hp, footprint, beam, starts);
+
+				// All samples of the tile go into one wave, a pixel that converges halfway through still gets the rest of them
+				for (int y = tile.y0; y < tile.y1; y++) {
+					for (int x = tile.x0; x < tile.x1; x++) {
+						const size_t i = static_cast<size_t>(y) * fb.width + x;
+						if (!needsSample(i)) { continue; }
+						const uint32_t n = acc.samples[i], count = std::min(requested, maxN - n);
+						const float start = starts[static_cast<size_t>((y - tile.y0) / BEAM_SIZE) * blocksX + (x - tile.x0) / BEAM_SIZE];
+						for (uint32_t s = 0; s < count; s++) {
+							float jx, jy;
+							jitter(i, n + s, jx, jy);
+							wave.add(cam.get_ray((static_cast<float>(x) + jx) * wp, (static_cast<float>(y) + jy) * hp), start);
+							pixels.push_back(i);
+						}
+					}
+				}
+				wave.run(world, 1, footprint);
+
+				for (size_t p = 0; p < pixels.size(); p++) {
+					const size_t i = pixels[p];
+					if (record && acc.samples[i] == 0) {
+						const Ray center = cam.get_ray((static_cast<float>(i % fb.width) + 0.5f) * wp, (static_cast<float>(i / fb.width) + 0.5f) * hp);
+						hits.record(world, i, center.position, unit_vector(center.direction), wave.depths[p]);
+					}
+					acc.add(i, wave.colors[p]);
+				}
+				for (int y = tile.y0; y < tile.y1; y++) {
+					for (int x = tile.x0; x < tile.x1; x++) { fb.at(x, y) = acc.mean(static_cast<size_t>(y) * fb.width + x); }
+				}
+				traced += pixels.size();
+			});
+		} else if (packetTracing) {
+			scheduler.run(fb.width, fb.height, [&world, &cam, &fb, &acc, &hits, &traced, &needsSample, wp, hp, samples, record, footprint, beam](const Tile& tile) {
+				static thread_local std::vector<float> starts;
+				const int blocksX = beamStarts(world, cam, tile, wp, hp, footprint, beam, starts);
+				uint64_t count = 0;
+				for (int s = 0; s < samples; s++) {
+					for (int y = tile.y0; y < tile.y1; y += 2) {
+						for (int x = tile.x0; x < tile.x1; x += 2) {
+							// Converged pixels drop out of the packet as inactive lanes
+							RayPacket packet;
+							int first = 0; // Lanes that go through the pixel centre
+							for (int lane = 0; lane < PACKET_SIZE; lane++) {
+								int px = x + (lane & 1), py = y + (lane >> 1);
+								if (px >= tile.x1 || py >= tile.y1) { continue; }
+								const size_t i = static_cast<size_t>(py) * fb.width + px;
+								if (!needsSample(i)) { continue; }
+								float jx, jy;
+								jitter(i, acc.samples[i], jx, jy);
+								if (acc.samples[i] == 0) { first |= 1 << lane; }
+								packet.set(lane, cam.position, cam.get_ray((static_cast<float>(px) + jx) * wp, (static_cast<float>(py) + jy) * hp).direction);
+							}
+							if (packet.activeMask == 0) { continue; }
+
+							vec3 colors[PACKET_SIZE];
+							float depths[PACKET_SIZE];
+							const float start = starts[static_cast<size_t>((y - tile.y0) / BEAM_SIZE) * blocksX + (x - tile.x0) / BEAM_SIZE]; // Packets never straddle blocks
+							tracePacket(cam.position, packet, world, 1, 1, colors, depths, footprint, start);
+
+							for (int lane = 0; lane < PACKET_SIZE; lane++) {
+								if (!((packet.activeMask >> lane) & 1)) { continue; }
+								const size_t i = static_cast<size_t>(y + (lane >> 1)) * fb.width + x + (lane & 1);
+								if (record && ((first >> lane) & 1)) { hits.record(world, i, cam.position, vec3(packet.direction[0][lane], packet.direction[1][lane], packet.direction[2][lane]), depths[lane]); }
+								acc.add(i, colors[lane]);
+								count++;
+							}
+						}
+					}
+				}
+				for (int y = tile.y0; y < tile.y1; y++) {
+					for (int x = tile.x0; x < tile.x1; x++) { fb.at(x, y) = acc.mean(static_cast<size_t>(y) * fb.width + x); }
+				}
+				traced += count;
+			});
+		} else {
+			scheduler.run(fb.width, fb.height, [&world, &cam, &fb, &acc, &hits, &traced, &needsSample, wp, hp, samples, record, footprint, beam](const Tile& tile) {
+				static thread_local std::vector<float> starts;
+				const int blocksX = beamStarts(world, cam, tile, wp, hp, footprint, beam, starts);
+				uint64_t count = 0;
+				for (int s = 0; s < samples; s++) {
+					for (int y = tile.y0; y < tile.y1; y++) {
+						for (int x = tile.x0; x < tile.x1; x++) {
+							const size_t i = static_cast<size_t>(y) * fb.width + x;
+							if (!needsSample(i)) { continue; }
+							float jx, jy;
+							jitter(i, acc.samples[i], jx, jy);
+							Ray ray = cam.get_ray((static_cast<float>(x) + jx) * wp, (static_cast<float>(y) + jy) * hp);
+							float depth = 0;
+							const vec3 color = trace(cam.position, ray, world, 1, 1, depth, footprint, starts[static_cast<size_t>((y - tile.y0) / BEAM_SIZE) * blocksX + (x - tile.x0) / BEAM_SIZE]);
+							if (record && acc.samples[i] == 0) { hits.record(world, i, ray.position, unit_vector(ray.direction), depth < MAX_CHUNK_DISTANCE ? depth : -1.0f); }
+							acc.add(i, color);
+							count++;
+						}
+					}
+				}
+				for (int y = tile.y0; y < tile.y1; y++) {
+					for (int x = tile.x0; x < tile.x1; x++) { fb.at(x, y) = acc.mean(static_cast<size_t>(y) * fb.width + x); }
+				}
+				traced += count;
+			});
+		}
+		lastSampleCount = traced;
+	}
+};
\ No newline at end of file
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <emmintrin.h>
+#include <cstdint>
+#include <string.h>
+#include "TileScheduler.h"
+#include "Vec3.h"
+
+// Curve that brings linear colours above 1 back into range
+enum ToneMap {
+	TONEMAP_CLAMP, // Everything above 1 is white, the same as the image files
+	TONEMAP_REINHARD, // c / (1 + c)
+	TONEMAP_ACES, // Narkowicz's fit of the ACES filmic curve
+};
+
+// How the tracer's linear colour becomes displayable pixels
+struct ResolveSettings {
+	float exposure = 1.0f; // Colours are multiplied by this before the tone map
+	ToneMap toneMap = TONEMAP_CLAMP;
+	bool srgb = false; // Encode with the sRGB curve, without it values are written linear like ImageOutput does
+};
+
+// Where the 8 bit channels of a 32 bit pixel go
+struct PixelLayout {
+	uint32_t redShift = 16, greenShift = 8, blueShift = 0;
+	uint32_t alphaMask = 0xFF000000; // Set in every pixel
+};
+
+// Exposure, tone map, encoding, clamping and scaling to 0-255 for four values of any channel
+template <ToneMap MAP, bool SRGB>
+static inline __m128 resolve_values(__m128 c, __m128 exposure) {
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	c = _mm_max_ps(_mm_mul_ps(c, exposure), zero); // Also turns NaN into 0
+	if (MAP == TONEMAP_REINHARD) { c = _mm_div_ps(c, _mm_add_ps(c, one)); }
+	if (MAP == TONEMAP_ACES) {
+		const __m128 numerator = _mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(c, _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f)));
+		const __m128 denominator = _mm_add_ps(_mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(c, _mm_set1_ps(2.43f)), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+		c = _mm_div_ps(numerator, denominator);
+	}
+	c = _mm_min_ps(c, one);
+	if (SRGB) { // The power part of the sRGB curve fitted from three square roots, the linear toe is exact
+		const __m128 s1 = _mm_sqrt_ps(c), s2 = _mm_sqrt_ps(s1), s3 = _mm_sqrt_ps(s2);
+		const __m128 curve = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s1, _mm_set1_ps(0.662002687f)), _mm_mul_ps(s2, _mm_set1_ps(0.684122060f))),
+			_mm_sub_ps(_mm_mul_ps(s3, _mm_set1_ps(-0.323583601f)), _mm_mul_ps(c, _mm_set1_ps(0.0225411470f))));
+		const __m128 toe = _mm_cmple_ps(c, _mm_set1_ps(0.0031308f));
+		c = _mm_or_ps(_mm_and_ps(toe, _mm_mul_ps(c, _mm_set1_ps(12.92f))), _mm_andnot_ps(toe, curve));
+		c = _mm_min_ps(_mm_max_ps(c, zero), one);
+	}
+	return _mm_mul_ps(c, _mm_set1_ps(255.99f));
+}
+
+// Resolves four pixels, twelve floats in the layout of vec3
+template <ToneMap MAP, bool SRGB>
+static inline __m128i resolve4(const float* p, __m128 exposure, __m128i redShift, __m128i greenShift, __m128i blueShift, __m128i alpha) {
+	const __m128 a = _mm_loadu_ps(p), b = _mm_loadu_ps(p + 4), c = _mm_loadu_ps(p + 8); // r0 g0 b0 r1, g1 b1 r2 g2, b2 r3 g3 b3
+	const __m128 t0 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 1, 3, 2)); // r2 g2 r3 g3
+	const __m128 t1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 2, 1)); // g0 b0 g1 b1
+	const __m128 red = _mm_shuffle_ps(a, t0, _MM_SHUFFLE(2, 0, 3, 0));
+	const __m128 green = _mm_shuffle_ps(t1, t0, _MM_SHUFFLE(3, 1, 2, 0));
+	const __m128 blue = _mm_shuffle_ps(t1, c, _MM_SHUFFLE(3, 0, 3, 1));
+
+	const __m128i r = _mm_cvttps_epi32(resolve_values<MAP, SRGB>(red, exposure));
+	const __m128i g = _mm_cvttps_epi32(resolve_values<MAP, SRGB>(green, exposure));
+	const __m128i bl = _mm_cvttps_epi32(resolve_values<MAP, SRGB>(blue, exposure));
+	return _mm_or_si128(_mm_or_si128(_mm_sll_epi32(r, redShift), _mm_sll_epi32(g, greenShift)), _mm_or_si128(_mm_sll_epi32(bl, blueShift), alpha));
+}
+
+// One row, eight pixels per step, the rest goes through a padded copy so it comes out the same
+template <ToneMap MAP, bool SRGB>
+static void resolveRow(const vec3* pixels, int width, uint32_t* out, const PixelLayout& layout, float exposure) {
+	static_assert(sizeof(vec3) == 3 * sizeof(float), "resolve4 reads vec3 as packed floats");
+	const __m128 e = _mm_set1_ps(exposure);
+	const __m128i rs = _mm_cvtsi32_si128(static_cast<int>(layout.redShift)), gs = _mm_cvtsi32_si128(static_cast<int>(layout.greenShift)), bs = _mm_cvtsi32_si128(static_cast<int>(layout.blueShift));
+	const __m128i alpha = _mm_set1_epi32(static_cast<int>(layout.alphaMask));
+	const float* p = pixels[0].vertices;
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		const __m128i lo = resolve4<MAP, SRGB>(p + x * 3, e, rs, gs, bs, alpha);
+		const __m128i hi = resolve4<MAP, SRGB>(p + x * 3 + 12, e, rs, gs, bs, alpha);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), lo);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + x + 4), hi);
+	}
+	for (; x < width; x += 4) {
+		const int n = width - x < 4 ? width - x : 4;
+		float in[12]{};
+		uint32_t packed[4];
+		memcpy(in, p + x * 3, n * sizeof(vec3));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(packed), resolve4<MAP, SRGB>(in, e, rs, gs, bs, alpha));
+		memcpy(out + x, packed, n * sizeof(uint32_t));
+	}
+}
+
+// Turns linear colour into packed 32 bit pixels, rows of out are pitch bytes apart. Bands of rows are resolved on the scheduler's threads,
+// so nothing per pixel is left for the tracer or the window to do.
+static void resolve(const vec3* pixels, int width, int height, void* out, int pitch, const PixelLayout& layout, const ResolveSettings& settings, TileScheduler& scheduler) {
+	using RowFunction = void (*)(const vec3*, int, uint32_t*, const PixelLayout&, float);
+	static const RowFunction rows[3][2] = {
+		{ resolveRow<TONEMAP_CLAMP, false>, resolveRow<TONEMAP_CLAMP, true> },
+		{ resolveRow<TONEMAP_REINHARD, false>, resolveRow<TONEMAP_REINHARD, true> },
+		{ resolveRow<TONEMAP_ACES, false>, resolveRow<TONEMAP_ACES, true> },
+	};
+	const RowFunction row = rows[settings.toneMap][settings.srgb ? 1 : 0];
+	uint8_t* target = static_cast<uint8_t*>(out);
+	const float exposure = settings.exposure;
+	scheduler.run(1, height, [=, &layout](const Tile& tile) { // A single column of tiles, each one a band of whole rows
+		for (int y = tile.y0; y < tile.y1; y++) { row(pixels + static_cast<size_t>(y) * width, width, reinterpret_cast<uint32_t*>(target + static_cast<size_t>(y) * pitch), layout, exposure); }
+	}, false);
+}
@@ -1,7 +1,16 @@
 #pragma once
 
 #include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
 #include <SDL.h>
+#include "Profiler.h"
+
+#if !defined(_MSC_VER) && !defined(printf_s)
+#define printf_s printf // printf_s only exists in the MSVC runtime
+#endif
 
 #define MOUSE_INPUTS 6
 #define KEYBOARD_INPUTS 1024
@@ -49,12 +58,56 @@ public:
 	}
 };
 
+constexpr int WINDOW_BUFFERS = 2; // The program draws into one while the other is presented
+
+// Runs the program's loop on its own thread: while onLoop() draws frame N + 1 into one buffer, the main thread uploads frame N from the
+// other into a streaming texture that lives as long as the window and presents it. Events are handled between frames, so onEvent()
+// and onLoop() never run at the same time. Works with any video driver, including SDL's dummy driver.
 struct SDLWindowEngine {
 private:
 	SDL_Window* window = nullptr;
 	SDL_Renderer* renderer = nullptr;
-	SDL_Surface* surface = nullptr;
 	SDL_Texture* tex = nullptr;
+	SDL_Surface* buffers[WINDOW_BUFFERS]{ nullptr };
+	SDL_Surface* surface = nullptr; // The buffer onLoop() draws into
+
+	std::thread loopThread;
+	std::mutex loopLock;
+	std::condition_variable loopWake, loopDone;
+	uint64_t loopsStarted = 0, loopsFinished = 0;
+	bool stopping = false;
+
+	void loopThreadMain() {
+		register_thread_counters();
+		uint64_t seen = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(loopLock);
+				loopWake.wait(lock, [this, seen] { return stopping || loopsStarted != seen; });
+				if (stopping) { return; }
+				seen = loopsStarted;
+			}
+			onLoop();
+			{
+				std::lock_guard<std::mutex> lock(loopLock);
+				loopsFinished = seen;
+			}
+			loopDone.notify_all();
+		}
+	}
+
+	void startLoop() {
+		{
+			std::lock_guard<std::mutex> lock(loopLock);
+			loopsStarted++;
+		}
+		loopWake.notify_all();
+	}
+
+	void finishLoop() {
+		std::unique_lock<std::mutex> lock(loopLock);
+		loopDone.wait(lock, [this] { return loopsFinished == loopsStarted; });
+	}
 
 public:
 	friend struct Engine;
@@ -64,6 +117,8 @@ public:
 	Input input;
 	int width, height;
 	bool isRunning;
+	uint64_t frameLimit = 0; // Stops after this many frames, 0 runs until the window is closed
+	Profiler profiler; // Times every frame once it is opened, the program adds its own stages
 
 	// Constructor
 	SDLWindowEngine() {
@@ -72,37 +127,48 @@ public:
 		renderer = NULL;
 	}
 
+	virtual ~SDLWindowEngine() {}
+
 	// timing function
 	inline static const uint64_t getTime() { return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count(); }
 
 	// Main function that calls all the functions for the program
 	int execute(const char* title, int width, int height) {
 		SDL_Event event;
-		if (!init(title, width, height)) { return -1; }
-		while (isRunning) {
+		if (!init(title, width, height)) {
+			printf_s("Could not open the window: %s\n", SDL_GetError());
+			postExit();
+			return -1;
+		}
+		int back = 0;
+		for (uint64_t frame = 0; isRunning && (frameLimit == 0 || frame < frameLimit); frame++) {
+			profiler.begin_frame();
 			input.update(); // moves current inputs to last frames inputs so we can check if input has been released that frame
 			while (SDL_PollEvent(&event)) {
 				switch (event.type) {
-				case SDL_KEYDOWN: { input.pushKeyEvent(&event, false); break; }
-				case SDL_KEYUP: { input.pushKeyEvent(&event, true); break; }
-				case SDL_MOUSEBUTTONDOWN: { input.pushMouseButtonEvent(&event, false); break; }
-				case SDL_MOUSEBUTTONUP: { input.pushMouseButtonEvent(&event, true); break; }
+				case SDL_KEYDOWN: { input.pushKeyEvent(&event, true); break; }
+				case SDL_KEYUP: { input.pushKeyEvent(&event, false); break; }
+				case SDL_MOUSEBUTTONDOWN: { input.pushMouseButtonEvent(&event, true); break; }
+				case SDL_MOUSEBUTTONUP: { input.pushMouseButtonEvent(&event, false); break; }
 				case SDL_MOUSEWHEEL: { input.pushMouseWheelEvent(&event); break; }
 				case SDL_MOUSEMOTION: { input.pushMouseMovementEvent(&event); break; }
 				default: { break; }
 				}
 				onEvent(&event);
 			}
-			surface = SDL_GetWindowSurface(window);
-			if (tex != nullptr) {
-				SDL_DestroyTexture(tex);
+			if (!isRunning) { break; }
+
+			surface = buffers[back];
+			startLoop();
+			{
+				ProfileScope scope(profiler, "present");
+				onRender(buffers[(back + WINDOW_BUFFERS - 1) % WINDOW_BUFFERS]); // The frame the last loop finished
 			}
-			format = surface->format;
-			tex = SDL_CreateTextureFromSurface(renderer, surface);
-			if (tex == nullptr) { return -2; }
-			onLoop();
-			onRender();
+			finishLoop();
+			back = (back + 1) % WINDOW_BUFFERS;
+			profiler.end_frame();
 		}
+		stopLoop();
 		onExit();
 		postExit();
 		return 0;
@@ -117,7 +183,7 @@ public:
 private:
 	virtual bool programInit() = 0;
 	virtual void onEvent(SDL_Event* event) = 0;
-	virtual void onLoop() = 0;
+	virtual void onLoop() = 0; // Runs on the loop thread and draws into surface
 	virtual void onExit() = 0;
 
 	const bool init(const char* title, int width, int height) {
@@ -130,33 +196,58 @@ private:
 		window = SDL_CreateWindow(title, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width, height, SDL_WINDOW_SHOWN);
 		if (window == NULL) { return false; }
 		renderer = SDL_CreateRenderer(window, -1, 0);
+		if (renderer == NULL) { return false; }
 
-		// initialise the image instance.
-		surface = SDL_GetWindowSurface(window);
-		format = surface->format;
-		tex = SDL_CreateTextureFromSurface(renderer, surface);
+		// One texture for the whole run, every frame is uploaded into it
+		tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
 		if (tex == nullptr) { return false; }
+		for (int i = 0; i < WINDOW_BUFFERS; i++) {
+			buffers[i] = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888);
+			if (buffers[i] == nullptr) { return false; }
+		}
+		surface = buffers[WINDOW_BUFFERS - 1]; // Presented by the first frame
+		format = surface->format;
 
 		// Create some colour variations (uv map) for a test screen
 		for (int x = 0; x < width; x++) { for (int y = 0; y < height; y++) { setPixel(surface, x, y, SDL_MapRGB(format, static_cast<uint8_t>((static_cast<float>(x) / static_cast<float>(width)) * 255.0f), static_cast<uint8_t>((static_cast<float>(y) / static_cast<float>(height)) * 255.0f), 0)); } }
-		onRender(); // push test image to screen to show that program has started
-		return programInit(); // initialise the program
+		onRender(surface); // push test image to screen to show that program has started
+		if (!programInit()) { return false; } // initialise the program
+		loopThread = std::thread(&SDLWindowEngine::loopThreadMain, this);
+		return true;
 	};
 
-	// function that gets called after the programs loop function to display the image buffer
-	void onRender() {
+	// Uploads a finished frame into the texture and displays it
+	void onRender(SDL_Surface* frame) {
 		if (tex != nullptr) {
+			SDL_UpdateTexture(tex, NULL, frame->pixels, frame->pitch);
 			SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // set the background colour to black
 			SDL_RenderClear(renderer);  // clear the display buffer
 			SDL_RenderCopy(renderer, tex, NULL, NULL);
 			SDL_RenderPresent(renderer); // show the display buffer
-			SDL_DestroyTexture(tex);
 		}
 	};
 
+	void stopLoop() {
+		if (!loopThread.joinable()) { return; }
+		{
+			std::lock_guard<std::mutex> lock(loopLock);
+			stopping = true;
+		}
+		loopWake.notify_all();
+		loopThread.join();
+	}
+
 	void postExit() {
-		SDL_DestroyRenderer(renderer);
-		SDL_DestroyWindow(window);
+		stopLoop();
+		for (SDL_Surface*& buffer : buffers) {
+			if (buffer != nullptr) { SDL_FreeSurface(buffer); }
+			buffer = nullptr;
+		}
+		if (tex != nullptr) { SDL_DestroyTexture(tex); }
+		tex = nullptr;
+		if (renderer != nullptr) { SDL_DestroyRenderer(renderer); }
+		renderer = nullptr;
+		if (window != nullptr) { SDL_DestroyWindow(window); }
 		window = nullptr;
 		SDL_Quit();
 	}
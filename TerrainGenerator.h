@@ -0,0 +1,209 @@
+#pragma once
+
+#include <emmintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "TileScheduler.h"
+#include "World.h"
+
+constexpr int TERRAIN_LANES = 8; // Voxels per noise step, two SSE halves like the resolve
+static_assert(CHUNK_WIDTH % TERRAIN_LANES == 0, "Chunk rows are generated TERRAIN_LANES voxels at a time");
+
+// Shape of the generated terrain. A chunk only depends on these and its location, so it comes out the same on any thread and in any order.
+struct TerrainSettings {
+	uint64_t seed = 1;
+	float baseHeight = 16.0f; // Height the hills are centred on
+	float hillHeight = 24.0f, hillScale = 96.0f; // Amplitude and wavelength in voxels of the large hills
+	float detailHeight = 6.0f, detailScale = 24.0f; // Same for the small bumps on top of them
+	float caveScale = 32.0f; // Wavelength of the cave noise
+	float caveThreshold = 0.3f; // Caves are where the cave noise is above this, higher gives fewer and thinner caves
+	int32_t caveRoof = 3; // Voxels under the surface that caves leave alone, so they only open up where they cut through a slope
+	int32_t soilDepth = 3; // Voxels of groundMaterial below the surface voxel, everything deeper is stone
+	uint32_t surfaceMaterial = 3, groundMaterial = 1, stoneMaterial = 2; // See init_default_materials
+	uint32_t oreMaterial = 1;
+	float oreChance = 0.01f; // Share of the stone that is oreMaterial instead, picked per chunk from the seed and the location
+};
+
+// 32 bit multiply of every lane, SSE2 only has the 64 bit one for the even lanes
+static inline __m128i noise_mullo(__m128i a, __m128i b) {
+	const __m128i even = _mm_mul_epu32(a, b);
+	const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// Hash of a lattice point, stateless so every lane and thread gets the same value for the same point
+static inline __m128i noise_hash(__m128i x, __m128i y, __m128i z, __m128i seed) {
+	__m128i h = _mm_xor_si128(seed, noise_mullo(x, _mm_set1_epi32(0x27D4EB2D)));
+	h = _mm_xor_si128(h, noise_mullo(y, _mm_set1_epi32(0x165667B1)));
+	h = _mm_xor_si128(h, noise_mullo(z, _mm_set1_epi32(static_cast<int>(0x9E3779B1u))));
+	h = _mm_xor_si128(h, _mm_srli_epi32(h, 15));
+	h = noise_mullo(h, _mm_set1_epi32(0x2C1B3C6D));
+	h = _mm_xor_si128(h, _mm_srli_epi32(h, 12));
+	h = noise_mullo(h, _mm_set1_epi32(0x297A2D39));
+	return _mm_xor_si128(h, _mm_srli_epi32(h, 15));
+}
+
+// Dot product of the offset with one of Perlin's twelve edge gradients, picked by the low four bits of the hash
+static inline __m128 noise_grad(__m128i h, __m128 x, __m128 y, __m128 z) {
+	h = _mm_and_si128(h, _mm_set1_epi32(15));
+	const __m128 low8 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(8)));
+	const __m128 low4 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(4)));
+	const __m128 useX = _mm_castsi128_ps(_mm_or_si128(_mm_cmpeq_epi32(h, _mm_set1_epi32(12)), _mm_cmpeq_epi32(h, _mm_set1_epi32(14))));
+	const __m128 u = _mm_or_ps(_mm_and_ps(low8, x), _mm_andnot_ps(low8, y));
+	const __m128 v = _mm_or_ps(_mm_and_ps(low4, y), _mm_andnot_ps(low4, _mm_or_ps(_mm_and_ps(useX, x), _mm_andnot_ps(useX, z))));
+	const __m128 signU = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(1)), 31));
+	const __m128 signV = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(2)), 30));
+	return _mm_add_ps(_mm_xor_ps(u, signU), _mm_xor_ps(v, signV));
+}
+
+static inline __m128 noise_fade(__m128 t) { return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t), _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6.0f)), _mm_set1_ps(15.0f))), _mm_set1_ps(10.0f))); }
+static inline __m128 noise_lerp(__m128 a, __m128 b, __m128 t) { return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a))); }
+
+// Splits coordinates into the lattice cell and the offset inside it, rounding down for negative ones as well
+static inline __m128 noise_floor(__m128 v, __m128i& cell) {
+	const __m128i truncated = _mm_cvttps_epi32(v);
+	const __m128 rounded = _mm_cvtepi32_ps(truncated);
+	const __m128 above = _mm_cmpgt_ps(rounded, v);
+	cell = _mm_add_epi32(truncated, _mm_castps_si128(above)); // The mask is -1 where truncating went up
+	return _mm_sub_ps(v, _mm_sub_ps(rounded, _mm_and_ps(above, _mm_set1_ps(1.0f))));
+}
+
+// Perlin's improved gradient noise at four points, about -1 to 1 and 0 on the lattice
+static __m128 gradient_noise(__m128 x, __m128 y, __m128 z, __m128i seed) {
+	__m128i x0, y0, z0;
+	const __m128 fx = noise_floor(x, x0), fy = noise_floor(y, y0), fz = noise_floor(z, z0);
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128i x1 = _mm_add_epi32(x0, one), y1 = _mm_add_epi32(y0, one), z1 = _mm_add_epi32(z0, one);
+	const __m128 gx = _mm_sub_ps(fx, _mm_set1_ps(1.0f)), gy = _mm_sub_ps(fy, _mm_set1_ps(1.0f)), gz = _mm_sub_ps(fz, _mm_set1_ps(1.0f));
+	const __m128 u = noise_fade(fx), v = noise_fade(fy), w = noise_fade(fz);
+
+	const __m128 n000 = noise_grad(noise_hash(x0, y0, z0, seed), fx, fy, fz), n100 = noise_grad(noise_hash(x1, y0, z0, seed), gx, fy, fz);
+	const __m128 n010 = noise_grad(noise_hash(x0, y1, z0, seed), fx, gy, fz), n110 = noise_grad(noise_hash(x1, y1, z0, seed), gx, gy, fz);
+	const __m128 n001 = noise_grad(noise_hash(x0, y0, z1, seed), fx, fy, gz), n101 = noise_grad(noise_hash(x1, y0, z1, seed), gx, fy, gz);
+	const __m128 n011 = noise_grad(noise_hash(x0, y1, z1, seed), fx, gy, gz), n111 = noise_grad(noise_hash(x1, y1, z1, seed), gx, gy, gz);
+	const __m128 front = noise_lerp(noise_lerp(n000, n100, u), noise_lerp(n010, n110, u), v);
+	const __m128 back = noise_lerp(noise_lerp(n001, n101, u), noise_lerp(n011, n111, u), v);
+	return noise_lerp(front, back, w);
+}
+
+// Fills new chunks with hills, caves and layered materials. Generating only reads the settings, so one generator can be shared by every
+// streaming thread, and chunks fit together at their borders because all noise is sampled in world coordinates.
+struct TerrainGenerator {
+private:
+	// Seeds of the separate noise layers, derived from the world seed
+	__m128i hillSeed, detailSeed, caveSeed, caveDetailSeed;
+
+	static inline __m128i layer_seed(uint64_t seed, uint64_t layer) { return _mm_set1_epi32(static_cast<int>(hash64(seed ^ hash64(layer)))); }
+
+	// Surface height of TERRAIN_LANES columns next to each other along x
+	void surfaceHeights(int32_t x, int32_t z, float* out) const {
+		const __m128 hillFreq = _mm_set1_ps(1.0f / settings.hillScale), detailFreq = _mm_set1_ps(1.0f / settings.detailScale);
+		const __m128 hillHeight = _mm_set1_ps(settings.hillHeight), detailHeight = _mm_set1_ps(settings.detailHeight), base = _mm_set1_ps(settings.baseHeight);
+		const __m128 zs = _mm_set1_ps(static_cast<float>(z)), zero = _mm_setzero_ps();
+		for (int half = 0; half < TERRAIN_LANES; half += 4) {
+			const float x0 = static_cast<float>(x + half);
+			const __m128 xs = _mm_add_ps(_mm_set1_ps(x0), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+			const __m128 hills = gradient_noise(_mm_mul_ps(xs, hillFreq), zero, _mm_mul_ps(zs, hillFreq), hillSeed);
+			const __m128 detail = gradient_noise(_mm_mul_ps(xs, detailFreq), zero, _mm_mul_ps(zs, detailFreq), detailSeed);
+			_mm_storeu_ps(out + half, _mm_add_ps(base, _mm_add_ps(_mm_mul_ps(hills, hillHeight), _mm_mul_ps(detail, detailHeight))));
+		}
+	}
+
+	// Writes a mask per voxel of TERRAIN_LANES voxels along x, all bits set where the cave noise carves the voxel out
+	void caveMask(int32_t x, int32_t y, int32_t z, int32_t* out) const {
+		const __m128 freq = _mm_set1_ps(1.0f / settings.caveScale), detailFreq = _mm_set1_ps(2.0f / settings.caveScale);
+		const __m128 ys = _mm_set1_ps(static_cast<float>(y)), zs = _mm_set1_ps(static_cast<float>(z)), threshold = _mm_set1_ps(settings.caveThreshold);
+		for (int half = 0; half < TERRAIN_LANES; half += 4) {
+			const __m128 xs = _mm_add_ps(_mm_set1_ps(static_cast<float>(x + half)), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+			const __m128 caves = gradient_noise(_mm_mul_ps(xs, freq), _mm_mul_ps(ys, freq), _mm_mul_ps(zs, freq), caveSeed);
+			const __m128 detail = gradient_noise(_mm_mul_ps(xs, detailFreq), _mm_mul_ps(ys, detailFreq), _mm_mul_ps(zs, detailFreq), caveDetailSeed);
+			const __m128 carved = _mm_cmpgt_ps(_mm_add_ps(caves, _mm_mul_ps(detail, _mm_set1_ps(0.5f))), threshold);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + half), _mm_castps_si128(carved));
+		}
+	}
+
+public:
+	TerrainSettings settings;
+
+	TerrainGenerator() { seed(settings); }
+	explicit TerrainGenerator(const TerrainSettings& s) { seed(s); }
+
+	// Takes new settings, not safe while chunks are generated
+	void seed(const TerrainSettings& s) {
+		settings = s;
+		hillSeed = layer_seed(s.seed, 1);
+		detailSeed = layer_seed(s.seed, 2);
+		caveSeed = layer_seed(s.seed, 3);
+		caveDetailSeed = layer_seed(s.seed, 4);
+	}
+
+	// No column reaches above this, chunks that start higher are air without evaluating any noise
+	inline float max_height() const { return settings.baseHeight + (settings.hillHeight + settings.detailHeight) * 1.1f; }
+
+	// Height of the highest solid voxel of a column plus one, for placing a camera on the ground
+	int32_t surface_height(int32_t x, int32_t z) const {
+		float heights[TERRAIN_LANES];
+		surfaceHeights(x, z, heights);
+		return fastfloor(heights[0]) + 1;
+	}
+
+	// Builds the chunk at loc into chunk, replacing what it held. Returns false if its storage could not be allocated.
+	bool generate(ChunkLocation loc, Chunk& chunk) const {
+		const int32_t x0 = loc.x * CHUNK_WIDTH, y0 = loc.y * CHUNK_WIDTH, z0 = loc.z * CHUNK_WIDTH;
+		if (static_cast<float>(y0) > max_height()) { return chunk.allocate(loc); }
+
+		int32_t tops[CHUNK_WIDTH * CHUNK_WIDTH]; // Highest solid voxel per column, by z then x
+		int32_t highest = INT32_MIN;
+		for (int32_t z = 0; z < CHUNK_WIDTH; z++) {
+			for (int32_t x = 0; x < CHUNK_WIDTH; x += TERRAIN_LANES) {
+				float heights[TERRAIN_LANES];
+				surfaceHeights(x0 + x, z0 + z, heights);
+				for (int i = 0; i < TERRAIN_LANES; i++) {
+					const int32_t top = fastfloor(heights[i]);
+					tops[z * CHUNK_WIDTH + x + i] = top;
+					highest = std::max(highest, top);
+				}
+			}
+		}
+		if (highest < y0) { return chunk.allocate(loc); }
+
+		const uint64_t chunkSeed = hash64(settings.seed ^ hash64(loc.key()));
+		const uint64_t oreLimit = static_cast<uint64_t>(static_cast<double>(settings.oreChance) * 16777216.0);
+		uint32_t values[CHUNK_SIZE];
+		int32_t carved[CHUNK_WIDTH];
+		for (int32_t z = 0; z < CHUNK_WIDTH; z++) {
+			for (int32_t y = 0; y < CHUNK_WIDTH; y++) {
+				const int32_t wy = y0 + y;
+				const int32_t* top = tops + z * CHUNK_WIDTH;
+				bool anyCave = false; // Only rows with voxels deep enough for caves need the cave noise
+				for (int32_t x = 0; x < CHUNK_WIDTH; x++) { anyCave = anyCave || wy < top[x] - settings.caveRoof; }
+				if (anyCave) {
+					for (int32_t x = 0; x < CHUNK_WIDTH; x += TERRAIN_LANES) { caveMask(x0 + x, wy, z0 + z, carved + x); }
+				}
+				uint32_t* row = values + voxel_index(0, y, z);
+				for (int32_t x = 0; x < CHUNK_WIDTH; x++) {
+					const int32_t depth = top[x] - wy;
+					uint32_t value = 0; // Above the surface or in a cave
+					if (depth == 0) { value = settings.surfaceMaterial; }
+					else if (depth > 0 && depth <= settings.soilDepth) { value = settings.groundMaterial; }
+					else if (depth > settings.soilDepth && (depth <= settings.caveRoof || carved[x] == 0)) {
+						value = (hash64(chunkSeed ^ voxel_index(x, y, z)) >> 40) < oreLimit ? settings.oreMaterial : settings.stoneMaterial;
+					}
+					row[x] = value;
+				}
+			}
+		}
+		chunk.loc = loc;
+		return chunk.load(values);
+	}
+
+	// Generates every location into out, spread over the scheduler's threads
+	void generate_chunks(const std::vector<ChunkLocation>& locs, std::vector<Chunk>& out, TileScheduler& scheduler) const {
+		out.clear();
+		out.resize(locs.size());
+		scheduler.run(static_cast<int>(locs.size()), 1, [&](const Tile& tile) {
+			for (int i = tile.x0; i < tile.x1; i++) { if (!generate(locs[i], out[i])) { out[i].unload(); } }
+		}, false);
+	}
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Profiler.h"
+
+constexpr int DEFAULT_TILE_SIZE = 16; // 16x16 pixels, even so 2x2 ray packets never straddle tiles
+
+struct Tile {
+	int x0, y0, x1, y1; // Pixel range [x0, x1) x [y0, y1)
+	uint32_t id; // Position in the frame's tile grid, used to remember the cost per tile
+};
+
+// Splits a frame into tiles and runs them on a persistent pool of workers with work stealing.
+// Every worker owns a deque, takes its most expensive tile from the front and steals the cheapest one from the back of other deques once its own is empty.
+struct TileScheduler {
+private:
+	struct WorkerQueue {
+		std::mutex lock;
+		std::deque<Tile> tiles;
+	};
+
+	int threadCount = 1;
+	int tileSize = DEFAULT_TILE_SIZE;
+	std::vector<std::thread> workers;
+	std::unique_ptr<WorkerQueue[]> queues;
+
+	std::mutex frameLock;
+	std::condition_variable frameStart, frameDone;
+	uint64_t generation = 0;
+	int busyWorkers = 0;
+	bool stopping = false;
+	std::function<void(const Tile&)> job;
+	bool timed = true;
+
+	int tilesX = 0, tilesY = 0;
+	std::vector<uint64_t> tileCost; // Microseconds each tile took last frame
+
+	bool takeTile(int self, Tile& tile) {
+		{
+			WorkerQueue& own = queues[self];
+			std::lock_guard<std::mutex> lock(own.lock);
+			if (!own.tiles.empty()) {
+				tile = own.tiles.front();
+				own.tiles.pop_front();
+				return true;
+			}
+		}
+		for (int i = 1; i < threadCount; i++) {
+			WorkerQueue& victim = queues[(self + i) % threadCount];
+			std::lock_guard<std::mutex> lock(victim.lock);
+			if (!victim.tiles.empty()) {
+				tile = victim.tiles.back();
+				victim.tiles.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void work(int self) {
+		Tile tile;
+		while (takeTile(self, tile)) {
+			auto start = std::chrono::steady_clock::now();
+			job(tile);
+			if (timed) { tileCost[tile.id] = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count(); }
+		}
+	}
+
+	void workerLoop(int self) {
+		register_thread_counters();
+		uint64_t seen = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(frameLock);
+				frameStart.wait(lock, [this, seen] { return stopping || generation != seen; });
+				if (stopping) { return; }
+				seen = generation;
+			}
+			work(self);
+			{
+				std::lock_guard<std::mutex> lock(frameLock);
+				if (--busyWorkers == 0) { frameDone.notify_one(); }
+			}
+		}
+	}
+
+	void startWorkers() {
+		queues.reset(new WorkerQueue[threadCount]);
+		for (int i = 1; i < threadCount; i++) { workers.emplace_back(&TileScheduler::workerLoop, this, i); } // The calling thread is worker 0
+	}
+
+	void stopWorkers() {
+		{
+			std::lock_guard<std::mutex> lock(frameLock);
+			stopping = true;
+		}
+		frameStart.notify_all();
+		for (std::thread& t : workers) { t.join(); }
+		workers.clear();
+		stopping = false;
+	}
+
+	// Expensive tiles first when last frame's costs are known, otherwise from the centre out since that is where the detail usually is
+	void orderTiles(int width, int height, int countX, int countY, bool useCosts, std::vector<Tile>& tiles) {
+		tiles.clear();
+		for (int ty = 0; ty < countY; ty++) {
+			for (int tx = 0; tx < countX; tx++) {
+				tiles.push_back({ tx * tileSize, ty * tileSize, std::min((tx + 1) * tileSize, width), std::min((ty + 1) * tileSize, height), static_cast<uint32_t>(ty * countX + tx) });
+			}
+		}
+
+		bool haveCosts = false;
+		if (useCosts) { for (uint64_t c : tileCost) { if (c > 0) { haveCosts = true; break; } } }
+		if (haveCosts) {
+			std::stable_sort(tiles.begin(), tiles.end(), [this](const Tile& a, const Tile& b) { return tileCost[a.id] > tileCost[b.id]; });
+		} else {
+			const int cx = width / 2, cy = height / 2;
+			auto distance = [cx, cy](const Tile& t) { int dx = (t.x0 + t.x1) / 2 - cx, dy = (t.y0 + t.y1) / 2 - cy; return dx * dx + dy * dy; };
+			std::stable_sort(tiles.begin(), tiles.end(), [&distance](const Tile& a, const Tile& b) { return distance(a) < distance(b); });
+		}
+	}
+
+public:
+	// A thread count of 0 uses every hardware thread
+	TileScheduler(int threads = 0, int size = DEFAULT_TILE_SIZE) : tileSize(size) { setThreads(threads); }
+	~TileScheduler() { stopWorkers(); }
+
+	TileScheduler(const TileScheduler&) = delete;
+	TileScheduler& operator=(const TileScheduler&) = delete;
+
+	void setThreads(int threads) {
+		if (threads <= 0) { threads = std::max(1u, std::thread::hardware_concurrency()); }
+		if (threads == threadCount && queues) { return; }
+		stopWorkers();
+		threadCount = threads;
+		startWorkers();
+	}
+
+	// Has to be even so ray packets stay inside a tile
+	void setTileSize(int size) {
+		tileSize = std::max(2, size & ~1);
+		tileCost.clear();
+		tilesX = tilesY = 0; // The next timed run sizes the costs for its grid, even if it has the same dimensions
+	}
+
+	inline int threads() const { return threadCount; }
+	inline int getTileSize() const { return tileSize; }
+
+	// Calls f once for every tile of the frame, returns when all tiles are done.
+	// Untimed runs leave the tile costs alone, for passes that should not change the order of the next traced frame, and may use another size.
+	void run(int width, int height, const std::function<void(const Tile&)>& f, bool timeTiles = true) {
+		const int tx = (width + tileSize - 1) / tileSize, ty = (height + tileSize - 1) / tileSize;
+		if (timeTiles && (tx != tilesX || ty != tilesY)) {
+			tilesX = tx;
+			tilesY = ty;
+			tileCost.assign(static_cast<size_t>(tx) * ty, 0);
+		}
+
+		// Deal the ordered tiles out round robin so every worker starts with a share of the expensive ones
+		std::vector<Tile> tiles;
+		orderTiles(width, height, tx, ty, tx == tilesX && ty == tilesY, tiles);
+		for (size_t i = 0; i < tiles.size(); i++) { queues[i % threadCount].tiles.push_back(tiles[i]); }
+
+		job = f;
+		timed = timeTiles;
+		{
+			std::lock_guard<std::mutex> lock(frameLock);
+			busyWorkers = threadCount - 1;
+			generation++;
+		}
+		frameStart.notify_all();
+
+		work(0);
+
+		std::unique_lock<std::mutex> lock(frameLock);
+		frameDone.wait(lock, [this] { return busyWorkers == 0; });
+		job = nullptr;
+	}
+};
\ No newline at end of file
@@ -4,18 +4,114 @@
 #include "Camera.h"
 #include "World.h"
 
-#define RENDER_DISTANCE 10
-#define MAX_CHUNK_DISTANCE RENDER_DISTANCE * CHUNK_SIZE
-
 static vec3 skybox(vec3& direction) { // TODO
     return vec3(std::abs(direction[0]), std::abs(direction[1]), std::abs(direction[2]));
 }
 
-static vec3 trace(const vec3& source, const Ray& ray, World& world, int bounces, int maxBounces, float& depth);
+static vec3 trace(const vec3& source, const Ray& ray, World& world, int bounces, int maxBounces, float& depth, float footprint = 0.0f, float start = 0.0f);
+
+// Where a traversal stopped
+struct VoxelHit {
+    int32_t voxel[3]; // First solid voxel
+    float t; // Distance along the ray to where it entered the voxel, or to where it gave up
+    int axis; // Axis of the face the ray entered through
+    uint32_t material; // Of the voxel, or of the coarse cell around it that was hit
+};
+
+// Coarsest level whose cells are no wider than the footprint of a pixel at distance t. The footprint is the width of a pixel
+// at distance 1, 0 always gives the voxels.
+static inline int32_t lod_level(float t, float footprint) {
+    const float width = t * footprint;
+    int32_t level = 0;
+    while (level < CHUNK_LEVELS && width >= static_cast<float>(2 << level)) { level++; }
+    return level;
+}
 
-static void calculateTMaxForNextVoxel(vec3& rayLoc, vec3& rayDir, short* locDif, vec3& tMax) {
-    for (char i = 0; i < 3; i++) {
-        tMax[i] = rayDir[i] == 0.000f ? std::numeric_limits<float>::max() : (((rayLoc[i] == fastfloor(rayLoc[i]) ? rayLoc[i] + locDif[i] : (locDif[i] == 1 ? fastceil(rayLoc[i]) : fastfloor(rayLoc[i]))) - rayLoc[i]) / rayDir[i]);
+// Amanatides-Woo traversal for directions with the signs SX, SY and SZ (1 or -1), so the inner loop has no sign branches.
+// Voxels are stepped through with integer coords and tMax values that only get tDelta added, empty chunks and bricks are left in one jump.
+// The direction has to be normalised. The voxel the ray starts in is never tested. Returns false if nothing solid is within maxDistance.
+// With a footprint, cells of the coarse levels are used as soon as they are smaller than a pixel, see lod_level().
+// A start distance skips the part of the ray that is known to be empty, distances are still measured from the origin.
+template <int SX, int SY, int SZ>
+static bool traverseOctant(const World& world, const vec3& origin, const vec3& direction, float maxDistance, VoxelHit& hit, float footprint, float start) {
+    constexpr int32_t step[3]{ SX, SY, SZ };
+    float o[3], d[3], inv[3], tDelta[3], tMax[3];
+    int32_t c[3];
+    for (int i = 0; i < 3; i++) {
+        o[i] = origin[i];
+        d[i] = direction[i];
+        inv[i] = d[i] == 0.0f ? 1e20f : 1.0f / d[i]; // Parallel axes are stepped positive and never reach their next boundary
+        tDelta[i] = step[i] * inv[i];
+        const float p = o[i] + d[i] * start;
+        c[i] = step[i] > 0 ? fastfloor(p) : fastceil(p) - 1;
+        tMax[i] = (static_cast<float>(step[i] > 0 ? c[i] + 1 : c[i]) - o[i]) * inv[i];
+    }
+
+    const Chunk* chunk = nullptr;
+    int32_t chunkLoc[3]{ 0, 0, 0 };
+    bool haveChunk = false;
+    int32_t size = 1; // Width of the aligned empty cell the ray is in
+    float t = start;
+    int axis = 0;
+    while (true) {
+        threadCounters.steps++;
+
+        if (size == 1) { // Step into the next voxel
+            axis = tMax[0] < tMax[1] ? (tMax[0] < tMax[2] ? 0 : 2) : (tMax[1] < tMax[2] ? 1 : 2);
+            t = tMax[axis];
+            c[axis] += step[axis];
+            tMax[axis] += tDelta[axis];
+        } else { // Leave the empty cell, the voxel on the other side is found from where the ray crosses its border
+            int32_t base[3];
+            float tExit[3];
+            for (int i = 0; i < 3; i++) {
+                base[i] = c[i] & ~(size - 1);
+                tExit[i] = (static_cast<float>(step[i] > 0 ? base[i] + size : base[i]) - o[i]) * inv[i];
+            }
+            axis = tExit[0] < tExit[1] ? (tExit[0] < tExit[2] ? 0 : 2) : (tExit[1] < tExit[2] ? 1 : 2);
+            t = std::max(t, tExit[axis]);
+            for (int i = 0; i < 3; i++) {
+                if (i == axis) { c[i] = step[i] > 0 ? base[i] + size : base[i] - 1; }
+                else { c[i] = std::min(std::max(fastfloor(o[i] + d[i] * t), base[i]), base[i] + size - 1); }
+                tMax[i] = (static_cast<float>(step[i] > 0 ? c[i] + 1 : c[i]) - o[i]) * inv[i];
+            }
+        }
+        if (!(t < maxDistance)) { break; } // Also stops rays with a broken direction
+
+        const int32_t cx = c[0] >> CHUNK_SHIFT, cy = c[1] >> CHUNK_SHIFT, cz = c[2] >> CHUNK_SHIFT;
+        if (!haveChunk || cx != chunkLoc[0] || cy != chunkLoc[1] || cz != chunkLoc[2]) {
+            chunk = world.find_chunk(cx, cy, cz);
+            if (chunk == nullptr) { world.request_chunk(cx, cy, cz); }
+            chunkLoc[0] = cx; chunkLoc[1] = cy; chunkLoc[2] = cz;
+            haveChunk = true;
+        }
+        uint32_t material;
+        size = World::probe_chunk(chunk, c[0], c[1], c[2], material, lod_level(t, footprint));
+        if (material != 0) {
+            for (int i = 0; i < 3; i++) { hit.voxel[i] = c[i]; }
+            hit.t = t;
+            hit.axis = axis;
+            hit.material = material;
+            return true;
+        }
+    }
+    hit.t = t;
+    hit.axis = axis;
+    hit.material = 0;
+    return false;
+}
+
+// Finds the first solid voxel along a normalised direction with the kernel for the direction's octant, every ray query goes through here
+static bool traverse(const World& world, const vec3& origin, const vec3& direction, float maxDistance, VoxelHit& hit, float footprint = 0.0f, float start = 0.0f) {
+    switch ((direction[0] < 0.0f ? 1 : 0) | (direction[1] < 0.0f ? 2 : 0) | (direction[2] < 0.0f ? 4 : 0)) {
+    case 0: return traverseOctant<1, 1, 1>(world, origin, direction, maxDistance, hit, footprint, start);
+    case 1: return traverseOctant<-1, 1, 1>(world, origin, direction, maxDistance, hit, footprint, start);
+    case 2: return traverseOctant<1, -1, 1>(world, origin, direction, maxDistance, hit, footprint, start);
+    case 3: return traverseOctant<-1, -1, 1>(world, origin, direction, maxDistance, hit, footprint, start);
+    case 4: return traverseOctant<1, 1, -1>(world, origin, direction, maxDistance, hit, footprint, start);
+    case 5: return traverseOctant<-1, 1, -1>(world, origin, direction, maxDistance, hit, footprint, start);
+    case 6: return traverseOctant<1, -1, -1>(world, origin, direction, maxDistance, hit, footprint, start);
+    default: return traverseOctant<-1, -1, -1>(world, origin, direction, maxDistance, hit, footprint, start);
     }
 }
 
@@ -68,120 +164,74 @@ static vec3 refract(const vec3& source, const Material& mat, vec3& location, vec
     return reflect(source, mat, location, direction, normal, world, bounces, maxBounces) * fresnel + trace(source, refracted, world, bounces, maxBounces, depth) * (1.0f - fresnel);
 }
 
-static bool shadow(const vec3& source, const vec3& start, World& world) {
-    vec3 location = start;
-    vec3 direction = world.sunDirection;
-    direction = direction.normalize();
-    vec3 tMax(0, 0, 0);
-    vec3 normal;
-    short locDif[3]{ direction.x() > 0.0f ? 1 : -1, direction.y() > 0.0f ? 1 : -1, direction.z() > 0.0f ? 1 : -1 };
-    int x = fastfloor(location.x()), y = fastfloor(location.y()), z = fastfloor(location.z());
-
-    calculateTMaxForNextVoxel(location, direction, locDif, tMax);
-
-    //printf_s("Shadow debug:\n");
-    //direction.print();
-    //tMax.print();
-
-    // Iterate ray
-    while ((location - source).length() < MAX_CHUNK_DISTANCE) {
-        // traverse the ray to next voxel
-        calculateTMaxForNextVoxel(location, direction, locDif, tMax);
-        if (tMax.x() < tMax.y() && tMax.x() < tMax.z()) { // tMaxX
-            location += direction * tMax.x();
-            x += locDif[0];
-            normal = vec3((locDif[0] == 1 ? -1.0f : 1.0f), 0.0f, 0.0f);
-        } else if (tMax.y() < tMax.z()) { //tMaxY
-            location += direction * tMax.y();
-            y += locDif[1];
-            normal = vec3(0.0f, (locDif[1] == 1 ? -1.0f : 1.0f), 0.0f);
-        } else if (tMax.z() < 1000.0f) { // tMaxZ, check included to make sure tMaxZ is not near infinite
-            location += direction * tMax.z();
-            z += locDif[2];
-            normal = vec3(0.0f, 0.0f, (locDif[2] == 1 ? -1.0f : 1.0f));
-        } else {
-            printf_s("tMax values are too big..\n");
-            exit(-200);
-        }
+// True if something solid is between the point and the sun
+static bool shadow(const vec3& start, World& world) {
+    threadCounters.shadowRays++;
+    VoxelHit hit;
+    return traverse(world, start, unit_vector(world.sunDirection), MAX_CHUNK_DISTANCE, hit);
+}
 
-        // Check if voxel is solid
-        if (world.get_voxel(x, y, z)) { // TODO: fix glass scattering twice if the same material repeats immediatly in the next voxel
-            return true;
-        }
+// Shadow of the empty voxel the point is in, traced from the voxel's centre the first time and looked up in the world's cache after that
+static bool cachedShadow(const vec3& start, World& world) {
+    const int32_t x = fastfloor(start[0]), y = fastfloor(start[1]), z = fastfloor(start[2]);
+    bool shadowed;
+    if (world.find_sun_shadow(x, y, z, shadowed)) { return shadowed; }
+    const vec3 center(x + 0.5f, y + 0.5f, z + 0.5f);
+    shadowed = shadow(center, world);
+    world.store_sun_shadow(x, y, z, shadowed);
+    return shadowed;
+}
+
+// Sunlight on a surface facing normal, shared by shade() and the wavefront tracer. Shadowed surfaces are not darkened yet.
+static float sunLight(const World& world, const vec3& normal, bool shadowed) {
+    return dot(world.sunDirection, normal) * (shadowed ? 1.0f : 1.0f);
+}
+
+// Colors a hit, shared by the single ray and packet tracers
+static vec3 shade(const vec3& source, const vec3& location, vec3& direction, vec3& normal, uint32_t voxelMaterialId, bool shad, World& world, int bounces, int maxBounces) {
+    if (voxelMaterialId > world.materials.size() - 1) {
+        printf_s("VoxelMaterialId %i was over %i, reset to 0", voxelMaterialId, world.materials.size() - 1);
+        voxelMaterialId = 0;
+    }
+    const Material& mat = world.materials[voxelMaterialId];
+    vec3 rayLoc = location;
+    rayLoc -= direction * 0.0001f;
+    //printf_s("%s\n", shad ? "true" : "false");
+    float light = sunLight(world, normal, shad);
+    switch (mat.type) {
+    case REFLECTIVE: {
+        if (mat.effectValue <= 0.0f) { return mat.albedo * light; }
+        if (mat.effectValue >= 1.0f) { return reflect(source, mat, rayLoc, direction, normal, world, bounces - 1, maxBounces) * light; }
+        return reflect(source, mat, rayLoc, direction, normal, world, bounces - 1, maxBounces) * mat.effectValue * light + mat.albedo * (1 - mat.effectValue) * light;
+        break;
+    }
+    case REFRACTIVE: { // TODO: FIX: half of the surface is darker and the other half is lighter, is this because of reflection?
+        return mat.albedo * light; // TMP
+        return refract(source, mat, rayLoc, direction, normal, world, bounces - 1, maxBounces) * light;
+        break;
+    }
+    default: {
+        return mat.albedo * light;
+        break;
+    }
     }
-    return false;
 }
 
-vec3 trace(const vec3& source, const Ray& ray, World& world, int bounces, int maxBounces, float& depth) {
-    vec3 location = ray.position;
+vec3 trace(const vec3& source, const Ray& ray, World& world, int bounces, int maxBounces, float& depth, float footprint, float start) {
     vec3 direction = unit_vector(ray.direction);
     if (bounces == 0) { return skybox(direction); }
-    vec3 tMax(0, 0, 0);
-    vec3 normal;
-    short locDif[3]{ direction.x() > 0.0f ? 1 : -1, direction.y() > 0.0f ? 1 : -1, direction.z() > 0.0f ? 1 : -1 };
-    int32_t next[3]{ direction.x() > 0.0f ? fastceil(location.x()) : fastfloor(location.x()),
-                     direction.y() > 0.0f ? fastceil(location.y()) : fastfloor(location.y()),
-                     direction.z() > 0.0f ? fastceil(location.z()) : fastfloor(location.z()) };
-    int32_t current[3]{ direction.x() < 0.0f ? fastceil(location.x()) : fastfloor(location.x()),
-                        direction.y() < 0.0f ? fastceil(location.y()) : fastfloor(location.y()),
-                        direction.z() < 0.0f ? fastceil(location.z()) : fastfloor(location.z()) };
-    uint32_t voxelMaterialId;
-
-    calculateTMaxForNextVoxel(location, direction, locDif, tMax);
-
-    // Iterate ray
-    while ((location - source).length() < MAX_CHUNK_DISTANCE) {
-        // traverse the ray to next voxel
-        calculateTMaxForNextVoxel(location, direction, locDif, tMax);
-        if (tMax.x() < tMax.y() && tMax.x() < tMax.z()) { // tMaxX
-            location += direction * tMax.x();
-            current[0] += locDif[0];
-            normal = vec3((locDif[0] == 1 ? -1.0f : 1.0f), 0.0f, 0.0f);
-        } else if (tMax.y() < tMax.z()) { //tMaxY
-            location += direction * tMax.y();
-            current[1] += locDif[1];
-            normal = vec3(0.0f, (locDif[1] == 1 ? -1.0f : 1.0f), 0.0f);
-        } else if (tMax.z() < 1000.0f) { // tMaxZ, check included to make sure tMaxZ is not near infinite
-            location += direction * tMax.z();
-            current[2] += locDif[2];
-            normal = vec3(0.0f, 0.0f, (locDif[2] == 1 ? -1.0f : 1.0f));
-        } else {
-            printf_s("tMax values are too big..\n");
-            exit(-200);
-        }
-        depth += std::fmin(tMax.x(), std::fmin(tMax.y(), tMax.z()));
 
-        // Check if voxel is solid
-        if (voxelMaterialId = world.get_voxel(current[0], current[1], current[2])) { // TODO: fix glass scattering twice if the same material repeats immediatly in the next voxel
-            if (voxelMaterialId > world.materials.size()-1) {
-                printf_s("VoxelMaterialId %i was over %i, reset to 0", voxelMaterialId, world.materials.size() - 1);
-                voxelMaterialId = 0;
-            }
-            const Material& mat = world.materials[voxelMaterialId];
-            Ray shadowRay = Ray();
-            vec3 rayLoc = location;
-            rayLoc -= direction * 0.0001f;
-            bool shad = shadow(source, location - direction * 0.0001f, world);
-            //printf_s("%s\n", shad ? "true" : "false");
-            float light = dot(world.sunDirection, normal) * (shad ? 1.0f : 1.0f);
-            switch (mat.type) {
-            case REFLECTIVE: {
-                if (mat.effectValue <= 0.0f) { return mat.albedo * light; }
-                if (mat.effectValue >= 1.0f) { return reflect(source, mat, rayLoc, direction, normal, world, bounces - 1, maxBounces) * light; }
-                return reflect(source, mat, rayLoc, direction, normal, world, bounces - 1, maxBounces) * mat.effectValue * light + mat.albedo * (1 - mat.effectValue) * light;
-                break;
-            }
-            case REFRACTIVE: { // TODO: FIX: half of the surface is darker and the other half is lighter, is this because of reflection?
-                return mat.albedo * light; // TMP
-                return refract(source, mat, rayLoc, direction, normal, world, bounces - 1, maxBounces) * light;
-                break;
-            }
-            default: {
-                return mat.albedo * light;
-                break;
-            }
-            }
-        }
-    }
-    return skybox(direction);
-}
\ No newline at end of file
+    threadCounters.rays++;
+    threadCounters.bounceDepths[std::min(maxBounces - bounces, PROFILE_BOUNCE_DEPTHS - 1)]++;
+    VoxelHit hit;
+    const bool found = traverse(world, ray.position, direction, MAX_CHUNK_DISTANCE, hit, footprint, start);
+    depth += hit.t;
+    if (!found) { return skybox(direction); }
+
+    // TODO: fix glass scattering twice if the same material repeats immediatly in the next voxel
+    vec3 location = ray.position + direction * hit.t;
+    vec3 normal(0.0f, 0.0f, 0.0f);
+    normal[hit.axis] = direction[hit.axis] < 0.0f ? 1.0f : -1.0f;
+    bool shad = cachedShadow(location - direction * 0.0001f, world);
+    return shade(source, location, direction, normal, hit.material, shad, world, bounces, maxBounces);
+}
@@ -4,6 +4,10 @@
 #include <math.h>
 #include <cstdio>
 
+#if !defined(_MSC_VER) && !defined(printf_s)
+#define printf_s printf // printf_s only exists in the MSVC runtime
+#endif
+
 struct vec3 {
 public:
     float vertices[3]{ 0.0f };
@@ -26,7 +30,7 @@ public:
 
     inline const vec3& operator+() const { return *this; }
     inline vec3 operator-() const { return vec3(-vertices[0], -vertices[1], -vertices[2]); }
-    inline const vec3& normalize() { float l = length(); vec3 t; if (l == 0) { t = {0, 1, 0}; } else { t = {vertices[0] / l, vertices[1] / l, vertices[2] / l}; } return t; }
+    inline vec3 normalize() const { float l = length(); vec3 t; if (l == 0) { t = {0, 1, 0}; } else { t = {vertices[0] / l, vertices[1] / l, vertices[2] / l}; } return t; }
     inline float operator[](int i) const { return vertices[i]; }
     inline float& operator[](int i) { return vertices[i]; }
     inline float length() const { return sqrt(vertices[0] * vertices[0] + vertices[1] * vertices[1] + vertices[2] * vertices[2]); }
@@ -1,67 +1,87 @@
 #pragma once
 
-#include <algorithm>
-#include <execution>
 #include "SDLWindowEngine.h"
-#include "Screenshot.h"
-#include "Tracing.h"
+#include "ImageOutput.h"
+#include "Renderer.h"
+#include "DynamicResolution.h"
+#include "ChunkStreamer.h"
+#include "Resolve.h"
 
 constexpr int SC_WIDTH = 1920;
 constexpr int SC_HEIGHT = 1080;
+constexpr const char* SC_FILENAME = "test.png";
 
 struct Engine : public SDLWindowEngine {
 private:
 	World world;
+	TerrainGenerator terrain;
+	ChunkStreamer streamer;
 	Camera cam;
+	Renderer renderer;
+	Framebuffer frame, screenshotFrame; // Separate so a screenshot does not throw away the window's accumulated samples
+	ImageWriter imageWriter; // Encodes screenshots in the background
+	ResolutionController resolution; // Size of frame, scaled so moving around stays within the frame budget
+	std::vector<vec3> upscaled; // frame brought up to the window size
+	ResolveSettings display; // Turns the linear colour of frame into the window's pixels
+	std::vector<uint32_t> resolved; // Only used for surface formats the resolve cannot write directly
 
 	virtual bool programInit() override {
-		// init materials
-		world.materials.push_back(Material()); // air
-		world.materials.push_back(Material(SOLID, {0.3f, 0.5f, 0.8f}, 0.3f, 0.3f)); // solid
-		world.materials.push_back(Material(SOLID, {0.8f, 0.3f, 0.5f}, 0.3f, 0.3f)); // reflective
-		world.materials.push_back(Material(SOLID, {0.5f, 0.8f, 0.3f}, 0.3f, 0.3f)); // refractive
+		init_default_materials(world);
+		renderer.temporalReuse = true; // The window shows one sample per frame while moving, reuse what the last frame already found
 
 		cam = Camera({ 0, 1, 0 }, 50.0f, static_cast<float>(surface->w) / static_cast<float>(surface->h), 0.1f, 10.0f);
+		streamer.generator = &terrain;
+		cam.position = vec3(0.0f, static_cast<float>(terrain.surface_height(0, 0) + 2), 0.0f);
 
 		return true;
 	};
 
-	void renderToSurface(SDL_Surface* s, const vec3& dir, int samples) {
+	// Returns how long rendering into fb took, without the upscale and the resolve into the surface
+	uint64_t renderToSurface(SDL_Surface* s, Framebuffer& fb, const vec3& dir, int samples) {
 		cam.prepare(dir);
 
-		std::vector<uint32_t> vertIter, horIter;
-		vertIter.clear();
-		vertIter.resize(s->h);
-		for (int i = 0; i < s->h; i++) { vertIter[i] = i; }
-		horIter.clear();
-		horIter.resize(s->w);
-		for (int i = 0; i < s->w; i++) { horIter[i] = i; }
-		float wp = 1.0f / static_cast<float>(s->w), hp = 1.0f / static_cast<float>(s->h);
-
-		{// Clear the screen
-			int size = s->w * s->h;
-			uint32_t* pixels = (uint32_t*)s->pixels;
-			uint32_t t = SDL_MapRGBA(format, 0, 0, 0, 255);
-			for (int i = 0; i < size; i++) {
-				pixels[i] = t;
-			}
+		int width, height;
+		resolution.size(s->w, s->h, width, height);
+		if (fb.width != width || fb.height != height) { fb.resize(width, height); }
+		const uint64_t start = getTime();
+		{
+			ProfileScope scope(profiler, "render");
+			renderer.render(world, cam, fb, samples);
 		}
+		const uint64_t us = getTime() - start;
 
-		if (samples > 1) {
-			std::for_each(std::execution::par, vertIter.begin(), vertIter.end(), [this, s, wp, hp, horIter](uint32_t y) {
-				std::for_each(std::execution::par, horIter.begin(), horIter.end(), [this, s, wp, hp, y](uint32_t x) {
-					Ray ray = cam.get_ray(static_cast<float>(x) * wp, static_cast<float>(y) * hp);
-
-
-					float depth = 0; // unused but required for 
-					vec3 color = trace(cam.position, ray, world, 0, 1, depth);
-					// TODO: maybe multisampling a pixel?
-
-
-					setPixel(s, x, y, SDL_MapRGBA(format, ((uint8_t)color.r() * 255.99f), ((uint8_t)color.g() * 255.99f), ((uint8_t)color.b() * 255.99f), 255));
-				});
-			});
+		const std::vector<vec3>* image = &fb.pixels;
+		if (width != s->w || height != s->h) {
+			ProfileScope scope(profiler, "upscale");
+			upscale(fb, upscaled, s->w, s->h, renderer.scheduler);
+			image = &upscaled;
+		}
+		ProfileScope scope(profiler, "resolve");
+		PixelLayout layout;
+		if (pixel_layout(s->format, layout)) {
+			resolve(image->data(), s->w, s->h, s->pixels, s->pitch, layout, display, renderer.scheduler);
+			return us;
+		}
+		// Other formats get the default layout first and are converted per pixel, the window's own buffers never need this
+		resolved.resize(static_cast<size_t>(s->w) * s->h);
+		resolve(image->data(), s->w, s->h, resolved.data(), s->w * 4, layout, display, renderer.scheduler);
+		for (int y = 0; y < s->h; y++) {
+			for (int x = 0; x < s->w; x++) {
+				const uint32_t p = resolved[static_cast<size_t>(y) * s->w + x];
+				setPixel(s, x, y, SDL_MapRGBA(format, static_cast<uint8_t>(p >> layout.redShift), static_cast<uint8_t>(p >> layout.greenShift), static_cast<uint8_t>(p >> layout.blueShift), 255));
+			}
 		}
+		return us;
+	}
+
+	// Where the resolve puts the channels of a pixel, false if the format is not 32 bits with 8 bits per channel
+	static bool pixel_layout(const SDL_PixelFormat* f, PixelLayout& layout) {
+		if (f->BytesPerPixel != 4 || f->Rmask != 0xFFu << f->Rshift || f->Gmask != 0xFFu << f->Gshift || f->Bmask != 0xFFu << f->Bshift) { return false; }
+		layout.redShift = f->Rshift;
+		layout.greenShift = f->Gshift;
+		layout.blueShift = f->Bshift;
+		layout.alphaMask = f->Amask;
+		return true;
 	}
 
 	virtual void onEvent(SDL_Event* event) override {
@@ -76,32 +96,46 @@ private:
 	};
 
 	virtual void onLoop() override {
-		// Load the chunks requested in the last frame
-		world.loadChunks();
+		// Publish the chunks that finished streaming in and queue the ones requested in the last frame
+		{
+			ProfileScope scope(profiler, "loadChunks");
+			streamer.update(world, cam);
+		}
 
 		// TODO: use input to move camera
+		if (input.isKeyPressed(SDL_SCANCODE_P)) { renderer.packetTracing = !renderer.packetTracing; }
+		if (input.isKeyPressed(SDL_SCANCODE_O)) { renderer.wavefront = !renderer.wavefront; }
+		if (input.isKeyPressed(SDL_SCANCODE_T)) { renderer.temporalReuse = !renderer.temporalReuse; }
 
 		// Prepare camera for rendering
-		float depth = 0;
-		trace(cam.position, cam.get_ray(0.5f, 0.5f), world, 0, 5, depth);
-		cam.focusDistance = depth;
+		{
+			ProfileScope scope(profiler, "autofocus");
+			float depth = 0;
+			trace(cam.position, cam.get_ray(0.5f, 0.5f), world, 1, 1, depth);
+			if (depth > 0.0f) { cam.focusDistance = depth; }
+		}
 
 		// Render image
 		uint64_t start = getTime();
-		renderToSurface(surface, { 3,5,8 }, 1);
+		uint64_t renderUs;
+		{
+			ProfileScope scope(profiler, "renderToSurface");
+			renderUs = renderToSurface(surface, frame, { 3,-2,8 }, 1);
+		}
 		uint64_t us = getTime() - start;
-		printf_s("Rendering the frame took %d us (%d ms)\n", us, us / 1000);
+		resolution.update(us, renderUs, frame.width, frame.height, surface->w, surface->h, renderer.lastRestarted);
+		printf_s("Rendering the frame took %llu us (%llu ms, %dx%d, %llu samples, %llu reused, %.2f Msamples/s %s)\n", static_cast<unsigned long long>(us), static_cast<unsigned long long>(us / 1000), frame.width, frame.height, static_cast<unsigned long long>(renderer.lastSampleCount), static_cast<unsigned long long>(renderer.lastReusedCount), us > 0 ? static_cast<double>(renderer.lastSampleCount) / us : 0.0, renderer.wavefront ? "wavefront" : (renderer.packetTracing ? "packets" : "single rays"));
 
 		// Render screenshot if needed
-		if (input.isKeyPressed(SDLK_q)) {
-			SDL_Surface* screenshot = SDL_CreateRGBSurfaceWithFormat(NULL, SC_WIDTH, SC_HEIGHT, 8, format->format);
-			if (screenshot != nullptr) {
-				start = getTime();
-				renderToSurface(screenshot, {3,5,8}, 10);
-				us = getTime() - start;
-				printf_s("Rendering the screenshot took %d us (%d ms)\n", us, us / 1000);
-				save_surface_as_bmp(screenshot, "test.bmp");
-			}
+		if (input.isKeyPressed(SDL_SCANCODE_Q)) {
+			ProfileScope scope(profiler, "screenshot");
+			start = getTime();
+			cam.prepare({ 3,-2,8 });
+			if (screenshotFrame.width != SC_WIDTH || screenshotFrame.height != SC_HEIGHT) { screenshotFrame.resize(SC_WIDTH, SC_HEIGHT); }
+			renderer.render(world, cam, screenshotFrame, 10);
+			us = getTime() - start;
+			printf_s("Rendering the screenshot took %llu us (%llu ms, %llu samples, %.2f Msamples/s)\n", static_cast<unsigned long long>(us), static_cast<unsigned long long>(us / 1000), static_cast<unsigned long long>(renderer.lastSampleCount), us > 0 ? static_cast<double>(renderer.lastSampleCount) / us : 0.0);
+			imageWriter.save(screenshotFrame, SC_FILENAME);
 		}
 	};
 
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include "Tracing.h"
+
+// Rays of one wave as structure of arrays, every stage only streams through the fields it needs
+struct RayQueue {
+	std::vector<float> origin[3], direction[3];
+	std::vector<vec3> weight; // How much the ray's color counts towards its path
+	std::vector<uint32_t> path; // Path the ray continues
+
+	inline size_t size() const { return path.size(); }
+
+	void clear() {
+		for (int i = 0; i < 3; i++) {
+			origin[i].clear();
+			direction[i].clear();
+		}
+		weight.clear();
+		path.clear();
+	}
+
+	inline void push(const vec3& o, const vec3& d, const vec3& w, uint32_t p) {
+		for (int i = 0; i < 3; i++) {
+			origin[i].push_back(o[i]);
+			direction[i].push_back(d[i]);
+		}
+		weight.push_back(w);
+		path.push_back(p);
+	}
+
+	inline vec3 get_origin(size_t i) const { return vec3(origin[0][i], origin[1][i], origin[2][i]); }
+	inline vec3 get_direction(size_t i) const { return vec3(direction[0][i], direction[1][i], direction[2][i]); }
+};
+
+// Rays of a wave that hit something, the shading stage visits them in material order
+struct HitQueue {
+	std::vector<uint32_t> ray; // Index into the wave's RayQueue
+	std::vector<float> t;
+	std::vector<uint8_t> axis, shadowed;
+	std::vector<uint32_t> material;
+	std::vector<uint64_t> order; // Material type and id in the high bits, hit index in the low bits
+
+	inline size_t size() const { return ray.size(); }
+
+	void clear() {
+		ray.clear();
+		t.clear();
+		axis.clear();
+		shadowed.clear();
+		material.clear();
+		order.clear();
+	}
+};
+
+// Traces paths one bounce at a time over a whole batch: every ray of a wave is extended, then the shadows of all hits are resolved,
+// the hits are sorted by material and shaded, and the reflected rays are packed into the next wave.
+// Gives the same colors as trace(), only the order of the work is different.
+struct Wavefront {
+private:
+	RayQueue rays, next;
+	HitQueue hits;
+
+	// Finds the first solid voxel for every ray, the ones that miss get the sky. Only primary rays use the coarse levels.
+	void extend(World& world, int depth, float footprint) {
+		const bool primary = depth == 0;
+		threadCounters.rays += rays.size();
+		threadCounters.bounceDepths[std::min(depth, PROFILE_BOUNCE_DEPTHS - 1)] += rays.size();
+		for (size_t i = 0; i < rays.size(); i++) {
+			const vec3 direction = rays.get_direction(i);
+			VoxelHit hit;
+			if (!traverse(world, rays.get_origin(i), direction, MAX_CHUNK_DISTANCE, hit, primary ? footprint : 0.0f, primary ? starts[rays.path[i]] : 0.0f)) {
+				vec3 sky = direction;
+				colors[rays.path[i]] += rays.weight[i] * skybox(sky);
+				continue;
+			}
+			if (primary) { depths[rays.path[i]] = hit.t; }
+			uint32_t material = hit.material;
+			if (material > world.materials.size() - 1) { material = 0; } // Same fallback as shade()
+			hits.ray.push_back(static_cast<uint32_t>(i));
+			hits.t.push_back(hit.t);
+			hits.axis.push_back(static_cast<uint8_t>(hit.axis));
+			hits.material.push_back(material);
+		}
+	}
+
+	void resolveShadows(World& world) {
+		hits.shadowed.resize(hits.size());
+		for (size_t k = 0; k < hits.size(); k++) {
+			const uint32_t i = hits.ray[k];
+			const vec3 direction = rays.get_direction(i);
+			const vec3 location = rays.get_origin(i) + direction * hits.t[k];
+			hits.shadowed[k] = cachedShadow(location - direction * 0.0001f, world);
+		}
+	}
+
+	void sortByMaterial(const World& world) {
+		hits.order.resize(hits.size());
+		for (size_t k = 0; k < hits.size(); k++) {
+			const uint64_t type = world.materials[hits.material[k]].type;
+			hits.order[k] = (type << 56) | (static_cast<uint64_t>(hits.material[k]) << 32) | k;
+		}
+		std::sort(hits.order.begin(), hits.order.end());
+	}
+
+	// Same math as shade() and reflect(), reflections become rays of the next wave instead of recursing
+	void shade(World& world) {
+		for (uint64_t key : hits.order) {
+			const size_t k = static_cast<size_t>(key & 0xFFFFFFFF);
+			const uint32_t i = hits.ray[k];
+			const vec3 direction = rays.get_direction(i);
+			const vec3 location = rays.get_origin(i) + direction * hits.t[k];
+			const int axis = hits.axis[k];
+			vec3 normal(0.0f, 0.0f, 0.0f);
+			normal[axis] = direction[axis] < 0.0f ? 1.0f : -1.0f;
+			const Material& mat = world.materials[hits.material[k]];
+			const float light = sunLight(world, normal, hits.shadowed[k]);
+			const vec3& weight = rays.weight[i];
+			vec3& color = colors[rays.path[i]];
+
+			if (mat.type != REFLECTIVE || mat.effectValue <= 0.0f) { // Refraction is not traced by shade() either yet
+				color += weight * mat.albedo * light;
+				continue;
+			}
+			vec3 reflected = direction;
+			reflected[axis] = -reflected[axis];
+			const float effect = std::min(mat.effectValue, 1.0f);
+			if (effect < 1.0f) { color += weight * mat.albedo * ((1.0f - effect) * light); }
+			next.push(location - direction * 0.0001f, reflected, weight * (effect * light), rays.path[i]);
+		}
+	}
+
+public:
+	std::vector<vec3> colors; // Per path, filled in by run()
+	std::vector<float> depths; // Per path, distance to the primary hit or negative if the primary ray missed
+	std::vector<float> starts; // Per path, distance along the primary ray that is known to be empty, see beam_start()
+
+	// Starts a new batch, paths are numbered in the order their primary rays are added
+	void clear() {
+		rays.clear();
+		colors.clear();
+		depths.clear();
+		starts.clear();
+	}
+
+	inline void add(const Ray& ray, float start = 0.0f) {
+		rays.push(ray.position, unit_vector(ray.direction), vec3(1.0f, 1.0f, 1.0f), static_cast<uint32_t>(colors.size()));
+		colors.push_back(vec3(0.0f, 0.0f, 0.0f));
+		depths.push_back(-1.0f);
+		starts.push_back(start);
+	}
+
+	// Traces every path that was added, bounces and footprint work the same way as for trace()
+	void run(World& world, int bounces, float footprint = 0.0f) {
+		for (int b = bounces; rays.size() > 0; b--) {
+			if (b == 0) { // Out of bounces, trace() returns the sky here
+				for (size_t i = 0; i < rays.size(); i++) {
+					vec3 direction = rays.get_direction(i);
+					colors[rays.path[i]] += rays.weight[i] * skybox(direction);
+				}
+				break;
+			}
+			hits.clear();
+			next.clear();
+			extend(world, bounces - b, footprint);
+			resolveShadows(world);
+			sortByMaterial(world);
+			shade(world);
+			std::swap(rays, next);
+		}
+		rays.clear();
+	}
+};
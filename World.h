@@ -1,17 +1,38 @@
 #pragma once
 
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
 #include <vector>
+#include "ChunkAllocator.h"
+#include "Profiler.h"
 #include "Randomizer.h"
 
-constexpr uint32_t CHUNKS = 1024;
-constexpr int32_t CHUNK_WIDTH = 16;
+constexpr int32_t CHUNK_SHIFT = 4; // log2 of the chunk width, used to split world coords into chunk and local coords
+constexpr int32_t CHUNK_WIDTH = 1 << CHUNK_SHIFT;
+constexpr int32_t CHUNK_MASK = CHUNK_WIDTH - 1;
 constexpr uint32_t CHUNK_SIZE = CHUNK_WIDTH * CHUNK_WIDTH * CHUNK_WIDTH;
 constexpr uint32_t CHUNK_ARRAY_SIZE = CHUNK_SIZE * sizeof(uint32_t);
+constexpr int32_t BRICK_SHIFT = 2; // Bricks are 4x4x4 voxel blocks used for empty space skipping
+constexpr int32_t BRICK_WIDTH = 1 << BRICK_SHIFT;
+constexpr int32_t BRICKS_PER_AXIS = CHUNK_WIDTH / BRICK_WIDTH;
+constexpr uint32_t BRICKS = BRICKS_PER_AXIS * BRICKS_PER_AXIS * BRICKS_PER_AXIS; // Has to fit in the 64 bit brick mask
+constexpr int32_t CHUNK_LEVELS = CHUNK_SHIFT; // Coarse levels above the voxels, cells of 2, 4, 8 and 16 voxels for 16^3 chunks
+constexpr uint64_t CHUNK_KEY_EMPTY = ~0ULL;
+constexpr uint32_t CHUNK_REQUEST_SIZE = 4096; // Power of two, misses that do not fit are dropped and simply requested again next frame
+constexpr uint32_t CHUNK_REQUEST_PROBES = 32;
+constexpr size_t DEFAULT_MEMORY_BUDGET = 32ull << 20; // Bytes of resident chunks, roughly two thousand full chunks
 
-static uint32_t _BACKUP_ = 0;
+#define RENDER_DISTANCE 10
+#define MAX_CHUNK_DISTANCE (RENDER_DISTANCE * CHUNK_WIDTH)
 
 enum MaterialType {
 	AIR,
@@ -36,108 +57,1313 @@ struct Material {
 	~Material() {};
 };
 
+// Index of a voxel inside its chunk, takes world or local coords
+static inline uint32_t voxel_index(long x, long y, long z) { return static_cast<uint32_t>(((z & CHUNK_MASK) << (CHUNK_SHIFT * 2)) | ((y & CHUNK_MASK) << CHUNK_SHIFT) | (x & CHUNK_MASK)); }
+
+// Coarse levels are stored finest first, level 1 at the start
+static constexpr uint32_t mip_offset(int32_t level) { return level <= 1 ? 0 : mip_offset(level - 1) + (1u << ((CHUNK_SHIFT - level + 1) * 3)); }
+constexpr uint32_t MIP_CELLS = mip_offset(CHUNK_LEVELS + 1);
+constexpr uint32_t MIP_MARK_WORDS = ((CHUNK_SIZE >> 3) + 63) / 64; // 64 bit words for a bit per level 1 cell
+
+// Index of the cell of the given level that holds a voxel, takes world or local coords
+static inline uint32_t mip_index(int32_t level, long x, long y, long z) {
+	const int32_t w = CHUNK_SHIFT - level;
+	return mip_offset(level) + static_cast<uint32_t>((((z & CHUNK_MASK) >> level) << (w * 2)) | (((y & CHUNK_MASK) >> level) << w) | ((x & CHUNK_MASK) >> level));
+}
+
 struct ChunkLocation {
 	int x, y, z;
 
 	ChunkLocation() { x = 0; y = 0; z = 0; }
 	ChunkLocation(int X, int Y, int Z) : x(X), y(Y), z(Z) {}
+
+	// Packs the location into 21 bits per axis, the top bit stays clear so a key never equals CHUNK_KEY_EMPTY
+	inline const uint64_t key() const { return (static_cast<uint64_t>(x & 0x1FFFFF) << 42) | (static_cast<uint64_t>(y & 0x1FFFFF) << 21) | static_cast<uint64_t>(z & 0x1FFFFF); }
+
+	// Inverse of key(), sign extends every axis back from 21 bits
+	static inline ChunkLocation from_key(uint64_t key) {
+		auto axis = [](uint64_t v) { return static_cast<int>(static_cast<int64_t>(v << 43) >> 43); };
+		return ChunkLocation(axis(key >> 42), axis(key >> 21), axis(key));
+	}
+};
+
+// Spreads a chunk key over a power of two sized table (up to 2^24 entries), the fold keeps the x bits at the top of the key from being multiplied away
+static inline uint32_t chunk_hash(uint64_t key, uint32_t size) { return static_cast<uint32_t>(((key ^ (key >> 29)) * 0x9E3779B97F4A7C15ULL) >> 40) & (size - 1); }
+
+// How a chunk keeps its voxels, chunks switch between these on their own as voxels get written
+enum ChunkStorage : uint8_t {
+	CHUNK_UNLOADED,
+	CHUNK_UNIFORM, // Every voxel has the same value, needs no voxel memory at all
+	CHUNK_PALETTE, // Up to 256 distinct values, every voxel is a 1, 2, 4 or 8 bit index into the palette
+	CHUNK_FULL, // One value per voxel
+	CHUNK_COARSE // Only the coarse levels are kept, voxels read as the level 1 cell they are in
+};
+
+// How a chunk starts in a region file. The voxel block and the coarse levels follow it exactly as a chunk keeps them in memory,
+// so a loaded chunk can read them straight from the mapped file.
+struct ChunkRecord {
+	uint32_t uniform, solidCount;
+	uint8_t storage, indexShift;
+	uint16_t paletteSize, mipPaletteSize, mipPaletteCapacity;
+	uint64_t brickMask;
+	uint8_t brickCounts[BRICKS];
+};
+
+// One voxel of a Chunk::set_batch, index as from voxel_index
+struct VoxelWrite {
+	uint32_t index, value;
 };
 
 struct Chunk {
 private:
-	uint32_t* voxels = nullptr; // Voxel storage
+	uint32_t* data = nullptr; // The full voxel array, or the palette followed by the packed indices
+	uint32_t* indices = nullptr; // Packed palette indices inside data
+	uint32_t uniform = 0; // Value of every voxel of a uniform chunk
+	uint32_t indexMask = 0;
+	uint16_t paletteSize = 0;
+	uint8_t indexShift = 0; // log2 of the bits per palette index
+	ChunkStorage storage = CHUNK_UNLOADED;
+	uint64_t brickMask = 0; // Bit per brick that contains at least one solid voxel
+	uint8_t brickCounts[BRICKS]{ 0 }; // Solid voxels per brick, keeps the mask correct when voxels get cleared
+	uint32_t solidCount = 0;
+	mutable std::atomic<uint32_t> lastAccess{ 0 }; // World frame in which a ray last looked at this chunk
+
+	// Coarse levels for distant rays, every cell holds the value most of its solid children have, or air if less than half of them are solid.
+	// Cells are indices into their own small palette, all in one block. Uniform chunks need none, chunks with too many values get none.
+	uint8_t* mips = nullptr;
+	uint32_t* mipPalette = nullptr; // Inside the mips block, after the cells
+	uint16_t mipPaletteSize = 0, mipPaletteCapacity = 0;
+
+	// Set while data and mips point into a mapped region file instead of memory of their own, keeps the mapping alive.
+	// The mapping is read only, the first write copies both out.
+	std::shared_ptr<const void> backing;
+	bool dirty = false; // Written since it was loaded or last saved
+
+	static inline uint32_t brick_of(uint32_t i) { return (((i >> (CHUNK_SHIFT * 2 + BRICK_SHIFT)) & (BRICKS_PER_AXIS - 1)) << 4) | (((i >> (CHUNK_SHIFT + BRICK_SHIFT)) & (BRICKS_PER_AXIS - 1)) << 2) | ((i >> BRICK_SHIFT) & (BRICKS_PER_AXIS - 1)); }
+	static inline uint32_t palette_capacity(uint8_t shift) { return 1u << (1u << shift); }
+	static inline size_t palette_bytes(uint8_t shift) { return (palette_capacity(shift) + ((CHUNK_SIZE << shift) >> 5)) * sizeof(uint32_t); }
+	static inline uint8_t palette_shift(uint32_t count) { return count <= 2 ? 0 : (count <= 4 ? 1 : (count <= 16 ? 2 : 3)); }
+
+	inline uint32_t index_at(uint32_t i) const {
+		const uint32_t bit = i << indexShift;
+		return (indices[bit >> 5] >> (bit & 31)) & indexMask;
+	}
+
+	inline void set_index(uint32_t i, uint32_t index) {
+		const uint32_t bit = i << indexShift;
+		indices[bit >> 5] = (indices[bit >> 5] & ~(indexMask << (bit & 31))) | (index << (bit & 31));
+	}
+
+	int32_t find_palette(uint32_t value) const {
+		for (uint32_t i = 0; i < paletteSize; i++) { if (data[i] == value) { return static_cast<int32_t>(i); } }
+		return -1;
+	}
+
+	void clearOccupancy() {
+		brickMask = 0;
+		solidCount = 0;
+		memset(brickCounts, 0, sizeof(brickCounts));
+	}
+
+	void release() {
+		if (backing == nullptr) { chunk_allocator().release(data, data_bytes()); }
+		data = nullptr;
+		indices = nullptr;
+		paletteSize = 0;
+	}
+
+	static inline size_t mip_bytes(uint16_t capacity) { return ((MIP_CELLS + 3) & ~3u) + capacity * sizeof(uint32_t); }
+
+	void releaseMips() {
+		if (backing == nullptr && mips != nullptr) { chunk_allocator().release(mips, mip_bytes(mipPaletteCapacity)); }
+		mips = nullptr;
+		mipPalette = nullptr;
+		mipPaletteSize = 0;
+		mipPaletteCapacity = 0;
+	}
+
+	// Frees the voxels and coarse levels, or lets go of the mapping they were in
+	void releaseAll() {
+		release();
+		releaseMips();
+		backing.reset();
+	}
+
+	inline size_t data_bytes() const { return storage == CHUNK_PALETTE ? palette_bytes(indexShift) : (storage == CHUNK_FULL ? CHUNK_ARRAY_SIZE : 0); }
+
+	// Gives a chunk that reads from a mapped region file its own copy of the voxels and coarse levels, so they can be written
+	bool unshare() {
+		if (backing == nullptr) { return true; }
+		const size_t dataBytes = data_bytes(), mipBytes = mips != nullptr ? mip_bytes(mipPaletteCapacity) : 0;
+		uint32_t* block = dataBytes > 0 ? static_cast<uint32_t*>(chunk_allocator().allocate(dataBytes)) : nullptr;
+		uint8_t* mipBlock = mipBytes > 0 ? static_cast<uint8_t*>(chunk_allocator().allocate(mipBytes)) : nullptr;
+		if ((dataBytes > 0 && block == nullptr) || (mipBytes > 0 && mipBlock == nullptr)) {
+			if (block != nullptr) { chunk_allocator().release(block, dataBytes); }
+			if (mipBlock != nullptr) { chunk_allocator().release(mipBlock, mipBytes); }
+			return false;
+		}
+		if (dataBytes > 0) { memcpy(block, data, dataBytes); }
+		if (mipBytes > 0) { memcpy(mipBlock, mips, mipBytes); }
+		if (indices != nullptr) { indices = block + (indices - data); }
+		data = block;
+		mips = mipBlock;
+		mipPalette = mipBlock != nullptr ? reinterpret_cast<uint32_t*>(mipBlock + mip_bytes(0)) : nullptr;
+		backing.reset();
+		return true;
+	}
+
+	inline uint32_t mip_at(uint32_t cell) const { return mipPalette[mips[cell]]; }
+
+	// Palette index of a value, added if it is new. Returns -1 if the palette could not grow.
+	int32_t mipIndexOf(uint32_t value) {
+		for (uint16_t i = 0; i < mipPaletteSize; i++) { if (mipPalette[i] == value) { return i; } }
+		if (mipPaletteSize == mipPaletteCapacity) {
+			if (mipPaletteCapacity == 256) { return -1; }
+			const uint16_t capacity = static_cast<uint16_t>(mipPaletteCapacity * 2);
+			uint8_t* block = static_cast<uint8_t*>(chunk_allocator().allocate(mip_bytes(capacity)));
+			if (block == nullptr) { return -1; }
+			memcpy(block, mips, mip_bytes(mipPaletteCapacity));
+			chunk_allocator().release(mips, mip_bytes(mipPaletteCapacity));
+			mips = block;
+			mipPalette = reinterpret_cast<uint32_t*>(block + mip_bytes(0));
+			mipPaletteCapacity = capacity;
+		}
+		mipPalette[mipPaletteSize] = value;
+		return mipPaletteSize++;
+	}
+
+	// Value of a coarse cell from its 8 children
+	static uint32_t representative(const uint32_t* children) {
+		uint32_t best = 0, bestCount = 0, solid = 0;
+		for (int i = 0; i < 8; i++) {
+			if (children[i] == 0) { continue; }
+			solid++;
+			uint32_t count = 0;
+			for (int j = 0; j < 8; j++) { count += children[j] == children[i]; }
+			if (count > bestCount) { best = children[i]; bestCount = count; }
+		}
+		return solid >= 4 ? best : 0;
+	}
+
+	// Recomputes one cell of a level >= 1 from the level below, returns false if its value did not fit the palette
+	bool updateMipCell(int32_t level, int32_t lx, int32_t ly, int32_t lz) {
+		const int32_t child = level - 1, x0 = lx & ~((1 << level) - 1), y0 = ly & ~((1 << level) - 1), z0 = lz & ~((1 << level) - 1);
+		uint32_t children[8];
+		for (int i = 0; i < 8; i++) {
+			const int32_t x = x0 + ((i & 1) << child), y = y0 + (((i >> 1) & 1) << child), z = z0 + (((i >> 2) & 1) << child);
+			children[i] = child == 0 ? (*this)[voxel_index(x, y, z)] : mip_at(mip_index(child, x, y, z));
+		}
+		const int32_t index = mipIndexOf(representative(children));
+		if (index < 0) { return false; }
+		mips[mip_index(level, lx, ly, lz)] = static_cast<uint8_t>(index);
+		return true;
+	}
+
+	// Recomputes the cells above the marked level 1 cells, one level after the other so every cell is only done once.
+	// Cells holds a bit per level 1 cell in mip_index order and is used up.
+	void updateMips(uint64_t* cells) {
+		for (int32_t level = 1; level <= CHUNK_LEVELS; level++) {
+			const int32_t w = CHUNK_SHIFT - level; // log2 of the cells per axis on this level
+			const uint32_t count = 1u << (w * 3);
+			uint64_t parents[MIP_MARK_WORDS]{};
+			for (uint32_t c = 0; c < count; c++) {
+				if (cells[c >> 6] == 0) {
+					c |= 63;
+					continue;
+				}
+				if (!((cells[c >> 6] >> (c & 63)) & 1)) { continue; }
+				const int32_t x = static_cast<int32_t>(c & ((1u << w) - 1)), y = static_cast<int32_t>((c >> w) & ((1u << w) - 1)), z = static_cast<int32_t>(c >> (w * 2));
+				if (!updateMipCell(level, x << level, y << level, z << level)) {
+					buildMips();
+					return;
+				}
+				if (w > 0) {
+					const uint32_t parent = (static_cast<uint32_t>(z >> 1) << ((w - 1) * 2)) | (static_cast<uint32_t>(y >> 1) << (w - 1)) | static_cast<uint32_t>(x >> 1);
+					parents[parent >> 6] |= 1ULL << (parent & 63);
+				}
+			}
+			memcpy(cells, parents, sizeof(parents));
+		}
+	}
+
+	// Builds every coarse level from the voxels, chunks whose levels need more than 256 values are left without them
+	void buildMips() {
+		releaseMips();
+		if (storage != CHUNK_PALETTE && storage != CHUNK_FULL) { return; }
+		mips = static_cast<uint8_t*>(chunk_allocator().allocate(mip_bytes(4)));
+		if (mips == nullptr) { return; }
+		mipPalette = reinterpret_cast<uint32_t*>(mips + mip_bytes(0));
+		mipPaletteCapacity = 4;
+		for (int32_t level = 1; level <= CHUNK_LEVELS; level++) {
+			const int32_t cell = 1 << level;
+			for (int32_t z = 0; z < CHUNK_WIDTH; z += cell) {
+				for (int32_t y = 0; y < CHUNK_WIDTH; y += cell) {
+					for (int32_t x = 0; x < CHUNK_WIDTH; x += cell) {
+						if (!updateMipCell(level, x, y, z)) {
+							releaseMips();
+							return;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Switches to a palette with 2^(2^shift) entries, keeping every voxel
+	bool make_palette(uint8_t shift) {
+		uint32_t* block = static_cast<uint32_t*>(chunk_allocator().allocate(palette_bytes(shift), true));
+		if (block == nullptr) { return false; }
+		uint32_t* packed = block + palette_capacity(shift);
+		const uint32_t mask = (1u << (1u << shift)) - 1;
+
+		if (storage == CHUNK_PALETTE) {
+			memcpy(block, data, paletteSize * sizeof(uint32_t));
+			for (uint32_t i = 0; i < CHUNK_SIZE; i++) {
+				const uint32_t bit = i << shift;
+				packed[bit >> 5] |= index_at(i) << (bit & 31);
+			}
+		} else {
+			block[0] = uniform;
+			paletteSize = 1;
+		}
+		chunk_allocator().release(data, data_bytes()); // Not release(), that forgets the palette size
+		data = block;
+		indices = packed;
+		indexShift = shift;
+		indexMask = mask;
+		storage = CHUNK_PALETTE;
+		return true;
+	}
+
+	bool make_full() {
+		uint32_t* block = static_cast<uint32_t*>(chunk_allocator().allocate(CHUNK_ARRAY_SIZE));
+		if (block == nullptr) { return false; }
+		for (uint32_t i = 0; i < CHUNK_SIZE; i++) { block[i] = (*this)[i]; }
+		release();
+		data = block;
+		storage = CHUNK_FULL;
+		return true;
+	}
+
+	// Keeps the solid counts and the brick mask correct for a voxel that changed from old to value
+	void updateOccupancy(uint32_t i, uint32_t old, uint32_t value) {
+		const bool wasSolid = old != 0, isSolid = value != 0;
+		if (wasSolid == isSolid) { return; }
+		const uint32_t brick = brick_of(i);
+		if (isSolid) {
+			solidCount++;
+			if (brickCounts[brick]++ == 0) { brickMask |= 1ULL << brick; }
+		} else {
+			solidCount--;
+			if (--brickCounts[brick] == 0) { brickMask &= ~(1ULL << brick); }
+		}
+	}
+
+	// Writes a value without touching the occupancy, grows the palette or falls back to the full array when needed
+	bool store(uint32_t i, uint32_t value) {
+		if (storage == CHUNK_UNIFORM && !make_palette(0)) { return false; }
+		if (storage == CHUNK_PALETTE) {
+			int32_t index = find_palette(value);
+			if (index < 0) {
+				if (paletteSize == palette_capacity(indexShift)) {
+					if (indexShift == 3) {
+						if (!make_full()) { return false; }
+						data[i] = value;
+						return true;
+					}
+					if (!make_palette(indexShift + 1)) { return false; }
+				}
+				index = paletteSize++;
+				data[index] = value;
+			}
+			set_index(i, static_cast<uint32_t>(index));
+			return true;
+		}
+		data[i] = value;
+		return true;
+	}
 
 public:
 	ChunkLocation loc; // Chunk position
 
 	Chunk() { loc = { 0,0,0 }; }
 	Chunk(int x, int y, int z) : loc(x,y,z) {} // Constructor sets location but does not allocate
-	~Chunk() { if (is_used()) { delete[] voxels; voxels = nullptr; } }
+	~Chunk() { releaseAll(); }
+
+	// Chunks own their voxel storage, so they can only be moved, e.g. from a streaming worker into a world slot
+	Chunk(const Chunk&) = delete;
+	Chunk& operator=(const Chunk&) = delete;
+	Chunk(Chunk&& other) noexcept { *this = std::move(other); }
+	Chunk& operator=(Chunk&& other) noexcept {
+		if (this == &other) { return *this; }
+		unload();
+		loc = other.loc;
+		data = other.data;
+		indices = other.indices;
+		uniform = other.uniform;
+		indexMask = other.indexMask;
+		paletteSize = other.paletteSize;
+		indexShift = other.indexShift;
+		storage = other.storage;
+		brickMask = other.brickMask;
+		solidCount = other.solidCount;
+		memcpy(brickCounts, other.brickCounts, sizeof(brickCounts));
+		lastAccess.store(other.lastAccess.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		mips = other.mips;
+		mipPalette = other.mipPalette;
+		mipPaletteSize = other.mipPaletteSize;
+		mipPaletteCapacity = other.mipPaletteCapacity;
+		backing = std::move(other.backing);
+		dirty = other.dirty;
+		other.data = nullptr;
+		other.indices = nullptr;
+		other.mips = nullptr;
+		other.mipPalette = nullptr;
+		other.mipPaletteSize = 0;
+		other.mipPaletteCapacity = 0;
+		other.dirty = false;
+		other.storage = CHUNK_UNLOADED;
+		other.clearOccupancy();
+		return *this;
+	}
 
 	inline const bool is(int X, int Y, int Z) const { return loc.x == X && loc.y == Y && loc.z == Z; }
-	inline const bool is_used() const { return voxels == nullptr; }
-	void unload() { if (is_used()) { delete[] voxels; voxels = nullptr; } }
+	inline const bool is_used() const { return storage != CHUNK_UNLOADED; }
+	inline const bool is_empty() const { return solidCount == 0; }
+	inline const bool is_brick_empty(int32_t lx, int32_t ly, int32_t lz) const { return !((brickMask >> (((lz >> BRICK_SHIFT) << 4) | ((ly >> BRICK_SHIFT) << 2) | (lx >> BRICK_SHIFT))) & 1); }
+	inline ChunkStorage get_storage() const { return storage; }
+	inline bool is_dirty() const { return dirty; }
+	inline void mark_saved() { dirty = false; }
+	inline bool is_mapped() const { return backing != nullptr; }
+
+	// Coarsest level that can be looked up, 0 if the chunk has no coarse levels
+	inline int32_t max_level() const { return storage == CHUNK_UNIFORM || mips != nullptr ? CHUNK_LEVELS : 0; }
+	// Finest level that can be looked up, coarse chunks no longer have their voxels
+	inline int32_t min_level() const { return storage == CHUNK_COARSE ? 1 : 0; }
+
+	// Value of the cell of the given level that holds a voxel, the level has to be between min_level and max_level
+	inline uint32_t mip(int32_t level, long x, long y, long z) const {
+		if (storage == CHUNK_UNIFORM) { return uniform; }
+		if (level == 0) { return (*this)[voxel_index(x, y, z)]; }
+		return mip_at(mip_index(level, x, y, z));
+	}
+
+	// Bytes this chunk counts against the world's memory budget
+	inline size_t memory_usage() const {
+		const size_t mipBytes = mips != nullptr ? mip_bytes(mipPaletteCapacity) : 0;
+		switch (storage) {
+		case CHUNK_UNIFORM: return sizeof(Chunk);
+		case CHUNK_PALETTE: return sizeof(Chunk) + palette_bytes(indexShift) + mipBytes;
+		case CHUNK_FULL: return sizeof(Chunk) + CHUNK_ARRAY_SIZE + mipBytes;
+		case CHUNK_COARSE: return sizeof(Chunk) + mipBytes;
+		default: return 0;
+		}
+	}
+
+	// Called from the render threads, only writes when the frame changed so the cache line is not bounced around
+	inline void touch(uint32_t frame) const { if (lastAccess.load(std::memory_order_relaxed) != frame) { lastAccess.store(frame, std::memory_order_relaxed); } }
+	inline uint32_t last_access() const { return lastAccess.load(std::memory_order_relaxed); }
+
+	void unload() {
+		releaseAll();
+		dirty = false;
+		storage = CHUNK_UNLOADED;
+		clearOccupancy();
+	}
+
 	bool allocate(ChunkLocation Loc) {
 		// set chunk location while arguments are still hot in memory
 		loc = Loc;
 
-		// Attempt allocation of voxel storage
-		voxels = (uint32_t*) malloc(CHUNK_ARRAY_SIZE);
-		if (voxels == nullptr) { return false; }
-		memset(voxels, 0, CHUNK_ARRAY_SIZE);
+		// Starts out as uniform air, storage is only allocated once voxels differ. TerrainGenerator fills generated chunks instead.
+		fill(0);
+
+		return true;
+	}
+
+	// Sets every voxel to the same value and frees the voxel storage
+	void fill(uint32_t value) {
+		releaseAll();
+		storage = CHUNK_UNIFORM;
+		uniform = value;
+		if (value == 0) {
+			clearOccupancy();
+		} else {
+			brickMask = ~0ULL;
+			solidCount = CHUNK_SIZE;
+			memset(brickCounts, BRICK_WIDTH * BRICK_WIDTH * BRICK_WIDTH, sizeof(brickCounts));
+		}
+	}
+
+	// Replaces every voxel with the CHUNK_SIZE given values, using the smallest storage that can hold them
+	bool load(const uint32_t* values) {
+		uint32_t palette[256];
+		uint32_t count = 0;
+		bool full = false;
+		for (uint32_t i = 0; i < CHUNK_SIZE && !full; i++) {
+			if (count > 0 && values[i] == palette[count - 1]) { continue; } // Runs of the same value are the common case
+			bool found = false;
+			for (uint32_t j = 0; j < count; j++) { if (palette[j] == values[i]) { found = true; break; } }
+			if (found) { continue; }
+			if (count == 256) { full = true; }
+			else { palette[count++] = values[i]; }
+		}
+
+		if (!full && count == 1) {
+			fill(values[0]);
+			return true;
+		}
+
+		uint32_t* block = nullptr;
+		if (full) {
+			block = static_cast<uint32_t*>(chunk_allocator().allocate(CHUNK_ARRAY_SIZE));
+			if (block == nullptr) { return false; }
+			memcpy(block, values, CHUNK_ARRAY_SIZE);
+			releaseAll();
+			data = block;
+			storage = CHUNK_FULL;
+		} else {
+			const uint8_t shift = palette_shift(count);
+			block = static_cast<uint32_t*>(chunk_allocator().allocate(palette_bytes(shift), true));
+			if (block == nullptr) { return false; }
+			releaseAll();
+			data = block;
+			indices = block + palette_capacity(shift);
+			memcpy(data, palette, count * sizeof(uint32_t));
+			paletteSize = static_cast<uint16_t>(count);
+			indexShift = shift;
+			indexMask = (1u << (1u << shift)) - 1;
+			storage = CHUNK_PALETTE;
+			uint32_t last = 0;
+			for (uint32_t i = 0; i < CHUNK_SIZE; i++) {
+				if (data[last] != values[i]) { last = static_cast<uint32_t>(find_palette(values[i])); }
+				if (last != 0) { set_index(i, last); }
+			}
+		}
+
+		clearOccupancy();
+		for (uint32_t i = 0; i < CHUNK_SIZE; i++) {
+			if (values[i] == 0) { continue; }
+			solidCount++;
+			brickCounts[brick_of(i)]++;
+		}
+		for (uint32_t b = 0; b < BRICKS; b++) { if (brickCounts[b] > 0) { brickMask |= 1ULL << b; } }
+		buildMips();
+		return true;
+	}
+
+	// Drops the voxels and keeps only the coarse levels, returns false if the chunk has no voxels or no coarse levels to keep
+	bool make_coarse() {
+		if ((storage != CHUNK_PALETTE && storage != CHUNK_FULL) || mips == nullptr) { return false; }
+		release();
+		storage = CHUNK_COARSE;
+		return true;
+	}
 
-		// TODO: generate chunk voxels
+	// Moves the chunk to the smallest storage for its current voxels, writes only ever grow the storage
+	bool compact() {
+		if (storage != CHUNK_PALETTE && storage != CHUNK_FULL) { return true; }
+		uint32_t values[CHUNK_SIZE];
+		for (uint32_t i = 0; i < CHUNK_SIZE; i++) { values[i] = (*this)[i]; }
+		return load(values);
+	}
+
+	// Bytes write_record needs, 0 for chunks that cannot be saved because they are not loaded or only have their coarse levels
+	inline size_t record_size() const {
+		if (storage != CHUNK_UNIFORM && storage != CHUNK_PALETTE && storage != CHUNK_FULL) { return 0; }
+		return sizeof(ChunkRecord) + data_bytes() + (mips != nullptr ? mip_bytes(mipPaletteCapacity) : 0);
+	}
 
+	// Writes record_size bytes
+	void write_record(uint8_t* out) const {
+		ChunkRecord record;
+		memset(&record, 0, sizeof(record));
+		record.uniform = uniform;
+		record.solidCount = solidCount;
+		record.storage = storage;
+		record.indexShift = indexShift;
+		record.paletteSize = paletteSize;
+		record.mipPaletteSize = mipPaletteSize;
+		record.mipPaletteCapacity = mips != nullptr ? mipPaletteCapacity : 0;
+		record.brickMask = brickMask;
+		memcpy(record.brickCounts, brickCounts, sizeof(brickCounts));
+		memcpy(out, &record, sizeof(record));
+		out += sizeof(record);
+		if (data != nullptr) { memcpy(out, data, data_bytes()); }
+		if (mips != nullptr) { memcpy(out + data_bytes(), mips, mip_bytes(mipPaletteCapacity)); }
+	}
+
+	// Points the chunk at a record in memory that owner keeps alive, without copying anything. The record has to be 4 byte aligned.
+	// Returns false and leaves the chunk untouched if the record is damaged.
+	bool map_record(const uint8_t* bytes, size_t length, ChunkLocation Loc, std::shared_ptr<const void> owner) {
+		ChunkRecord record;
+		if (length < sizeof(record) || (reinterpret_cast<uintptr_t>(bytes) & 3) != 0) { return false; }
+		memcpy(&record, bytes, sizeof(record));
+		const ChunkStorage kind = static_cast<ChunkStorage>(record.storage);
+		if ((kind != CHUNK_UNIFORM && kind != CHUNK_PALETTE && kind != CHUNK_FULL) || record.indexShift > 3 || record.solidCount > CHUNK_SIZE) { return false; }
+		if (kind == CHUNK_PALETTE && (record.paletteSize == 0 || record.paletteSize > palette_capacity(record.indexShift))) { return false; }
+		const uint16_t capacity = record.mipPaletteCapacity;
+		if (capacity != 0 && (kind == CHUNK_UNIFORM || capacity < 4 || capacity > 256 || (capacity & (capacity - 1)) != 0 || record.mipPaletteSize == 0 || record.mipPaletteSize > capacity)) { return false; }
+		const size_t dataBytes = kind == CHUNK_PALETTE ? palette_bytes(record.indexShift) : (kind == CHUNK_FULL ? CHUNK_ARRAY_SIZE : 0);
+		if (length != sizeof(record) + dataBytes + (capacity != 0 ? mip_bytes(capacity) : 0)) { return false; }
+		const uint8_t* cells = bytes + sizeof(record) + dataBytes;
+		if (capacity != 0) { for (uint32_t i = 0; i < MIP_CELLS; i++) { if (cells[i] >= record.mipPaletteSize) { return false; } } } // Would read past the palette
+
+		releaseAll();
+		loc = Loc;
+		storage = kind;
+		uniform = record.uniform;
+		solidCount = record.solidCount;
+		brickMask = record.brickMask;
+		memcpy(brickCounts, record.brickCounts, sizeof(brickCounts));
+		indexShift = record.indexShift;
+		indexMask = (1u << (1u << indexShift)) - 1;
+		paletteSize = kind == CHUNK_PALETTE ? record.paletteSize : 0;
+		data = dataBytes > 0 ? const_cast<uint32_t*>(reinterpret_cast<const uint32_t*>(bytes + sizeof(record))) : nullptr;
+		indices = kind == CHUNK_PALETTE ? data + palette_capacity(indexShift) : nullptr;
+		if (capacity != 0) {
+			mips = const_cast<uint8_t*>(cells);
+			mipPalette = reinterpret_cast<uint32_t*>(mips + mip_bytes(0));
+			mipPaletteSize = record.mipPaletteSize;
+			mipPaletteCapacity = capacity;
+		}
+		if (data != nullptr || mips != nullptr) { backing = std::move(owner); }
+		dirty = false;
 		return true;
 	}
 
-	const uint32_t operator[](uint32_t i) const { 
-		if (is_used() && i < CHUNK_SIZE) { return voxels[i]; }
+	inline const uint32_t operator[](uint32_t i) const {
+		if (i < CHUNK_SIZE) {
+			if (storage == CHUNK_PALETTE) { return data[index_at(i)]; }
+			if (storage == CHUNK_FULL) { return data[i]; }
+			if (storage == CHUNK_UNIFORM) { return uniform; }
+			if (storage == CHUNK_COARSE) { return mip_at(mip_index(1, i & CHUNK_MASK, (i >> CHUNK_SHIFT) & CHUNK_MASK, i >> (CHUNK_SHIFT * 2))); }
+		}
 		// Warn user that they tried to read data from a non-allocated chunk instead of panicking
 		printf_s("WARNING: Tried reading data from a non-allocated chunk!\n");
 		return 0;
 	};
 
-	uint32_t& operator[](uint32_t i) {
-		if (is_used() && i < CHUNK_SIZE) { return voxels[i]; }
-		// Warn user that they tried to read data from a non-allocated chunk instead of panicking
-		printf_s("WARNING: Tried reading a reference to data from a non-allocated chunk!\n");
-		return _BACKUP_;
-	};
+	// Writes go through here so the occupancy masks stay correct, fails if the storage could not grow
+	bool set(uint32_t i, uint32_t value) {
+		if (!is_used() || i >= CHUNK_SIZE) {
+			printf_s("WARNING: Tried writing data to a non-allocated chunk!\n");
+			return false;
+		}
+		if (storage == CHUNK_COARSE) {
+			printf_s("WARNING: Tried writing data to a chunk that only has its coarse levels!\n");
+			return false;
+		}
+		const uint32_t old = (*this)[i];
+		if (old == value) { return true; }
+		const bool wasUniform = storage == CHUNK_UNIFORM;
+		if (!unshare() || !store(i, value)) { return false; }
+		dirty = true;
+
+		// The cells above the voxel. A chunk that just stopped being uniform gets all of its levels, and so does one whose
+		// palette of cell values filled up with values that are no longer used.
+		if (wasUniform) { buildMips(); }
+		else if (mips != nullptr) {
+			const int32_t lx = static_cast<int32_t>(i & CHUNK_MASK), ly = static_cast<int32_t>((i >> CHUNK_SHIFT) & CHUNK_MASK), lz = static_cast<int32_t>(i >> (CHUNK_SHIFT * 2));
+			for (int32_t level = 1; level <= CHUNK_LEVELS; level++) {
+				if (!updateMipCell(level, lx, ly, lz)) {
+					buildMips();
+					break;
+				}
+			}
+		}
+		updateOccupancy(i, old, value);
+		return true;
+	}
+
+	// Writes the voxels in order and brings the coarse levels up to date once for all of them, only the cells above written voxels
+	// are recomputed. Batches that rewrite a large part of the chunk compact it afterwards, since writes alone never shrink the storage.
+	// Fails like set, the writes before the one that failed are kept.
+	bool set_batch(const VoxelWrite* writes, size_t count) {
+		if (!is_used() || storage == CHUNK_COARSE) {
+			printf_s("WARNING: Tried writing data to a chunk without voxels!\n");
+			return false;
+		}
+		const bool wasUniform = storage == CHUNK_UNIFORM;
+		uint64_t cells[MIP_MARK_WORDS]{}; // Level 1 cells above the written voxels
+		uint32_t changed = 0;
+		bool stored = true;
+		for (size_t n = 0; n < count; n++) {
+			const uint32_t i = writes[n].index, value = writes[n].value;
+			if (i >= CHUNK_SIZE) { continue; }
+			const uint32_t old = (*this)[i];
+			if (old == value) { continue; }
+			if (!unshare() || !store(i, value)) {
+				stored = false;
+				break;
+			}
+			updateOccupancy(i, old, value);
+			const uint32_t cell = mip_index(1, i & CHUNK_MASK, (i >> CHUNK_SHIFT) & CHUNK_MASK, i >> (CHUNK_SHIFT * 2));
+			cells[cell >> 6] |= 1ULL << (cell & 63);
+			changed++;
+		}
+		if (changed == 0) { return stored; }
+		dirty = true;
+		if (changed >= CHUNK_SIZE / 8 && compact()) { return stored; } // Rebuilt the coarse levels as well
+		if (wasUniform) { buildMips(); }
+		else if (mips != nullptr) { updateMips(cells); }
+		return stored;
+	}
+};
+
+// Open addressing hash map from packed chunk location to a slot in World::chunks, grows so it is never more than half full
+struct ChunkIndex {
+private:
+	std::vector<uint64_t> keys;
+	std::vector<int32_t> slots;
+	uint32_t mask = 0;
+	uint32_t count = 0;
+
+	inline uint32_t hash(uint64_t key) const { return chunk_hash(key, mask + 1); }
+
+	void place(uint64_t key, int32_t slot) {
+		uint32_t i = hash(key);
+		while (keys[i] != CHUNK_KEY_EMPTY && keys[i] != key) { i = (i + 1) & mask; }
+		if (keys[i] == CHUNK_KEY_EMPTY) { count++; }
+		keys[i] = key;
+		slots[i] = slot;
+	}
+
+	void grow(uint32_t size) {
+		std::vector<uint64_t> oldKeys;
+		std::vector<int32_t> oldSlots;
+		oldKeys.swap(keys);
+		oldSlots.swap(slots);
+		keys.assign(size, CHUNK_KEY_EMPTY);
+		slots.assign(size, -1);
+		mask = size - 1;
+		count = 0;
+		for (size_t i = 0; i < oldKeys.size(); i++) { if (oldKeys[i] != CHUNK_KEY_EMPTY) { place(oldKeys[i], oldSlots[i]); } }
+	}
+
+public:
+	ChunkIndex() { grow(1024); }
+
+	void clear() {
+		keys.assign(keys.size(), CHUNK_KEY_EMPTY);
+		slots.assign(slots.size(), -1);
+		count = 0;
+	}
+
+	inline uint32_t size() const { return count; }
+
+	// Read only, safe to call from multiple threads as long as nothing is inserted or removed at the same time
+	inline int32_t find(uint64_t key) const {
+		uint32_t i = hash(key);
+		while (keys[i] != CHUNK_KEY_EMPTY) {
+			if (keys[i] == key) { return slots[i]; }
+			i = (i + 1) & mask;
+		}
+		return -1;
+	}
+
+	void insert(uint64_t key, int32_t slot) {
+		if ((count + 1) * 2 > mask + 1) { grow((mask + 1) * 2); }
+		place(key, slot);
+	}
+
+	void remove(uint64_t key) {
+		uint32_t i = hash(key);
+		while (keys[i] != key) {
+			if (keys[i] == CHUNK_KEY_EMPTY) { return; }
+			i = (i + 1) & mask;
+		}
+		count--;
+
+		// Shift following entries back so no probe chain gets broken by the hole
+		uint32_t j = i;
+		while (true) {
+			j = (j + 1) & mask;
+			if (keys[j] == CHUNK_KEY_EMPTY) { break; }
+			uint32_t home = hash(keys[j]);
+			if (((j - home) & mask) >= ((j - i) & mask)) {
+				keys[i] = keys[j];
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+		keys[i] = CHUNK_KEY_EMPTY;
+		slots[i] = -1;
+	}
+};
+
+// Sun visibility of the voxels of one chunk, filled in by the render threads as they shade.
+// A voxel's shadowed bit is only valid once its known bit is set.
+struct SunShadowBlock {
+	std::atomic<uint64_t> known[CHUNK_SIZE / 64], shadowed[CHUNK_SIZE / 64];
+
+	SunShadowBlock() {
+		for (uint32_t i = 0; i < CHUNK_SIZE / 64; i++) {
+			known[i].store(0, std::memory_order_relaxed);
+			shadowed[i].store(0, std::memory_order_relaxed);
+		}
+	}
+};
+
+// Counters for how well the resident chunks fit the memory budget
+struct ResidencyStats {
+	uint64_t residentChunks = 0, residentBytes = 0, budgetBytes = 0;
+	uint64_t sunShadowBytes = 0; // Cached sun shadows, they count against the budget as well
+	uint64_t uniformChunks = 0, paletteChunks = 0, fullChunks = 0, coarseChunks = 0; // Resident chunks per storage kind
+	uint64_t loaded = 0; // Chunks published into the world
+	uint64_t evicted = 0; // Chunks unloaded to stay within the budget
+	uint64_t rejected = 0; // Chunks that could not be published because everything resident was still in use
+	uint64_t misses = 0; // Distinct chunk requests from the render threads
+	uint64_t dropped = 0; // Requests lost because the request set was full
+};
+
+enum VoxelEditShape {
+	EDIT_BOX, // Every voxel between the corners
+	EDIT_SPHERE, // Every voxel whose centre is inside the sphere
+};
+
+// A change to the world that waits in World's queue until the next frame boundary
+struct VoxelEdit {
+	VoxelEditShape shape = EDIT_BOX;
+	int32_t low[3]{}, high[3]{}; // Voxels the edit can touch, both corners included
+	float center[3]{}, radius = 0.0f; // Spheres only
+	uint32_t value = 0;
+
+	static VoxelEdit box(long x0, long y0, long z0, long x1, long y1, long z1, uint32_t value) {
+		VoxelEdit e;
+		const long a[3]{ x0, y0, z0 }, b[3]{ x1, y1, z1 };
+		for (int i = 0; i < 3; i++) {
+			e.low[i] = static_cast<int32_t>(std::min(a[i], b[i]));
+			e.high[i] = static_cast<int32_t>(std::max(a[i], b[i]));
+		}
+		e.value = value;
+		return e;
+	}
+
+	static inline VoxelEdit voxel(long x, long y, long z, uint32_t value) { return box(x, y, z, x, y, z, value); }
+
+	static VoxelEdit sphere(const vec3& c, float r, uint32_t value) {
+		VoxelEdit e;
+		e.shape = EDIT_SPHERE;
+		for (int i = 0; i < 3; i++) {
+			e.center[i] = c[i];
+			e.low[i] = static_cast<int32_t>(std::floor(c[i] - r));
+			e.high[i] = static_cast<int32_t>(std::floor(c[i] + r));
+		}
+		e.radius = r;
+		e.value = value;
+		return e;
+	}
+};
+
+// What the last World::apply_edits did
+struct EditStats {
+	uint64_t edits = 0; // Taken from the queue
+	uint64_t chunks = 0; // Chunks with voxels that changed
+	uint64_t voxels = 0; // Voxels that changed
+	uint64_t held = 0; // Edits waiting for their chunk to be loaded at full resolution, once per chunk they touch
+	uint64_t failed = 0; // Chunks whose storage could not grow, the rest of their edits was dropped
 };
 
 struct World {
 private:
-	Chunk chunks[CHUNKS] { Chunk(0, 0, 0) };
-	std::vector<ChunkLocation> toAllocate = {};
+	std::vector<Chunk> chunks; // Only grows between frames, slots of evicted chunks are reused
+	std::vector<int32_t> freeSlots;
+	ChunkIndex index;
+	std::vector<uint64_t> chunkMask; // Bit per chunk slot that holds at least one solid voxel
+	uint64_t version = 0; // Changes whenever voxels change, lets the renderer know old samples are stale
+	mutable std::atomic<uint64_t> requests[CHUNK_REQUEST_SIZE]; // Lock free set of chunk keys the render threads missed since the last take_requests
+
+	// Residency
+	size_t memoryBudget = DEFAULT_MEMORY_BUDGET;
+	size_t residentBytes = 0;
+	uint32_t frame = 1; // Chunks start out last accessed in frame 0
+	vec3 viewer{ 0, 0, 0 };
+	std::vector<int32_t> victims; // Eviction candidates, least useful last
+	uint32_t victimsFrame = 0, victimsMinAge = 0;
+	ResidencyStats stats;
+	mutable std::atomic<uint64_t> misses{ 0 }, dropped{ 0 };
 
-	int findFirstEmpty() {
-		for (int i = 0; i < CHUNKS; i++) { if (!chunks[i].is_used()) { return i; } }
+	// Sun shadows, cached per voxel so shading does not need a shadow ray for every hit
+	mutable std::deque<std::atomic<SunShadowBlock*>> sunShadow; // Per chunk slot, created by the first shadow stored in the chunk
+	mutable std::atomic<uint32_t> sunShadowBlocks{ 0 };
+	vec3 sunShadowDirection; // Sun direction the cached shadows were traced with
+
+	// Edits, queued from any thread and applied between frames one batch per chunk
+	std::mutex editLock; // Only guards queuedEdits
+	std::vector<VoxelEdit> queuedEdits, takenEdits;
+	std::unordered_map<uint64_t, std::vector<VoxelEdit>> heldEdits, editBatches; // By chunk key, held ones wait for their chunk
+	std::vector<VoxelWrite> editWrites;
+	EditStats editStats;
+
+	inline size_t usedBytes() const { return residentBytes + static_cast<size_t>(sunShadowBlocks.load(std::memory_order_relaxed)) * sizeof(SunShadowBlock); }
+
+	inline void update_chunk_mask(int32_t slot) {
+		if (chunks[slot].is_empty()) { chunkMask[slot >> 6] &= ~(1ULL << (slot & 63)); }
+		else { chunkMask[slot >> 6] |= 1ULL << (slot & 63); }
+	}
+
+	int32_t takeFreeSlot() {
+		if (!freeSlots.empty()) {
+			int32_t slot = freeSlots.back();
+			freeSlots.pop_back();
+			return slot;
+		}
+		chunks.emplace_back();
+		chunkMask.resize((chunks.size() + 63) / 64, 0);
+		sunShadow.emplace_back(nullptr);
+		return static_cast<int32_t>(chunks.size() - 1);
+	}
+
+	// Edited chunks that were not saved yet stay resident while holdEdits is set, evicting them would lose the edits
+	inline bool evictable(int32_t slot, uint32_t minAge) const { return chunks[slot].is_used() && frame - chunks[slot].last_access() >= minAge && !(holdEdits && chunks[slot].is_dirty()); }
+
+	// Higher is less useful: frames since a ray last touched the chunk plus its distance to the camera in chunks
+	float evictionScore(int32_t slot) const {
+		const Chunk& c = chunks[slot];
+		const float half = CHUNK_WIDTH * 0.5f;
+		const vec3 center(c.loc.x * CHUNK_WIDTH + half, c.loc.y * CHUNK_WIDTH + half, c.loc.z * CHUNK_WIDTH + half);
+		return static_cast<float>(frame - c.last_access()) + (center - viewer).length() / CHUNK_WIDTH;
+	}
+
+	// Least useful resident chunk that has not been used for minAge frames, -1 if there is none.
+	// The candidates are sorted once per frame and then handed out one by one.
+	int32_t nextVictim(uint32_t minAge) {
+		if (victimsFrame != frame || victimsMinAge != minAge) {
+			victimsFrame = frame;
+			victimsMinAge = minAge;
+			victims.clear();
+			for (int32_t i = 0; i < static_cast<int32_t>(chunks.size()); i++) {
+				if (evictable(i, minAge)) { victims.push_back(i); }
+			}
+			std::vector<float> scores(chunks.size(), 0.0f);
+			for (int32_t i : victims) { scores[i] = evictionScore(i); }
+			std::sort(victims.begin(), victims.end(), [&scores](int32_t a, int32_t b) { return scores[a] < scores[b]; });
+		}
+		while (!victims.empty()) {
+			int32_t slot = victims.back();
+			victims.pop_back();
+			if (evictable(slot, minAge)) { return slot; }
+		}
 		return -1;
 	}
 
+	void dropSunShadow(int32_t slot) {
+		SunShadowBlock* block = sunShadow[slot].exchange(nullptr, std::memory_order_relaxed);
+		if (block == nullptr) { return; }
+		delete block;
+		sunShadowBlocks.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// Drops the cached shadows of every chunk with voxels whose sun ray could pass through the given chunk, they are traced again when needed
+	void invalidateSunShadow(const ChunkLocation& loc) {
+		if (sunShadowBlocks.load(std::memory_order_relaxed) == 0) { return; }
+		const float half = CHUNK_WIDTH * 0.5f;
+		const float radius = half * 1.7320508f * 2.0f; // Both chunks' half diagonals
+		const float reach = MAX_CHUNK_DISTANCE + CHUNK_WIDTH; // Shadow rays can step a little past their distance
+		const vec3& sun = sunShadowDirection;
+		const vec3 center(loc.x * CHUNK_WIDTH + half, loc.y * CHUNK_WIDTH + half, loc.z * CHUNK_WIDTH + half);
+		int low[3], high[3];
+		for (int i = 0; i < 3; i++) {
+			const float end = center[i] - sun[i] * reach;
+			low[i] = static_cast<int>(std::floor((std::min(center[i], end) - radius) / CHUNK_WIDTH));
+			high[i] = static_cast<int>(std::floor((std::max(center[i], end) + radius) / CHUNK_WIDTH));
+		}
+		for (int z = low[2]; z <= high[2]; z++) {
+			for (int y = low[1]; y <= high[1]; y++) {
+				for (int x = low[0]; x <= high[0]; x++) {
+					// Only chunks close to the line from this chunk away from the sun
+					const vec3 offset(static_cast<float>((x - loc.x) * CHUNK_WIDTH), static_cast<float>((y - loc.y) * CHUNK_WIDTH), static_cast<float>((z - loc.z) * CHUNK_WIDTH));
+					const float t = -dot(offset, sun);
+					if (t < -radius || t > reach + radius || (offset + sun * t).length() > radius) { continue; }
+					const int32_t slot = index.find(ChunkLocation(x, y, z).key());
+					if (slot > -1) { dropSunShadow(slot); }
+				}
+			}
+		}
+	}
+
+	void evict(int32_t slot) {
+		const ChunkLocation loc = chunks[slot].loc;
+		dropSunShadow(slot);
+		index.remove(chunks[slot].loc.key());
+		residentBytes -= chunks[slot].memory_usage();
+		chunks[slot].unload();
+		update_chunk_mask(slot);
+		freeSlots.push_back(slot);
+		invalidateSunShadow(loc);
+		stats.evicted++;
+		version++;
+	}
+
+	// Far chunks drop their voxels and keep only the coarse levels. Coarse chunks that came close again are evicted,
+	// so the next ray that misses them requests them at full resolution. The margin keeps a chunk on the edge from flipping every frame.
+	void updateCoarseChunks() {
+		const float half = CHUNK_WIDTH * 0.5f;
+		for (int32_t slot = 0; slot < static_cast<int32_t>(chunks.size()); slot++) {
+			Chunk& c = chunks[slot];
+			const ChunkStorage storage = c.get_storage();
+			if (storage != CHUNK_PALETTE && storage != CHUNK_FULL && storage != CHUNK_COARSE) { continue; }
+			const vec3 center(c.loc.x * CHUNK_WIDTH + half, c.loc.y * CHUNK_WIDTH + half, c.loc.z * CHUNK_WIDTH + half);
+			const float distance = (center - viewer).length();
+			if (storage == CHUNK_COARSE) {
+				if (distance < coarseDistance - CHUNK_WIDTH) { evict(slot); }
+				continue;
+			}
+			if (distance <= coarseDistance || (holdEdits && c.is_dirty())) { continue; }
+			const size_t bytes = c.memory_usage();
+			if (!c.make_coarse()) { continue; }
+			residentBytes -= bytes - c.memory_usage();
+			invalidateSunShadow(c.loc); // Shadow rays now see the coarse cells
+			version++;
+		}
+	}
+
+	// Works out what the edits leave in the chunk, later ones win where they overlap, and writes the voxels that change in one batch.
+	// The occupancy, coarse levels, chunk mask and cached shadows are then updated once for the whole batch. Returns false if the storage could not grow.
+	bool applyChunkEdits(int32_t slot, const std::vector<VoxelEdit>& edits) {
+		Chunk& chunk = chunks[slot];
+		const int32_t base[3]{ chunk.loc.x * CHUNK_WIDTH, chunk.loc.y * CHUNK_WIDTH, chunk.loc.z * CHUNK_WIDTH };
+		uint32_t values[CHUNK_SIZE];
+		uint64_t touched[CHUNK_SIZE / 64]{};
+		for (const VoxelEdit& e : edits) {
+			int32_t l0[3], l1[3];
+			bool inside = true;
+			for (int i = 0; i < 3; i++) {
+				l0[i] = std::max(e.low[i] - base[i], 0);
+				l1[i] = std::min(e.high[i] - base[i], CHUNK_MASK);
+				inside = inside && l0[i] <= l1[i];
+			}
+			if (!inside) { continue; }
+			const float r2 = e.radius * e.radius;
+			for (int32_t z = l0[2]; z <= l1[2]; z++) {
+				for (int32_t y = l0[1]; y <= l1[1]; y++) {
+					for (int32_t x = l0[0]; x <= l1[0]; x++) {
+						if (e.shape == EDIT_SPHERE) {
+							const float dx = base[0] + x + 0.5f - e.center[0], dy = base[1] + y + 0.5f - e.center[1], dz = base[2] + z + 0.5f - e.center[2];
+							if (dx * dx + dy * dy + dz * dz > r2) { continue; }
+						}
+						const uint32_t i = voxel_index(x, y, z);
+						values[i] = e.value;
+						touched[i >> 6] |= 1ULL << (i & 63);
+					}
+				}
+			}
+		}
+
+		editWrites.clear();
+		for (uint32_t w = 0; w < CHUNK_SIZE / 64; w++) {
+			if (touched[w] == 0) { continue; }
+			for (uint32_t b = 0; b < 64; b++) {
+				const uint32_t i = (w << 6) | b;
+				if (((touched[w] >> b) & 1) && chunk[i] != values[i]) { editWrites.push_back({ i, values[i] }); }
+			}
+		}
+		if (editWrites.empty()) { return true; }
+
+		const size_t bytes = chunk.memory_usage();
+		const bool stored = chunk.set_batch(editWrites.data(), editWrites.size());
+		residentBytes += chunk.memory_usage() - bytes; // Grows with the palette, or shrinks if the batch compacted the chunk
+		update_chunk_mask(slot);
+		invalidateSunShadow(chunk.loc);
+		editStats.chunks++;
+		editStats.voxels += editWrites.size();
+		version++;
+		return stored;
+	}
+
+	// Evicts until the given number of bytes fits into the budget
+	bool makeRoom(size_t bytes, uint32_t minAge) {
+		while (usedBytes() + bytes > memoryBudget) {
+			int32_t victim = nextVictim(minAge);
+			if (victim < 0) { return false; }
+			evict(victim);
+		}
+		return true;
+	}
+
 public:
 	std::vector<Material> materials;
-	vec3 sunDirection = unit_vector({ 4, 10, 7 });
+	vec3 sunDirection = unit_vector({ 4, 10, 7 }); // Cached shadows follow a change at the next begin_frame
+	float coarseDistance = 0.0f; // Chunks farther than this from the camera only keep their coarse levels, 0 keeps every chunk at full resolution
+	bool holdEdits = false; // Set while the world is saved to region files, edited chunks are then neither evicted nor made coarse until they were saved
 
-	World() {}
-	~World() {}
+	World() {
+		for (uint32_t i = 0; i < CHUNK_REQUEST_SIZE; i++) { requests[i].store(CHUNK_KEY_EMPTY, std::memory_order_relaxed); }
+		sunShadowDirection = sunDirection;
+	}
+	~World() { for (int32_t i = 0; i < static_cast<int32_t>(sunShadow.size()); i++) { dropSunShadow(i); } }
 
+	// Synchronously allocates every requested chunk, ChunkStreamer does the same in the background
 	void loadChunks() {
-		int empty = findFirstEmpty();
-		while (empty > -1) {
-			if (toAllocate.size() == 0) { break; }
-			if (!chunks[empty].allocate(toAllocate[toAllocate.size()-1])) { break; }
-			empty = findFirstEmpty();
-		}
-	}
-
-	uint32_t& get_voxel(long x, long y, long z) {
-		// get chunk location and voxel coords in chunk
-		int cx = 0, cy = 0, cz = 0;
-		while (x < -CHUNK_WIDTH) { x += CHUNK_WIDTH; cx--; }
-		while (x >= CHUNK_WIDTH) { x -= CHUNK_WIDTH; cx++; }
-		while (y < -CHUNK_WIDTH) { y += CHUNK_WIDTH; cy--; }
-		while (y >= CHUNK_WIDTH) { y -= CHUNK_WIDTH; cy++; }
-		while (z < -CHUNK_WIDTH) { z += CHUNK_WIDTH; cz--; }
-		while (z >= CHUNK_WIDTH) { z -= CHUNK_WIDTH; cz++; }
-		const uint32_t index = z * CHUNK_WIDTH * CHUNK_WIDTH + y * CHUNK_WIDTH + x;
-
-		// check if a chunk is allocated at this chunk coord
-		int found = -1;
-		int count = 0;
-		for (int i = 0; i < CHUNKS; i++) {
-			if (chunks[i].is_used()) {
-				count++;
-				if (chunks[i].is(cx, cy, cz)) {
-					return chunks[i][index]; // return voxel if found
+		std::vector<ChunkLocation> requested;
+		take_requests(requested);
+		for (const ChunkLocation& loc : requested) {
+			Chunk chunk;
+			if (!chunk.allocate(loc) || !publish_chunk(chunk)) { break; }
+		}
+	}
+
+	// Starts a new frame for the residency tracking, call between frames with the camera position the next frame is rendered from
+	void begin_frame(const vec3& cameraPosition) {
+		frame++;
+		viewer = cameraPosition;
+		if (sunDirection[0] != sunShadowDirection[0] || sunDirection[1] != sunShadowDirection[1] || sunDirection[2] != sunShadowDirection[2]) {
+			for (int32_t i = 0; i < static_cast<int32_t>(sunShadow.size()); i++) { dropSunShadow(i); }
+			sunShadowDirection = sunDirection;
+		}
+		apply_edits();
+		if (coarseDistance > 0.0f) { updateCoarseChunks(); }
+	}
+
+	// Queues edits, safe to call from any thread while rendering. They are applied in the order they were queued by the next begin_frame
+	// or apply_edits, all at once, so a frame never shows only part of them.
+	void queue_edits(const VoxelEdit* edits, size_t count) {
+		std::lock_guard<std::mutex> guard(editLock);
+		queuedEdits.insert(queuedEdits.end(), edits, edits + count);
+	}
+
+	inline void queue_edit(const VoxelEdit& edit) { queue_edits(&edit, 1); }
+	inline void queue_voxel(long x, long y, long z, uint32_t value) { queue_edit(VoxelEdit::voxel(x, y, z, value)); }
+	inline void queue_box(long x0, long y0, long z0, long x1, long y1, long z1, uint32_t value) { queue_edit(VoxelEdit::box(x0, y0, z0, x1, y1, z1, value)); }
+	inline void queue_sphere(const vec3& center, float radius, uint32_t value) { queue_edit(VoxelEdit::sphere(center, radius, value)); }
+
+	// Applies the queued edits one chunk at a time, not safe to use while rendering. Edits for chunks that are not loaded, or only have their
+	// coarse levels, are held and applied as soon as the chunk is published at full resolution, missing chunks are requested.
+	void apply_edits() {
+		{
+			std::lock_guard<std::mutex> guard(editLock);
+			takenEdits.swap(queuedEdits);
+		}
+		editStats = EditStats();
+		editStats.edits = takenEdits.size();
+		if (takenEdits.empty() && heldEdits.empty()) { return; }
+
+		editBatches.swap(heldEdits); // Held edits are older than the queued ones, so they come first
+		for (const VoxelEdit& e : takenEdits) {
+			for (int32_t cz = e.low[2] >> CHUNK_SHIFT; cz <= e.high[2] >> CHUNK_SHIFT; cz++) {
+				for (int32_t cy = e.low[1] >> CHUNK_SHIFT; cy <= e.high[1] >> CHUNK_SHIFT; cy++) {
+					for (int32_t cx = e.low[0] >> CHUNK_SHIFT; cx <= e.high[0] >> CHUNK_SHIFT; cx++) { editBatches[ChunkLocation(cx, cy, cz).key()].push_back(e); }
 				}
 			}
 		}
+		takenEdits.clear();
+
+		for (auto& batch : editBatches) {
+			const int32_t slot = index.find(batch.first);
+			if (slot < 0 || chunks[slot].get_storage() == CHUNK_COARSE) {
+				if (slot < 0) {
+					const ChunkLocation loc = ChunkLocation::from_key(batch.first);
+					request_chunk(loc.x, loc.y, loc.z);
+				}
+				editStats.held += batch.second.size();
+				heldEdits[batch.first].swap(batch.second);
+				continue;
+			}
+			if (!applyChunkEdits(slot, batch.second)) { editStats.failed++; }
+		}
+		editBatches.clear();
+	}
+
+	inline EditStats get_edit_stats() const { return editStats; }
+
+	// Changes how many bytes of chunks may be resident, evicts right away if the new budget is smaller. Not safe to use while rendering.
+	void set_memory_budget(size_t bytes) {
+		memoryBudget = bytes;
+		makeRoom(0, 0);
+	}
+
+	inline size_t get_memory_budget() const { return memoryBudget; }
+
+	ResidencyStats get_residency_stats() const {
+		ResidencyStats s = stats;
+		s.residentChunks = index.size();
+		s.residentBytes = residentBytes;
+		s.budgetBytes = memoryBudget;
+		s.misses = misses.load(std::memory_order_relaxed);
+		s.dropped = dropped.load(std::memory_order_relaxed);
+		s.sunShadowBytes = static_cast<uint64_t>(sunShadowBlocks.load(std::memory_order_relaxed)) * sizeof(SunShadowBlock);
+		for (const Chunk& c : chunks) {
+			switch (c.get_storage()) {
+			case CHUNK_UNIFORM: s.uniformChunks++; break;
+			case CHUNK_PALETTE: s.paletteChunks++; break;
+			case CHUNK_FULL: s.fullChunks++; break;
+			case CHUNK_COARSE: s.coarseChunks++; break;
+			default: break;
+			}
+		}
+		return s;
+	}
+
+	// Queue a chunk for allocation, called from the render threads on a miss.
+	// Lock free, a chunk that is already queued costs a few loads and the set is bounded so a fast camera cannot flood it.
+	void request_chunk(int cx, int cy, int cz) const {
+		const uint64_t key = ChunkLocation(cx, cy, cz).key();
+		uint32_t i = chunk_hash(key, CHUNK_REQUEST_SIZE);
+		for (uint32_t n = 0; n < CHUNK_REQUEST_PROBES; n++) {
+			uint64_t current = requests[i].load(std::memory_order_relaxed);
+			if (current == key) { return; }
+			if (current == CHUNK_KEY_EMPTY) {
+				if (requests[i].compare_exchange_strong(current, key, std::memory_order_relaxed)) {
+					misses.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}
+				if (current == key) { return; }
+			}
+			i = (i + 1) & (CHUNK_REQUEST_SIZE - 1);
+		}
+		dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Moves the requested chunks that are not loaded yet into out and empties the set, call between frames
+	void take_requests(std::vector<ChunkLocation>& out) {
+		out.clear();
+		for (uint32_t i = 0; i < CHUNK_REQUEST_SIZE; i++) {
+			const uint64_t key = requests[i].exchange(CHUNK_KEY_EMPTY, std::memory_order_relaxed);
+			if (key != CHUNK_KEY_EMPTY && index.find(key) < 0) { out.push_back(ChunkLocation::from_key(key)); }
+		}
+	}
+
+	// Makes a fully built chunk visible to the renderer, evicting the least useful chunks that were not used last frame if the budget is full.
+	// Not safe to use while rendering. Returns false if the chunk is already loaded or does not fit, the chunk is left untouched then.
+	bool publish_chunk(Chunk& chunk) {
+		if (!chunk.is_used() || index.find(chunk.loc.key()) > -1) { return false; }
+		const size_t bytes = chunk.memory_usage();
+		if (!makeRoom(bytes, 2)) {
+			stats.rejected++;
+			return false;
+		}
+		int32_t slot = takeFreeSlot();
+		chunks[slot] = std::move(chunk);
+		chunks[slot].touch(frame); // Counts as used so it is not evicted before a ray had the chance to look at it
+		index.insert(chunks[slot].loc.key(), slot);
+		update_chunk_mask(slot);
+		invalidateSunShadow(chunks[slot].loc);
+		residentBytes += bytes;
+		stats.loaded++;
+		version++;
+		const auto held = heldEdits.find(chunks[slot].loc.key()); // Edited before it was loaded, shows up with the edits right away
+		if (held != heldEdits.end()) {
+			if (!applyChunkEdits(slot, held->second)) { editStats.failed++; }
+			heldEdits.erase(held);
+		}
+		return true;
+	}
+
+	// Resident chunks with unsaved edits, or every resident chunk that can be saved. Not safe to use while rendering.
+	void collect_chunks(std::vector<const Chunk*>& out, bool everything) const {
+		out.clear();
+		for (const Chunk& c : chunks) {
+			if (c.record_size() > 0 && (everything || c.is_dirty())) { out.push_back(&c); }
+		}
+	}
+
+	// Called once a chunk's edits are on disk, so it may be evicted again
+	void mark_saved(const ChunkLocation& loc) {
+		const int32_t slot = index.find(loc.key());
+		if (slot > -1) { chunks[slot].mark_saved(); }
+	}
+
+	inline bool is_loaded(int cx, int cy, int cz) const { return index.find(ChunkLocation(cx, cy, cz).key()) > -1; }
+
+	inline uint64_t get_version() const { return version; }
+
+	inline const Chunk* find_chunk(int cx, int cy, int cz) const {
+		int32_t slot = index.find(ChunkLocation(cx, cy, cz).key());
+		if (slot < 0) { return nullptr; }
+		chunks[slot].touch(frame);
+		return &chunks[slot];
+	}
+
+	// Read only voxel lookup for the render threads, returns air and queues the chunk if it is not loaded
+	uint32_t get_voxel(long x, long y, long z) const {
+		const int cx = static_cast<int>(x >> CHUNK_SHIFT), cy = static_cast<int>(y >> CHUNK_SHIFT), cz = static_cast<int>(z >> CHUNK_SHIFT);
+		const Chunk* chunk = find_chunk(cx, cy, cz);
+		threadCounters.voxelLookups++;
+		if (chunk == nullptr) {
+			threadCounters.voxelMisses++;
+			request_chunk(cx, cy, cz);
+			return 0;
+		}
+		return (*chunk)[voxel_index(x, y, z)];
+	}
+
+	// Size of the largest aligned empty cell around the voxel: a whole chunk, a brick or a single voxel
+	int32_t empty_cell_size(long x, long y, long z) const {
+		const int cx = static_cast<int>(x >> CHUNK_SHIFT), cy = static_cast<int>(y >> CHUNK_SHIFT), cz = static_cast<int>(z >> CHUNK_SHIFT);
+		int32_t slot = index.find(ChunkLocation(cx, cy, cz).key());
+		if (slot < 0) {
+			request_chunk(cx, cy, cz);
+			return CHUNK_WIDTH;
+		}
+		chunks[slot].touch(frame);
+		if (!((chunkMask[slot >> 6] >> (slot & 63)) & 1)) { return CHUNK_WIDTH; }
+		return chunks[slot].is_brick_empty(x & CHUNK_MASK, y & CHUNK_MASK, z & CHUNK_MASK) ? BRICK_WIDTH : 1;
+	}
+
+	// Same as empty_cell_size for a chunk that was already looked up (nullptr if not loaded), also returns the value of the cell.
+	// Level asks for a cell of that many halvings above the voxels, chunks without coarse levels or without voxels answer with the closest one they have.
+	static inline int32_t probe_chunk(const Chunk* chunk, long x, long y, long z, uint32_t& voxel, int32_t level = 0) {
+		voxel = 0;
+		if (chunk == nullptr || chunk->is_empty()) { return CHUNK_WIDTH; }
+		level = std::max(std::min(level, chunk->max_level()), chunk->min_level());
+		if (level < BRICK_SHIFT && chunk->is_brick_empty(x & CHUNK_MASK, y & CHUNK_MASK, z & CHUNK_MASK)) { return BRICK_WIDTH; }
+		voxel = chunk->mip(level, x, y, z);
+		return 1 << level;
+	}
+
+	// Cached sun shadow of the voxel, returns false if it was not traced yet
+	inline bool find_sun_shadow(long x, long y, long z, bool& shadowed) const {
+		const int32_t slot = index.find(ChunkLocation(static_cast<int>(x >> CHUNK_SHIFT), static_cast<int>(y >> CHUNK_SHIFT), static_cast<int>(z >> CHUNK_SHIFT)).key());
+		if (slot < 0) { return false; }
+		const SunShadowBlock* block = sunShadow[slot].load(std::memory_order_acquire);
+		if (block == nullptr) { return false; }
+		const uint32_t i = voxel_index(x, y, z);
+		if (!((block->known[i >> 6].load(std::memory_order_acquire) >> (i & 63)) & 1)) { return false; }
+		shadowed = (block->shadowed[i >> 6].load(std::memory_order_relaxed) >> (i & 63)) & 1;
+		return true;
+	}
+
+	// Remembers a traced sun shadow, safe to call from the render threads. Voxels in chunks that are not loaded are not cached.
+	void store_sun_shadow(long x, long y, long z, bool shadowed) const {
+		const int32_t slot = index.find(ChunkLocation(static_cast<int>(x >> CHUNK_SHIFT), static_cast<int>(y >> CHUNK_SHIFT), static_cast<int>(z >> CHUNK_SHIFT)).key());
+		if (slot < 0) { return; }
+		SunShadowBlock* block = sunShadow[slot].load(std::memory_order_acquire);
+		if (block == nullptr) {
+			SunShadowBlock* created = new SunShadowBlock();
+			if (sunShadow[slot].compare_exchange_strong(block, created, std::memory_order_acq_rel)) {
+				block = created;
+				sunShadowBlocks.fetch_add(1, std::memory_order_relaxed);
+			} else {
+				delete created; // Another thread was first, block holds its block now
+			}
+		}
+		const uint32_t i = voxel_index(x, y, z);
+		if (shadowed) { block->shadowed[i >> 6].fetch_or(1ULL << (i & 63), std::memory_order_relaxed); }
+		block->known[i >> 6].fetch_or(1ULL << (i & 63), std::memory_order_release);
+	}
 
-		// return default voxel
-		printf_s("WARNING: Unable to find correct chunk, %d are currently allocated and in use", count);
-		toAllocate.push_back({cx, cy, cz});
-		return _BACKUP_;
+	// Writes a single voxel right away, not safe to use while rendering (queue_voxel is). Returns false if the chunk is not loaded yet.
+	bool set_voxel(long x, long y, long z, uint32_t value) {
+		const int cx = static_cast<int>(x >> CHUNK_SHIFT), cy = static_cast<int>(y >> CHUNK_SHIFT), cz = static_cast<int>(z >> CHUNK_SHIFT);
+		int32_t slot = index.find(ChunkLocation(cx, cy, cz).key());
+		if (slot < 0) {
+			request_chunk(cx, cy, cz);
+			return false;
+		}
+		const size_t bytes = chunks[slot].memory_usage();
+		if (!chunks[slot].set(voxel_index(x, y, z), value)) { return false; }
+		residentBytes += chunks[slot].memory_usage() - bytes; // The storage can grow with a write
+		update_chunk_mask(slot);
+		invalidateSunShadow(chunks[slot].loc);
+		version++;
+		return true;
 	}
-};
\ No newline at end of file
+};
+
+static void init_default_materials(World& world) {
+	world.materials.push_back(Material()); // air
+	world.materials.push_back(Material(SOLID, {0.3f, 0.5f, 0.8f}, 0.3f, 0.3f)); // solid
+	world.materials.push_back(Material(SOLID, {0.8f, 0.3f, 0.5f}, 0.3f, 0.3f)); // reflective
+	world.materials.push_back(Material(SOLID, {0.5f, 0.8f, 0.3f}, 0.3f, 0.3f)); // refractive
+}
\ No newline at end of file
@@ -1,6 +1,15 @@
 #include "VoxelTracer.h"
+#include "Headless.h"
+#include "Benchmark.h"
 
 int main(int argc, char* argv[]) {
+	if (isBenchmark(argc, argv)) { return runBenchmark(argc, argv); }
+	if (isHeadless(argc, argv)) { return runHeadless(argc, argv); }
 	Engine eng;
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--profile") == 0 && !eng.profiler.open(argv[i + 1])) { printf_s("Could not write the profile %s\n", argv[i + 1]); }
+		else if (strcmp(argv[i], "--frames") == 0) { eng.frameLimit = strtoull(argv[i + 1], nullptr, 10); }
+		else if (strcmp(argv[i], "--video-driver") == 0) { SDL_SetHint(SDL_HINT_VIDEODRIVER, argv[i + 1]); } // dummy runs without a display
+	}
 	return eng.execute("test1", 400, 300);
 }
\ No newline at end of file